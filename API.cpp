@@ -5,11 +5,14 @@
 
 static int mozQuicInit = 0;
 
+#include "CryptoPool.h"
 #include "Logging.h"
 #include "MozQuic.h"
 #include "MozQuicInternal.h"
 #include "NSSHelper.h"
+#include "Pool.h"
 #include "Streams.h"
+#include "TicketCache.h"
 
 #include <assert.h>
 #include <strings.h>
@@ -28,6 +31,14 @@ struct mozquic_internal_config_t
   unsigned int forceAddressValidation; // flag
   uint64_t streamWindow;
   uint64_t connWindowKB;
+  uint64_t windowBudgetKB;
+  uint64_t cryptoWorkers;
+  uint64_t handshakeWorkers;
+  unsigned int enable0RTT; // flag
+  uint64_t antiReplayWindow; // ms
+  uint64_t halfOpenThreshold;
+  uint64_t initialRateThreshold; // per second
+  unsigned int noServerModel; // flag
 };
   
 uint32_t mozquic_unstable_api1(struct mozquic_config_t *c, const char *name, uint64_t arg1, uint64_t arg2)
@@ -51,6 +62,24 @@ uint32_t mozquic_unstable_api1(struct mozquic_config_t *c, const char *name, uin
     internal->streamWindow = arg1;
   } else if (!strcasecmp(name, "connWindowKB")) {
     internal->connWindowKB = arg1;
+  } else if (!strcasecmp(name, "windowBudgetKB")) {
+    internal->windowBudgetKB = arg1;
+  } else if (!strcasecmp(name, "cryptoWorkers")) {
+    internal->cryptoWorkers = arg1;
+  } else if (!strcasecmp(name, "handshakeWorkers")) {
+    internal->handshakeWorkers = arg1;
+  } else if (!strcasecmp(name, "enable0RTT")) {
+    // arg2 is the server's anti-replay window in ms
+    internal->enable0RTT = arg1;
+    internal->antiReplayWindow = arg2;
+  } else if (!strcasecmp(name, "addressValidationThreshold")) {
+    // arg1 is half open handshakes, arg2 new connections per second
+    internal->halfOpenThreshold = arg1;
+    internal->initialRateThreshold = arg2;
+  } else if (!strcasecmp(name, "noServerModel")) {
+    // configure each server connection's tls from scratch rather than
+    // from the parent's model socket. only useful for measuring it
+    internal->noServerModel = arg1;
   } else {
     return MOZQUIC_ERR_GENERAL;
   }
@@ -123,6 +152,27 @@ int mozquic_new_connection(mozquic_connection_t **outConnection,
     if (internal->connWindowKB) {
     q->SetConnWindowKB(internal->connWindowKB);
   }
+  if (internal->windowBudgetKB) {
+    q->SetWindowBudgetKB(internal->windowBudgetKB);
+  }
+  if (internal->cryptoWorkers) {
+    q->SetCryptoWorkers(internal->cryptoWorkers);
+  }
+  if (internal->handshakeWorkers) {
+    q->SetHandshakeWorkers(internal->handshakeWorkers);
+  }
+  if (internal->enable0RTT) {
+    q->SetEnable0RTT();
+  }
+  if (internal->antiReplayWindow) {
+    q->SetAntiReplayWindow(internal->antiReplayWindow);
+  }
+  if (internal->halfOpenThreshold || internal->initialRateThreshold) {
+    q->SetAddressValidationThreshold(internal->halfOpenThreshold, internal->initialRateThreshold);
+  }
+  if (internal->noServerModel) {
+    q->SetNoServerModel();
+  }
   
   unsigned char empty[128];
   memset(empty, 0, 128);
@@ -165,6 +215,58 @@ int mozquic_release_backpressure(mozquic_connection_t *conn)
   self->ReleaseBackPressure();
   return MOZQUIC_OK;
 }
+
+int mozquic_ticket_cache_export(void *buf, uint32_t avail, uint32_t *used)
+{
+  if (!used) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  return mozquic::TicketCache::Export((unsigned char *)buf, avail, *used);
+}
+
+int mozquic_ticket_cache_import(const void *buf, uint32_t len)
+{
+  if (!buf && len) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  return mozquic::TicketCache::Import((const unsigned char *)buf, len);
+}
+
+int mozquic_ticket_stats(struct mozquic_ticket_stats *stats)
+{
+  if (!stats) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  mozquic::TicketCache::GetStats(stats);
+  return MOZQUIC_OK;
+}
+
+int mozquic_pool_stats(struct mozquic_pool_stats *stats)
+{
+  if (!stats) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  mozquic::Pool::GetStats(stats);
+  return MOZQUIC_OK;
+}
+
+int mozquic_worker_stats(struct mozquic_worker_stats *stats)
+{
+  if (!stats) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  mozquic::CryptoPool::GetStats(stats);
+  return MOZQUIC_OK;
+}
+
+int mozquic_server_stats(mozquic_connection_t *conn, struct mozquic_server_stats *stats)
+{
+  if (!conn || !stats) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  mozquic::MozQuic *self(reinterpret_cast<mozquic::MozQuic *>(conn));
+  return self->GetServerStats(stats);
+}
   
 int mozquic_start_new_stream(mozquic_stream_t **outStream,
                              mozquic_connection_t *conn, void *data,
@@ -191,6 +293,50 @@ int mozquic_send(mozquic_stream_t *stream, void *data, uint32_t amount,
   return rv;
 }
 
+int mozquic_sendv(mozquic_stream_t *stream, const struct mozquic_iovec *iov,
+                  int iovcnt, int fin)
+{
+  mozquic::StreamPair *self(reinterpret_cast<mozquic::StreamPair *>(stream));
+  if (iovcnt < 0 || (!iov && iovcnt)) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  int rv = self->Writev(iov, iovcnt, fin);
+  if (fin) {
+    self->mMozQuic->MaybeDeleteStream(self);
+  }
+  return rv;
+}
+
+int mozquic_send_zc(mozquic_stream_t *stream, const void *data, uint32_t amount,
+                    int fin, void (*release)(void *, const void *, uint32_t),
+                    void *cookie)
+{
+  mozquic::StreamPair *self(reinterpret_cast<mozquic::StreamPair *>(stream));
+  if (!data && amount) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  int rv = self->WriteExternal((const unsigned char *)data, amount, fin,
+                               release, cookie);
+  if (fin) {
+    self->mMozQuic->MaybeDeleteStream(self);
+  }
+  return rv;
+}
+
+int mozquic_send_file(mozquic_stream_t *stream, int fd, uint64_t offset,
+                      uint64_t len, int fin)
+{
+  mozquic::StreamPair *self(reinterpret_cast<mozquic::StreamPair *>(stream));
+  if (fd < 0) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  int rv = self->WriteFile(fd, offset, len, fin);
+  if (fin) {
+    self->mMozQuic->MaybeDeleteStream(self);
+  }
+  return rv;
+}
+
 int mozquic_end_stream(mozquic_stream_t *stream)
 {
   mozquic::StreamPair *self(reinterpret_cast<mozquic::StreamPair *>(stream));
@@ -230,6 +376,68 @@ int mozquic_recv(mozquic_stream_t *stream, void *data, uint32_t avail,
   return rv;
 }
 
+int mozquic_recvv(mozquic_stream_t *stream, const struct mozquic_iovec *iov,
+                  int iovcnt, uint32_t *amount, int *fin)
+{
+  mozquic::StreamPair *self(reinterpret_cast<mozquic::StreamPair *>(stream));
+  if (iovcnt < 0 || (!iov && iovcnt)) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  bool f;
+  uint32_t a;
+  int rv = self->Readv(iov, iovcnt, a, f);
+  *fin = f;
+  *amount = a;
+  if (f) {
+    self->mMozQuic->MaybeDeleteStream(self);
+  }
+  return rv;
+}
+
+int mozquic_recv_all(mozquic_stream_t *stream, void *data, uint32_t avail,
+                     uint32_t *amount, int *fin, uint64_t *readable)
+{
+  mozquic::StreamPair *self(reinterpret_cast<mozquic::StreamPair *>(stream));
+  bool f;
+  uint32_t a;
+  int rv = self->Read((unsigned char *)data, avail, a, f);
+  *fin = f;
+  *amount = a;
+  *readable = f ? 0 : self->Readable();
+  if (f) {
+    self->mMozQuic->MaybeDeleteStream(self);
+  }
+  return rv;
+}
+
+int mozquic_recv_peek(mozquic_stream_t *stream, const void **data,
+                      uint32_t *amount, int *fin)
+{
+  mozquic::StreamPair *self(reinterpret_cast<mozquic::StreamPair *>(stream));
+  bool f;
+  uint32_t a;
+  const unsigned char *d;
+  int rv = self->Peek(d, a, f);
+  *data = d;
+  *fin = f;
+  *amount = a;
+  if (f && !a) {
+    self->mMozQuic->MaybeDeleteStream(self);
+  }
+  return rv;
+}
+
+int mozquic_recv_consume(mozquic_stream_t *stream, uint32_t amount)
+{
+  mozquic::StreamPair *self(reinterpret_cast<mozquic::StreamPair *>(stream));
+  bool f;
+  int rv = self->Consume(amount, f);
+  if (f) {
+    self->mMozQuic->MaybeDeleteStream(self);
+  }
+  return rv;
+}
+
 int mozquic_set_event_callback(mozquic_connection_t *conn, int (*fx)(mozquic_connection_t *, uint32_t event, void * param))
 {
   mozquic::MozQuic *self(reinterpret_cast<mozquic::MozQuic *>(conn));
@@ -302,6 +510,16 @@ int mozquic_get_streamid(mozquic_stream_t *stream)
   return (reinterpret_cast<mozquic::StreamPair *>(stream))->mStreamID;
 }
 
+int mozquic_set_stream_priority(mozquic_stream_t *stream, int urgency, int incremental)
+{
+  mozquic::StreamPair *self(reinterpret_cast<mozquic::StreamPair *>(stream));
+  if ((urgency < 0) || (urgency >= mozquic::kUrgencyLevels)) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  self->SetPriority(urgency, incremental);
+  return MOZQUIC_OK;
+}
+
 namespace mozquic  {
 
 static const uint32_t kMozQuicVersionGreaseC = 0xfa1a7a3a;
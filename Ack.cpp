@@ -234,6 +234,28 @@ MozQuic::Acknowledge(uint64_t packetNum, keyPhase kp)
   AckScoreboard(packetNum, kp);
 }
 
+void
+MozQuic::UpdateRTT(uint64_t sendTime, uint64_t ackDelay)
+{
+  uint64_t now = Timestamp();
+  if (now < sendTime) {
+    return;
+  }
+  uint64_t sample = now - sendTime;
+  if (sample > ackDelay) {
+    sample -= ackDelay;
+  }
+  if (!sample) {
+    sample = 1; // ms clock, and 0 means no estimate
+  }
+  if (!mSmoothedRTT) {
+    mSmoothedRTT = sample;
+  } else {
+    mSmoothedRTT = (mSmoothedRTT * 7 + sample) / 8;
+  }
+  AckLog7("rtt sample %ld smoothed %ld\n", sample, mSmoothedRTT);
+}
+
 void
 MozQuic::ProcessAck(FrameHeaderData *ackMetaInfo, const unsigned char *framePtr, bool fromCleartext)
 {
@@ -281,6 +303,8 @@ MozQuic::ProcessAck(FrameHeaderData *ackMetaInfo, const unsigned char *framePtr,
     framePtr++;
   } while (1);
 
+  std::vector<std::unique_ptr<ReliableData>> ackedStreamData;
+  uint64_t rttSampleSent = 0;
   auto dataIter = mStreamState->mUnAckedData.begin();
   for (auto iters = numRanges; iters > 0; --iters) {
     uint64_t haveAckFor = ackStack[iters - 1].first;
@@ -304,6 +328,16 @@ MozQuic::ProcessAck(FrameHeaderData *ackMetaInfo, const unsigned char *framePtr,
           assert ((*dataIter)->mPacketNumber == haveAckFor);
           AckLog5("ACK'd data found for %lX (frame type %d)\n",
                   haveAckFor, (*dataIter)->mType);
+          if (haveAckFor == ackMetaInfo->u.mAck.mLargestAcked) {
+            // the record holds the send time of this packet number, even
+            // if the data in it is a retransmission
+            rttSampleSent = (*dataIter)->mTransmitTime;
+          }
+          if ((*dataIter)->mSendBuffer) {
+            // the send buffer may hand memory back to the app, which can
+            // call back into us - so do that after this walk is done
+            ackedStreamData.push_back(std::move(*dataIter));
+          }
           dataIter = mStreamState->mUnAckedData.erase(dataIter);
         } while ((dataIter != mStreamState->mUnAckedData.end()) &&
                  (*dataIter)->mPacketNumber == haveAckFor);
@@ -311,6 +345,15 @@ MozQuic::ProcessAck(FrameHeaderData *ackMetaInfo, const unsigned char *framePtr,
     }
   }
 
+  for (auto i = ackedStreamData.begin(); i != ackedStreamData.end(); ++i) {
+    (*i)->mSendBuffer->Acked((*i)->mOffset, (*i)->mLen);
+  }
+  ackedStreamData.clear();
+
+  if (rttSampleSent) {
+    UpdateRTT(rttSampleSent, ufloat16_decode(ackMetaInfo->u.mAck.mAckDelay) / 1000);
+  }
+
   // todo read the timestamps
   // and obviously todo feed the times into congestion control
 
@@ -0,0 +1,104 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Logging.h"
+#include "MozQuic.h"
+#include "MozQuicInternal.h"
+
+#include <assert.h>
+#include <string.h>
+#include <pk11pub.h>
+#include <sechash.h>
+
+namespace mozquic  {
+
+// An address token is handed to the client in the server transport
+// parameters. When the client offers it back from the same address the
+// server can skip the stateless retry it would otherwise do to validate
+// that address. It is [8 byte expiry ms][hmac-sha256(key, addr | expiry)]
+// and only the parent's token key, fresh from the NSS rng for each
+// server, can make one. The port is left out because clients come back
+// from new ones.
+
+uint32_t
+MozQuic::AddressTokenEnsureKey()
+{
+  assert(!mIsChild && !mIsClient);
+  if (mAddressTokenKey) {
+    return MOZQUIC_OK;
+  }
+  unsigned char raw[32];
+  if (PK11_GenerateRandom(raw, sizeof(raw)) != SECSuccess) {
+    return MOZQUIC_ERR_CRYPTO;
+  }
+  SECItem item = {siBuffer, raw, sizeof(raw)};
+  PK11SlotInfo *slot = PK11_GetInternalSlot();
+  mAddressTokenKey = PK11_ImportSymKey(slot, CKM_SHA256_HMAC, PK11_OriginUnwrap,
+                                       CKA_SIGN, &item, nullptr);
+  PK11_FreeSlot(slot);
+  memset(raw, 0, sizeof(raw));
+  return mAddressTokenKey ? MOZQUIC_OK : MOZQUIC_ERR_CRYPTO;
+}
+
+bool
+MozQuic::AddressTokenMake(unsigned char *out)
+{
+  assert(mIsChild && !mIsClient);
+  uint64_t expires = PR_htonll(Timestamp() + kAddressTokenLifetime);
+  memcpy(out, &expires, sizeof(expires));
+  return AddressTokenTag(out, out + sizeof(expires));
+}
+
+bool
+MozQuic::AddressTokenCheck(const unsigned char *token, uint32_t len)
+{
+  assert(mIsChild && !mIsClient);
+  if (len != kAddressTokenSize) {
+    ConnectionLog5("address token wrong size %d\n", len);
+    return false;
+  }
+  uint64_t expires;
+  memcpy(&expires, token, sizeof(expires));
+  if (PR_ntohll(expires) < Timestamp()) {
+    ConnectionLog5("address token expired\n");
+    return false;
+  }
+  unsigned char tag[SHA256_LENGTH];
+  if (!AddressTokenTag(token, tag) ||
+      NSS_SecureMemcmp(tag, token + sizeof(expires), sizeof(tag))) {
+    ConnectionLog1("address token wrong\n");
+    return false;
+  }
+  ConnectionLog5("address token verified\n");
+  return true;
+}
+
+bool
+MozQuic::AddressTokenTag(const unsigned char *expires, unsigned char *out)
+{
+  assert(kAddressTokenSize == sizeof(uint64_t) + SHA256_LENGTH);
+  assert (mPeer.sin_family == AF_INET); // todo - need v6 support in server
+  if (!mParent->mAddressTokenKey) {
+    return false;
+  }
+
+  SECItem noParam = {siBuffer, nullptr, 0};
+  PK11Context *context = PK11_CreateContextBySymKey(CKM_SHA256_HMAC, CKA_SIGN,
+                                                    mParent->mAddressTokenKey, &noParam);
+  if (!context) {
+    return false;
+  }
+  unsigned int tagLen = 0;
+  bool ok = (PK11_DigestBegin(context) == SECSuccess) &&
+    (PK11_DigestOp(context, reinterpret_cast<const unsigned char *>(&mPeer.sin_addr.s_addr),
+                   sizeof(uint32_t)) == SECSuccess) &&
+    (PK11_DigestOp(context, expires, sizeof(uint64_t)) == SECSuccess) &&
+    (PK11_DigestFinal(context, out, &tagLen, SHA256_LENGTH) == SECSuccess) &&
+    (tagLen == SHA256_LENGTH);
+  PK11_DestroyContext(context, PR_TRUE);
+  return ok;
+}
+
+}
@@ -117,6 +117,7 @@ MozQuic::FlushStream0(bool forceAck)
 
   // then padding as needed up to mtu on client_initial
   uint32_t finalLen;
+  bool retried = false;
 
   if ((pkt[0] & 0x7f) == PACKET_TYPE_CLIENT_INITIAL) {
     finalLen = (framePtr - pkt) + 8;
@@ -125,12 +126,10 @@ MozQuic::FlushStream0(bool forceAck)
     }
   } else if (mConnectionState == SERVER_STATE_SSR) {
     finalLen = ((framePtr - pkt) + 8);
-    mConnectionState = SERVER_STATE_1RTT;
+    mConnectionState = SERVER_STATE_CLOSED;
+    retried = true;
     mStreamState->mUnAckedData.clear();
     assert(mStreamState->mConnUnWritten.empty());
-    if (mConnEventCB) {
-      mConnEventCB(mClosure, MOZQUIC_EVENT_ERROR, this);
-    }
   } else {
     uint32_t room = endpkt - framePtr - 8; // the last 8 are for checksum
     uint32_t used;
@@ -154,6 +153,9 @@ MozQuic::FlushStream0(bool forceAck)
     hash = PR_htonll(hash);
     memcpy(framePtr, &hash, kFNV64Size);
     uint32_t code = Transmit(pkt, finalLen, nullptr);
+    if (retried) {
+      StatelessRetrySent();
+    }
     if (code != MOZQUIC_OK) {
       return code;
     }
@@ -213,6 +215,11 @@ MozQuic::ProcessServerStatelessRetry(unsigned char *pkt, uint32_t pktSize, LongH
                                               kMaxStreamDataDefault,
                                               mStreamState->mLocalMaxStreamData));
   mSetupTransportExtension = false;
+  if (mConnectionState == CLIENT_STATE_0RTT) {
+    // nss rejects early data after a retry. it is resent once connected
+    mStreamState->RetransmitEarlyData();
+    mConnectionState = CLIENT_STATE_1RTT;
+  }
   mStreamState->mUnAckedData.clear();
   mStreamState->mConnUnWritten.clear();
   SetInitialPacketNumber();
@@ -296,6 +303,11 @@ MozQuic::ProcessVersionNegotiation(unsigned char *pkt, uint32_t pktSize, LongHea
                                                 kMaxStreamDataDefault,
                                                 mStreamState->mLocalMaxStreamData));
     mSetupTransportExtension  = false;
+    if (mConnectionState == CLIENT_STATE_0RTT) {
+      // the early packets used the old version. resent once connected
+      mStreamState->RetransmitEarlyData();
+      mConnectionState = CLIENT_STATE_1RTT;
+    }
     mStreamState->mUnAckedData.clear();
     
     return MOZQUIC_OK;
@@ -397,10 +409,13 @@ MozQuic::ProcessClientInitial(unsigned char *pkt, uint32_t pktSize,
       }
     }
   }
+  UpdateHandshakeLoad(); // before the child's tls is set up
   MozQuic *child = Accept(clientAddr, header.mConnectionID, header.mPacketNumber);
   assert(!mIsChild);
   assert(!mIsClient);
   mChildren.emplace_back(child->mAlive);
+  child->mCountedHalfOpen = true;
+  mHalfOpen++;
   child->ProcessGeneralDecoded(pkt + 17, pktSize - 17 - 8, sendAck, true);
   child->mConnectionState = SERVER_STATE_1RTT;
 
@@ -413,6 +428,68 @@ MozQuic::ProcessClientInitial(unsigned char *pkt, uint32_t pktSize,
   return MOZQUIC_OK;
 }
 
+void
+MozQuic::UpdateHandshakeLoad()
+{
+  // stateless retry goes on above either threshold, and off again once
+  // both are down to half of it and it has been on for a while
+  if (!mHalfOpenThreshold && !mInitialRateThreshold) {
+    return;
+  }
+
+  uint64_t now = Timestamp();
+  if (now - mInitialRateStart >= 1000) {
+    mInitialRateLast = (now - mInitialRateStart < 2000) ? mInitialRateCount : 0;
+    mInitialRateStart = now;
+    mInitialRateCount = 0;
+  }
+  mInitialRateCount++;
+  uint32_t rate = (mInitialRateLast > mInitialRateCount) ? mInitialRateLast : mInitialRateCount;
+
+  bool over = (mHalfOpenThreshold && mHalfOpen > mHalfOpenThreshold) ||
+    (mInitialRateThreshold && rate > mInitialRateThreshold);
+  bool under = (!mHalfOpenThreshold || mHalfOpen <= mHalfOpenThreshold / 2) &&
+    (!mInitialRateThreshold || rate <= mInitialRateThreshold / 2);
+
+  if (over) {
+    if (!mLoadAddressValidation) {
+      HandshakeLog2("handshake load %d half open %d per second. stateless retry on\n",
+                    mHalfOpen, rate);
+      mLoadAddressValidation = true;
+    }
+    mLoadAddressValidationSince = now;
+  } else if (mLoadAddressValidation && under &&
+             (now - mLoadAddressValidationSince >= kAddressValidationHold)) {
+    HandshakeLog2("handshake load %d half open %d per second. stateless retry off\n",
+                  mHalfOpen, rate);
+    mLoadAddressValidation = false;
+  }
+}
+
+void
+MozQuic::HalfOpenDone()
+{
+  if (mCountedHalfOpen) {
+    assert(mParent && mParent->mHalfOpen);
+    mCountedHalfOpen = false;
+    mParent->mHalfOpen--;
+  }
+}
+
+// server child. The client comes back from a stateless retry as a new
+// connection, so this one is unlinked and freed once the retry is out
+// rather than held by the parent until it goes away.
+void
+MozQuic::StatelessRetrySent()
+{
+  HalfOpenDone();
+  if (mConnEventCB) {
+    mConnEventCB(mClosure, MOZQUIC_EVENT_ERROR, this);
+  }
+  // the app may have destroyed it from the callback already
+  Destroy(0, "");
+}
+
 int
 MozQuic::ProcessClientCleartext(unsigned char *pkt, uint32_t pktSize, LongHeaderData &header, bool &sendAck)
 {
@@ -0,0 +1,211 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "CryptoPool.h"
+
+#include <assert.h>
+
+namespace mozquic  {
+
+static std::atomic<uint64_t> sWorkerCryptoJobs(0);
+static std::atomic<uint64_t> sWorkerHandshakes(0);
+
+void
+CryptoTask::Wait()
+{
+  if (mDone.load(std::memory_order_acquire)) {
+    return;
+  }
+  // not done means it is on a worker, whose pool is still around
+  assert(mCompletion);
+  mCompletion->Wait(this);
+}
+
+void
+CryptoCompletion::Wait(CryptoTask *task)
+{
+  mWaiters++;
+  {
+    std::unique_lock<std::mutex> lock(mLock);
+    mWake.wait(lock, [task] { return task->mDone.load(); });
+  }
+  mWaiters--;
+}
+
+void
+CryptoCompletion::Finished()
+{
+  // pairs with the increment in Wait before it looks at mDone, so either
+  // the waiter sees the task done or this sees the waiter
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (mWaiters.load()) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mWake.notify_all();
+  }
+}
+
+void
+CryptoJob::Reset(NSSHelper *helper, bool encrypt)
+{
+  mHelper = helper;
+  mEncrypt = encrypt;
+  mCount = 0;
+  mResult = MOZQUIC_OK;
+  mCompletion = nullptr;
+  mDone.store(false, std::memory_order_relaxed);
+}
+
+void
+CryptoJob::Prepare()
+{
+  for (uint32_t i = 0; i < mCount; i++) {
+    Packet &p = mPackets[i];
+    unsigned char *data = p.mPkt + p.mHeaderLen;
+    NSSHelper::PacketBlock &b = mBlocks[i];
+    b.mAAD = p.mPkt;
+    b.mAADLen = p.mHeaderLen;
+    b.mData = data;
+    b.mDataLen = p.mDataLen;
+    b.mPacketNumber = p.mPacketNumber;
+    b.mOut = data;
+    b.mOutAvail = mEncrypt ? (p.mMTU - p.mHeaderLen) : p.mDataLen;
+    b.mWritten = 0;
+    b.mResult = MOZQUIC_OK;
+  }
+}
+
+void
+CryptoJob::Run(int worker)
+{
+  if (worker < 0) {
+    mResult = mEncrypt ? mHelper->EncryptBatch(mBlocks, mCount) :
+      mHelper->DecryptBatch(mBlocks, mCount);
+  } else {
+    mResult = mHelper->WorkerBatch(worker, mEncrypt, mBlocks, mCount);
+    sWorkerCryptoJobs++;
+  }
+  mDone.store(true, std::memory_order_release);
+}
+
+void
+HandshakeTask::Run(int worker)
+{
+  // the handshake keeps no per worker state
+  mResult = mHelper->DriveHandshake();
+  if (worker >= 0) {
+    sWorkerHandshakes++;
+  }
+  mDone.store(true, std::memory_order_release);
+}
+
+CryptoPool::CryptoPool(uint32_t workers)
+  : mNext(0)
+{
+  assert(workers);
+  for (uint32_t i = 0; i < workers; i++) {
+    mWorkers.emplace_back(new Worker(i, &mCompletion));
+  }
+}
+
+CryptoPool::~CryptoPool()
+{
+  mWorkers.clear();
+}
+
+void
+CryptoPool::GetStats(struct mozquic_worker_stats *stats)
+{
+  stats->cryptoJobs = sWorkerCryptoJobs;
+  stats->handshakes = sWorkerHandshakes;
+}
+
+void
+CryptoPool::Submit(CryptoTask *task)
+{
+  task->mCompletion = &mCompletion;
+  uint32_t count = mWorkers.size();
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t idx = (mNext + i) % count;
+    if (mWorkers[idx]->Push(task)) {
+      mNext = (idx + 1) % count;
+      return;
+    }
+  }
+  // every ring is full - the connection is further ahead than the
+  // workers can go, so just do this one here
+  task->Run(-1);
+}
+
+CryptoPool::Worker::Worker(uint32_t index, CryptoCompletion *completion)
+  : mIndex(index)
+  , mCompletion(completion)
+  , mHead(0)
+  , mTail(0)
+  , mSleeping(false)
+  , mStop(false)
+{
+  mThread = std::thread(&CryptoPool::Worker::Run, this);
+}
+
+CryptoPool::Worker::~Worker()
+{
+  mStop.store(true);
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    mWake.notify_one();
+  }
+  mThread.join();
+}
+
+bool
+CryptoPool::Worker::Push(CryptoTask *task)
+{
+  uint32_t tail = mTail.load(std::memory_order_relaxed);
+  if (tail - mHead.load(std::memory_order_acquire) == kCryptoRingSize) {
+    return false;
+  }
+  mRing[tail & (kCryptoRingSize - 1)] = task;
+  mTail.store(tail + 1);
+  // pairs with the store to mSleeping before the worker's last look at
+  // mTail, so one side always sees the other
+  if (mSleeping.load()) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mWake.notify_one();
+  }
+  return true;
+}
+
+void
+CryptoPool::Worker::Run()
+{
+  uint32_t idle = 0;
+  while (true) {
+    uint32_t head = mHead.load(std::memory_order_relaxed);
+    if (head != mTail.load(std::memory_order_acquire)) {
+      mRing[head & (kCryptoRingSize - 1)]->Run(mIndex);
+      mHead.store(head + 1, std::memory_order_release);
+      mCompletion->Finished();
+      idle = 0;
+      continue;
+    }
+    if (mStop.load()) {
+      return; // only once the ring is drained
+    }
+    if (++idle < 64) {
+      // bursts usually come in several jobs - don't sleep between them
+      std::this_thread::yield();
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mLock);
+    mSleeping.store(true);
+    mWake.wait(lock, [this] {
+        return mStop.load() || (mHead.load(std::memory_order_relaxed) != mTail.load());
+      });
+    mSleeping.store(false);
+    idle = 0;
+  }
+}
+
+} // namespace
@@ -0,0 +1,154 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "MozQuic.h"
+#include "NSSHelper.h"
+#include "Packetization.h"
+
+namespace mozquic  {
+
+enum {
+  kCryptoBatch = 8,     // packets per job
+  kCryptoRingSize = 64, // jobs queued per worker, power of 2
+};
+
+class CryptoCompletion;
+
+// CryptoTask is anything a CryptoPool worker runs. Only mDone crosses
+// threads - everything else is written before the task is submitted and
+// read by its owner after mDone is seen.
+class CryptoTask
+{
+public:
+  CryptoTask() : mDone(false), mCompletion(nullptr) {}
+  virtual ~CryptoTask() {}
+  // worker < 0 runs on the submitting thread. Sets mDone when finished
+  virtual void Run(int worker) = 0;
+  // the owner blocks here until mDone instead of spinning on it
+  void Wait();
+
+  std::atomic<bool> mDone;
+  CryptoCompletion *mCompletion; // set by CryptoPool::Submit
+};
+
+// CryptoCompletion wakes owners blocked in CryptoTask::Wait(). A worker
+// only takes the lock when someone is waiting, and never touches the task
+// once its mDone is set - the owner may free it right then.
+class CryptoCompletion
+{
+public:
+  CryptoCompletion() : mWaiters(0) {}
+  void Wait(CryptoTask *task);
+  void Finished(); // by a worker, after a task has set mDone
+
+private:
+  std::atomic<uint32_t>   mWaiters;
+  std::mutex              mLock;
+  std::condition_variable mWake;
+};
+
+// CryptoJob is one batch of packets to be sealed or opened. The packet
+// buffers belong to the job, so the connection can build or read the
+// next batch while this one is on a worker.
+class CryptoJob : public CryptoTask
+{
+public:
+  struct Packet
+  {
+    unsigned char mPkt[kMaxMTU];
+    uint32_t      mHeaderLen;
+    uint32_t      mDataLen; // plaintext when sealing, ciphertext when opening
+    uint32_t      mMTU;     // sealing only
+    uint64_t      mPacketNumber;
+    unsigned char mResetCheck[25]; // opening only - see ProcessGeneral
+  };
+
+  CryptoJob() : mHelper(nullptr), mEncrypt(true), mCount(0),
+                mResult(MOZQUIC_OK) {}
+
+  void Reset(NSSHelper *helper, bool encrypt);
+  // point the blocks at the packets, in place
+  void Prepare();
+  // worker < 0 uses the connection's own contexts
+  void Run(int worker) override;
+
+  NSSHelper *mHelper;
+  bool       mEncrypt;
+  uint32_t   mCount;
+  Packet     mPackets[kCryptoBatch];
+  NSSHelper::PacketBlock mBlocks[kCryptoBatch];
+  uint32_t   mResult;
+};
+
+// HandshakeTask is one NSSHelper::DriveHandshake() call. The helper must
+// be in handshake offload mode so the TLS layer never calls back into
+// the connection from the worker.
+class HandshakeTask : public CryptoTask
+{
+public:
+  HandshakeTask(NSSHelper *helper) : mHelper(helper), mResult(MOZQUIC_OK) {}
+  void Run(int worker) override;
+
+  NSSHelper *mHelper;
+  uint32_t   mResult;
+};
+
+// CryptoPool is a few threads that run CryptoTasks. Each worker is fed by
+// a lock free single producer / single consumer ring, so Submit must
+// always be called from the same thread - the one that drives IO() for
+// the connection that owns the pool and its children. Completion is just
+// the task's mDone flag; the connection keeps its jobs in order and picks
+// them up from the front, or block in its Wait().
+class CryptoPool
+{
+public:
+  CryptoPool(uint32_t workers);
+  ~CryptoPool(); // runs whatever was submitted, then joins the workers
+
+  uint32_t Workers() { return mWorkers.size(); }
+  void Submit(CryptoTask *task);
+
+  // tasks that have run on a worker thread, over every pool
+  static void GetStats(struct mozquic_worker_stats *stats);
+
+private:
+  class Worker
+  {
+  public:
+    Worker(uint32_t index, CryptoCompletion *completion);
+    ~Worker();
+
+    bool Push(CryptoTask *task);
+
+  private:
+    void Run();
+
+    uint32_t   mIndex;
+    CryptoCompletion *mCompletion;
+    CryptoTask *mRing[kCryptoRingSize];
+    std::atomic<uint32_t> mHead; // next to run, advanced by the worker
+    std::atomic<uint32_t> mTail; // next free, advanced by the producer
+    std::atomic<bool>     mSleeping;
+    std::atomic<bool>     mStop;
+    std::mutex              mLock; // only for sleeping
+    std::condition_variable mWake;
+    std::thread             mThread;
+  };
+
+  CryptoCompletion mCompletion; // outlives the workers
+  std::vector<std::unique_ptr<Worker>> mWorkers;
+  uint32_t mNext;
+};
+
+} // namespace
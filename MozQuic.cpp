@@ -7,8 +7,10 @@
 #include "Logging.h"
 #include "MozQuic.h"
 #include "MozQuicInternal.h"
+#include "CryptoPool.h"
 #include "NSSHelper.h"
 #include "Streams.h"
+#include "TicketCache.h"
 #include "TransportExtension.h"
 
 #include "assert.h"
@@ -45,6 +47,7 @@ MozQuic::MozQuic(bool handleIO)
   , mBackPressure(false)
   , mConnectionState(STATE_UNINITIALIZED)
   , mOriginPort(-1)
+  , mAddressTokenKey(nullptr)
   , mVersion(kMozQuicVersion1)
   , mClientOriginalOfferedVersion(0)
   , mMTU(kInitialMTU)
@@ -66,6 +69,23 @@ MozQuic::MozQuic(bool handleIO)
   , mPeerIdleTimeout(kIdleTimeoutDefault)
   , mAdvertiseStreamWindow(kMaxStreamDataDefault)
   , mAdvertiseConnectionWindowKB(kMaxDataDefault >> 10)
+  , mWindowBudgetKB(kWindowBudgetDefault >> 10)
+  , mSmoothedRTT(0)
+  , mCryptoWorkers(0)
+  , mHandshakeWorkers(0)
+  , mEnable0RTT(false)
+  , mAntiReplayWindow(kAntiReplayWindowDefault)
+  , mHalfOpenThreshold(0)
+  , mInitialRateThreshold(0)
+  , mHalfOpen(0)
+  , mInitialRateStart(0)
+  , mInitialRateCount(0)
+  , mInitialRateLast(0)
+  , mLoadAddressValidation(false)
+  , mLoadAddressValidationSince(0)
+  , mCountedHalfOpen(false)
+  , mServerModel(nullptr)
+  , mNoServerModel(false)
 {
   Log::sParseSubscriptions(getenv("MOZQUIC_LOG"));
   
@@ -84,9 +104,26 @@ MozQuic::MozQuic(bool handleIO)
 
 MozQuic::~MozQuic()
 {
+  // tasks still on a worker point into mNSSHelper
+  for (auto i = mCryptoTransmits.begin(); i != mCryptoTransmits.end(); ++i) {
+    (*i)->Wait();
+  }
+  for (auto i = mCryptoReceives.begin(); i != mCryptoReceives.end(); ++i) {
+    (*i)->Wait();
+  }
+  if (mHandshakeTask) {
+    mHandshakeTask->Wait();
+  }
+
   if (!mIsChild && (mFD != MOZQUIC_SOCKET_BAD)) {
     close(mFD);
   }
+  if (mServerModel) {
+    PR_Close(mServerModel);
+  }
+  if (mAddressTokenKey) {
+    PK11_FreeSymKey(mAddressTokenKey);
+  }
 }
 
 void
@@ -156,11 +193,30 @@ MozQuic::ProtectedTransmit(unsigned char *header, uint32_t headerLen,
     return MOZQUIC_OK;
   }
 
+  // the payload is built right behind the header, so encrypt it where it
+  // sits and send the whole thing from there
+  assert(data == header + headerLen);
+
+  if (mTransmitJob && (header == mTransmitJob->mPackets[mTransmitJob->mCount].mPkt)) {
+    CryptoJob::Packet &slot = mTransmitJob->mPackets[mTransmitJob->mCount++];
+    slot.mHeaderLen = headerLen;
+    slot.mDataLen = dataLen;
+    slot.mMTU = MTU;
+    slot.mPacketNumber = mNextTransmitPacketNumber;
+    mNextTransmitPacketNumber++;
+    if (mTransmitJob->mCount == kCryptoBatch) {
+      return TransmitQueueSubmit();
+    }
+    return MOZQUIC_OK;
+  }
+  if ((mTransmitJob && mTransmitJob->mCount) || !mCryptoTransmits.empty()) {
+    // don't let this packet pass the ones numbered before it
+    TransmitQueueFlush();
+  }
+
   uint32_t written = 0;
-  unsigned char cipherPkt[kMaxMTU];
-  memcpy(cipherPkt, header, headerLen);
   uint32_t rv = mNSSHelper->EncryptBlock(header, headerLen, data, dataLen,
-                                         mNextTransmitPacketNumber, cipherPkt + headerLen,
+                                         mNextTransmitPacketNumber, data,
                                          MTU - headerLen, written);
 
   ConnectionLog6("encrypt[%lX] rv=%d inputlen=%d (+%d of aead) outputlen=%d\n",
@@ -171,7 +227,7 @@ MozQuic::ProtectedTransmit(unsigned char *header, uint32_t headerLen,
     return rv;
   }
 
-  rv = Transmit(cipherPkt, written + headerLen, nullptr);
+  rv = Transmit(header, written + headerLen, nullptr);
   if (rv != MOZQUIC_OK) {
     return rv;
   }
@@ -183,10 +239,349 @@ MozQuic::ProtectedTransmit(unsigned char *header, uint32_t headerLen,
   return MOZQUIC_OK;
 }
 
+unsigned char *
+MozQuic::TransmitQueueSlot()
+{
+  if (!mTransmitJob) {
+    mTransmitJob = NewCryptoJob(true);
+  }
+  return mTransmitJob->mPackets[mTransmitJob->mCount].mPkt;
+}
+
+uint32_t
+MozQuic::TransmitQueueSubmit()
+{
+  if (!mTransmitJob || !mTransmitJob->mCount) {
+    return MOZQUIC_OK;
+  }
+  mTransmitJob->mHelper = mNSSHelper.get();
+  mTransmitJob->Prepare();
+
+  CryptoPool *pool = GetCryptoPool();
+  if (pool && mNSSHelper->PacketProtectionReady()) {
+    mNSSHelper->SetCryptoWorkers(pool->Workers());
+    pool->Submit(mTransmitJob.get());
+    mCryptoTransmits.push_back(std::move(mTransmitJob));
+    return TransmitCompleted(false);
+  }
+
+  uint32_t rv = TransmitCompleted(true);
+  mTransmitJob->Run(-1);
+  uint32_t rv2 = TransmitSealed(mTransmitJob.get());
+  mTransmitJob->Reset(nullptr, true);
+  return (rv != MOZQUIC_OK) ? rv : rv2;
+}
+
+uint32_t
+MozQuic::TransmitQueueFlush()
+{
+  uint32_t rv = TransmitQueueSubmit();
+  uint32_t rv2 = TransmitCompleted(true);
+  return (rv != MOZQUIC_OK) ? rv : rv2;
+}
+
+uint32_t
+MozQuic::TransmitSealed(CryptoJob *job)
+{
+  for (uint32_t i = 0; i < job->mCount; i++) {
+    NSSHelper::PacketBlock &b = job->mBlocks[i];
+    ConnectionLog6("encrypt[%lX] rv=%d inputlen=%d (+%d of aead) outputlen=%d\n",
+                   b.mPacketNumber, b.mResult, b.mDataLen, b.mAADLen, b.mWritten);
+  }
+  if (job->mResult != MOZQUIC_OK) {
+    RaiseError(MOZQUIC_ERR_CRYPTO, (char *) "unexpected encrypt fail");
+    return job->mResult;
+  }
+
+  for (uint32_t i = 0; i < job->mCount; i++) {
+    uint32_t len = job->mPackets[i].mHeaderLen + job->mBlocks[i].mWritten;
+    uint32_t rv = Transmit(job->mPackets[i].mPkt, len, nullptr);
+    if (rv != MOZQUIC_OK) {
+      return rv;
+    }
+    ConnectionLog5("TRANSMIT[%lX] this=%p len=%d\n",
+                   job->mBlocks[i].mPacketNumber, this, len);
+  }
+  return MOZQUIC_OK;
+}
+
+uint32_t
+MozQuic::TransmitCompleted(bool wait)
+{
+  uint32_t rv = MOZQUIC_OK;
+  while (!mCryptoTransmits.empty()) {
+    if (!mCryptoTransmits.front()->mDone.load(std::memory_order_acquire)) {
+      if (!wait) {
+        break;
+      }
+      mCryptoTransmits.front()->Wait();
+    }
+    std::unique_ptr<CryptoJob> job(std::move(mCryptoTransmits.front()));
+    mCryptoTransmits.pop_front();
+    uint32_t code = TransmitSealed(job.get());
+    if (rv == MOZQUIC_OK) {
+      rv = code;
+    }
+    RecycleCryptoJob(job);
+  }
+  return rv;
+}
+
+CryptoPool *
+MozQuic::GetCryptoPool()
+{
+  if (mParent) {
+    return mParent->GetCryptoPool();
+  }
+  if (!mCryptoPool && mCryptoWorkers) {
+    mCryptoPool.reset(new CryptoPool(mCryptoWorkers));
+  }
+  return mCryptoPool.get();
+}
+
+std::unique_ptr<CryptoJob>
+MozQuic::NewCryptoJob(bool encrypt)
+{
+  std::unique_ptr<CryptoJob> job;
+  if (!mSpareCryptoJobs.empty()) {
+    job = std::move(mSpareCryptoJobs.back());
+    mSpareCryptoJobs.pop_back();
+  } else {
+    job.reset(new CryptoJob());
+  }
+  job->Reset(nullptr, encrypt);
+  return job;
+}
+
+void
+MozQuic::RecycleCryptoJob(std::unique_ptr<CryptoJob> &job)
+{
+  // enough to keep every worker busy without holding on to a burst
+  if (mSpareCryptoJobs.size() < 8) {
+    mSpareCryptoJobs.push_back(std::move(job));
+  }
+  job.reset();
+}
+
+uint32_t
+MozQuic::ReceiveProtected(unsigned char *pkt, uint32_t pktSize, uint32_t headerSize,
+                          uint64_t packetNum, bool &sendAck)
+{
+  if (mHandshakeTask) {
+    // the handshake is on a worker, or done but not yet picked up by
+    // Server1RTT(). Nothing is delivered before the CONNECTED event, so
+    // leave this one to be retransmitted
+    ConnectionLog5("protected packet %lX dropped during offloaded handshake\n", packetNum);
+    return MOZQUIC_OK;
+  }
+  CryptoPool *pool = GetCryptoPool();
+  if (!pool || (pktSize > kMaxMTU) || !mNSSHelper || !mNSSHelper->PacketProtectionReady() ||
+      mConnectionState == CLIENT_STATE_CLOSED || mConnectionState == SERVER_STATE_CLOSED) {
+    if (mReceiveJob || !mCryptoReceives.empty()) {
+      ReceiveQueueFlush(); // keep arrival order
+    }
+    uint32_t rv = ProcessGeneral(pkt, pktSize, headerSize, packetNum, sendAck);
+    if (rv == MOZQUIC_OK) {
+      Acknowledge(packetNum, keyPhase1Rtt);
+    }
+    return rv;
+  }
+
+  // open it on the pool. It is processed and acked by ReceiveCompleted()
+  if (!mReceiveJob) {
+    mReceiveJob = NewCryptoJob(false);
+  }
+  CryptoJob::Packet &p = mReceiveJob->mPackets[mReceiveJob->mCount++];
+  memcpy(p.mPkt, pkt, pktSize);
+  memcpy(p.mResetCheck, pkt, (pktSize < sizeof(p.mResetCheck)) ? pktSize : sizeof(p.mResetCheck));
+  p.mHeaderLen = headerSize;
+  p.mDataLen = pktSize - headerSize;
+  p.mMTU = 0;
+  p.mPacketNumber = packetNum;
+  if (mReceiveJob->mCount == kCryptoBatch) {
+    ReceiveQueueSubmit();
+  }
+  return MOZQUIC_OK;
+}
+
+void
+MozQuic::ReceiveQueueSubmit()
+{
+  if (!mReceiveJob) {
+    return;
+  }
+  CryptoPool *pool = GetCryptoPool();
+  assert(pool);
+  mReceiveJob->mHelper = mNSSHelper.get();
+  mReceiveJob->Prepare();
+  mNSSHelper->SetCryptoWorkers(pool->Workers());
+  pool->Submit(mReceiveJob.get());
+  mCryptoReceives.push_back(std::move(mReceiveJob));
+}
+
+void
+MozQuic::ReceiveOpened(CryptoJob *job)
+{
+  for (uint32_t i = 0; i < job->mCount; i++) {
+    CryptoJob::Packet &p = job->mPackets[i];
+    NSSHelper::PacketBlock &b = job->mBlocks[i];
+    if (mConnectionState == CLIENT_STATE_CLOSED ||
+        mConnectionState == SERVER_STATE_CLOSED) {
+      ConnectionLog4("processgeneral discarding %lX as closed\n", p.mPacketNumber);
+      continue;
+    }
+    ConnectionLog6("decrypt (pktnum=%lX) rv=%d sz=%d\n", p.mPacketNumber, b.mResult, b.mWritten);
+    if (b.mResult != MOZQUIC_OK) {
+      ConnectionLog1("decrypt failed\n");
+      StatelessResetCheckForReceipt(p.mResetCheck, p.mHeaderLen + p.mDataLen);
+      continue;
+    }
+    bool sendAck = false;
+    if (ProcessGeneralDecrypted(b.mOut, b.mWritten, sendAck) == MOZQUIC_OK) {
+      Acknowledge(p.mPacketNumber, keyPhase1Rtt);
+      if (sendAck) {
+        MaybeSendAck();
+      }
+    }
+  }
+}
+
+void
+MozQuic::ReceiveCompleted(bool wait)
+{
+  while (!mCryptoReceives.empty()) {
+    if (!mCryptoReceives.front()->mDone.load(std::memory_order_acquire)) {
+      if (!wait) {
+        break;
+      }
+      mCryptoReceives.front()->Wait();
+    }
+    std::unique_ptr<CryptoJob> job(std::move(mCryptoReceives.front()));
+    mCryptoReceives.pop_front();
+    ReceiveOpened(job.get());
+    RecycleCryptoJob(job);
+  }
+}
+
+void
+MozQuic::ReceiveQueueFlush()
+{
+  ReceiveQueueSubmit();
+  ReceiveCompleted(true);
+}
+
+uint32_t
+MozQuic::FlushEarlyData()
+{
+  if (mConnectionState != CLIENT_STATE_0RTT || !mNSSHelper->EarlyKeysReady()) {
+    return MOZQUIC_OK;
+  }
+
+  assert(mMTU <= kMaxMTU);
+  unsigned char pkt[kMaxMTU];
+  while (mStreamState->UnWrittenPending() || mStreamState->ControlFramesPending()) {
+    // the long form header of section 5.4.1 - 17 bytes
+    pkt[0] = 0x80 | PACKET_TYPE_0RTT_PROTECTED;
+    uint64_t connID = PR_htonll(mConnectionID);
+    memcpy(pkt + 1, &connID, 8);
+    uint32_t tmp32 = htonl(mNextTransmitPacketNumber & 0xffffffff);
+    memcpy(pkt + 9, &tmp32, 4);
+    tmp32 = htonl(mVersion);
+    memcpy(pkt + 13, &tmp32, 4);
+
+    unsigned char *framePtr = pkt + 17;
+    mStreamState->CreateStreamFrames(framePtr, pkt + mMTU - kTagLen, false);
+    uint32_t dataLen = framePtr - (pkt + 17);
+    if (!dataLen) {
+      break;
+    }
+    // so it can be sent again if the server turns early data down
+    for (auto i = mStreamState->mUnAckedData.rbegin();
+         (i != mStreamState->mUnAckedData.rend()) &&
+           ((*i)->mPacketNumber == mNextTransmitPacketNumber); ++i) {
+      (*i)->mTransmitKeyPhase = keyPhase0Rtt;
+    }
+
+    NSSHelper::PacketBlock block = { pkt, 17, pkt + 17, dataLen, mNextTransmitPacketNumber,
+                                     pkt + 17, mMTU - 17, 0, MOZQUIC_OK };
+    if (mNSSHelper->EarlyBatch(true, &block, 1) != MOZQUIC_OK) {
+      RaiseError(MOZQUIC_ERR_CRYPTO, (char *) "unexpected 0-RTT encrypt fail");
+      return MOZQUIC_ERR_CRYPTO;
+    }
+    uint32_t rv = Transmit(pkt, 17 + block.mWritten, nullptr);
+    if (rv != MOZQUIC_OK) {
+      return rv;
+    }
+    ConnectionLog5("TRANSMIT 0RTT[%lX] this=%p len=%d\n",
+                   mNextTransmitPacketNumber, this, 17 + block.mWritten);
+    mNextTransmitPacketNumber++;
+  }
+  return MOZQUIC_OK;
+}
+
+uint32_t
+MozQuic::ReceiveEarly(unsigned char *pkt, uint32_t pktSize, uint64_t packetNum, bool &sendAck)
+{
+  assert(mIsChild && !mIsClient);
+  sendAck = false;
+  if (pktSize < 17 + kTagLen) {
+    return MOZQUIC_OK;
+  }
+
+  // the helper is not looked at while a worker is driving its handshake
+  if (mHandshakeTask || !mNSSHelper->EarlyKeysReady()) {
+    // Server1RTT() decides what happens to these
+    if ((mConnectionState == SERVER_STATE_1RTT) && (mEarlyBacklog.size() < kEarlyBacklogMax)) {
+      ConnectionLog5("0-RTT packet %lX held for the handshake\n", packetNum);
+      mEarlyBacklog.emplace_back(pkt, pkt + pktSize);
+    } else {
+      ConnectionLog5("0-RTT packet %lX dropped\n", packetNum);
+    }
+    return MOZQUIC_OK;
+  }
+  if (mConnectionState != SERVER_STATE_1RTT &&
+      mConnectionState != SERVER_STATE_CONNECTED) {
+    return MOZQUIC_OK;
+  }
+
+  NSSHelper::PacketBlock block = { pkt, 17, pkt + 17, pktSize - 17, packetNum,
+                                   pkt + 17, pktSize - 17, 0, MOZQUIC_OK };
+  uint32_t rv = mNSSHelper->EarlyBatch(false, &block, 1);
+  ConnectionLog6("decrypt 0RTT (pktnum=%lX) rv=%d sz=%d\n", packetNum, rv, block.mWritten);
+  if (rv != MOZQUIC_OK) {
+    ConnectionLog1("0-RTT decrypt failed\n");
+    return MOZQUIC_OK;
+  }
+  rv = ProcessGeneralDecoded(pkt + 17, block.mWritten, sendAck, false);
+  if (rv == MOZQUIC_OK) {
+    Acknowledge(packetNum, keyPhase0Rtt);
+  }
+  return rv;
+}
+
+void
+MozQuic::ProcessEarlyBacklog()
+{
+  std::list<std::vector<unsigned char>> backlog;
+  backlog.swap(mEarlyBacklog);
+  if (!mNSSHelper->EarlyKeysReady()) {
+    if (!backlog.empty()) {
+      ConnectionLog2("0-RTT not accepted. %d early packets dropped\n", (int) backlog.size());
+    }
+    return;
+  }
+  for (auto i = backlog.begin(); i != backlog.end(); ++i) {
+    LongHeaderData header(i->data(), i->size());
+    bool sendAck = false;
+    ReceiveEarly(i->data(), i->size(), header.mPacketNumber, sendAck);
+  }
+}
+
 void
 MozQuic::Shutdown(uint32_t code, const char *reason)
 {
   if (mParent) {
+    HalfOpenDone();
     for (auto iter = mParent->mChildren.begin(); iter != mParent->mChildren.end(); ++iter) {
       if ((*iter).get() == this) {
           mParent->mChildren.erase(iter);
@@ -271,7 +666,8 @@ MozQuic::StartClient()
 {
   assert(!mHandleIO); // todo
   mIsClient = true;
-  mStreamState.reset(new StreamState(this, mAdvertiseStreamWindow, mAdvertiseConnectionWindowKB));
+  mStreamState.reset(new StreamState(this, mAdvertiseStreamWindow, mAdvertiseConnectionWindowKB,
+                                     mWindowBudgetKB));
   mStreamState->InitIDs(1,2);
   mNSSHelper.reset(new NSSHelper(this, mTolerateBadALPN, mOriginName.get(), true));
   mStreamState->mStream0.reset(new StreamPair(0, this, mStreamState.get(),
@@ -281,7 +677,10 @@ MozQuic::StartClient()
   assert(!mClientOriginalOfferedVersion);
   mClientOriginalOfferedVersion = mVersion;
 
-  mConnectionState = CLIENT_STATE_1RTT;
+  // early data needs a ticket to resume with. Whether it allows early
+  // data is known once the client hello is written (Client1RTT)
+  mConnectionState = (mEnable0RTT && mNSSHelper->OfferedTicket()) ?
+    CLIENT_STATE_0RTT : CLIENT_STATE_1RTT;
   for (int i=0; i < 4; i++) {
     mConnectionID = mConnectionID << 16;
     mConnectionID = mConnectionID | (random() & 0xffff);
@@ -330,14 +729,15 @@ MozQuic::StartServer()
 {
   assert(!mHandleIO); // todo
   mIsClient = false;
-  mStreamState.reset(new StreamState(this, mAdvertiseStreamWindow, mAdvertiseConnectionWindowKB));
+  mStreamState.reset(new StreamState(this, mAdvertiseStreamWindow, mAdvertiseConnectionWindowKB,
+                                     mWindowBudgetKB));
   mStreamState->InitIDs(2, 1);
 
   StatelessResetEnsureKey();
 
-  assert((sizeof(mValidationKey) % sizeof(uint16_t)) == 0);
-  for (int i=0; i < (sizeof(mValidationKey) / sizeof (uint16_t)); i++) {
-    ((uint16_t *)mValidationKey)[i] = random() & 0xffff;
+  if (PK11_GenerateRandom(mValidationKey, sizeof(mValidationKey)) != SECSuccess ||
+      AddressTokenEnsureKey() != MOZQUIC_OK) {
+    return MOZQUIC_ERR_CRYPTO;
   }
 
   mConnectionState = SERVER_STATE_LISTEN;
@@ -376,6 +776,17 @@ MozQuic::FindSession(uint64_t cid)
   return (*i).second;
 }
 
+int
+MozQuic::GetServerStats(struct mozquic_server_stats *stats)
+{
+  if (mIsClient || mIsChild) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  stats->children = mChildren.size();
+  stats->halfOpen = mHalfOpen;
+  return MOZQUIC_OK;
+}
+
 void
 MozQuic::RemoveSession(uint64_t cid)
 {
@@ -416,13 +827,19 @@ MozQuic::Client1RTT()
       unsigned char te[2048];
       uint16_t teLength = 0;
       assert(mVersion && mClientOriginalOfferedVersion);
+      std::vector<unsigned char> addressToken;
+      if (TicketCache::LookupAddressToken(TicketCache::Key(mOriginName.get(), mOriginPort),
+                                          addressToken)) {
+        ConnectionLog5("offering address token\n");
+      }
       TransportExtension::
         EncodeClientTransportParameters(te, teLength, 2048,
                                         mVersion, mClientOriginalOfferedVersion,
                                         mStreamState->mLocalMaxStreamData,
                                         mStreamState->mLocalMaxData,
                                         mStreamState->mLocalMaxStreamID,
-                                        kIdleTimeoutDefault);
+                                        kIdleTimeoutDefault,
+                                        addressToken.data(), addressToken.size());
       mNSSHelper->SetLocalTransportExtensionInfo(te, teLength);
       mSetupTransportExtension = true;
     }
@@ -433,6 +850,10 @@ MozQuic::Client1RTT()
       RaiseError(code, (char *) "client 1rtt handshake failed");
       return code;
     }
+    if ((mConnectionState == CLIENT_STATE_0RTT) && !mNSSHelper->MakeEarlyKeys()) {
+      ConnectionLog5("ticket does not allow 0-RTT\n");
+      mConnectionState = CLIENT_STATE_1RTT;
+    }
     if (mNSSHelper->IsHandshakeComplete()) {
       return ClientConnected();
     }
@@ -459,6 +880,10 @@ MozQuic::Server1RTT()
     StatelessResetCalculateToken(mParent->mStatelessResetKey,
                                  mConnectionID, resetToken); // from key and CID
   
+    // so this address can skip the stateless retry next time
+    unsigned char addressToken[kAddressTokenSize];
+    uint16_t addressTokenLen = AddressTokenMake(addressToken) ? sizeof(addressToken) : 0;
+
     unsigned char te[2048];
     uint16_t teLength = 0;
     TransportExtension::
@@ -467,26 +892,38 @@ MozQuic::Server1RTT()
                                       mStreamState->mLocalMaxStreamData,
                                       mStreamState->mLocalMaxData,
                                       mStreamState->mLocalMaxStreamID,
-                                      kIdleTimeoutDefault, resetToken);
+                                      kIdleTimeoutDefault, resetToken,
+                                      addressToken, addressTokenLen);
     mNSSHelper->SetLocalTransportExtensionInfo(te, teLength);
     mSetupTransportExtension = true;
   }
 
-  if (!mStreamState->mStream0->Empty()) {
-    uint32_t code = mNSSHelper->DriveHandshake();
+  if (!mStreamState->mStream0->Empty() || mHandshakeTask ||
+      mNSSHelper->HandshakeInputPending()) {
+    bool pending = false;
+    uint32_t code = DriveServerHandshake(pending);
     if (code != MOZQUIC_OK) {
+      HalfOpenDone();
       RaiseError(code, (char *) "server 1rtt handshake failed");
       return code;
     }
+    if (pending) {
+      return MOZQUIC_OK;
+    }
 
     if (mNSSHelper->DoHRR()) {
-      mNSSHelper.reset(new NSSHelper(this, mParent->mTolerateBadALPN, mParent->mOriginName.get()));
+      mEarlyBacklog.clear();
       mParent->mConnectionHash.erase(mConnectionID);
       mParent->mConnectionHashOriginalNew.erase(mOriginalConnectionID);
       mConnectionState = SERVER_STATE_SSR;
       return MOZQUIC_OK;
     }
 
+    // early data can be opened as soon as the client hello is read
+    if (mNSSHelper->MakeEarlyKeys() || mNSSHelper->IsHandshakeComplete()) {
+      ProcessEarlyBacklog();
+    }
+
     if (mNSSHelper->IsHandshakeComplete()) {
       return ServerConnected();
     }
@@ -494,6 +931,87 @@ MozQuic::Server1RTT()
   return MOZQUIC_OK;
 }
 
+PRFileDesc *
+MozQuic::GetServerModel(bool &shared)
+{
+  if (mParent) {
+    return mParent->GetServerModel(shared);
+  }
+  shared = !mNoServerModel;
+  if (mNoServerModel) {
+    return NSSHelper::MakeServerModel(this, mOriginName.get());
+  }
+  if (!mServerModel) {
+    mServerModel = NSSHelper::MakeServerModel(this, mOriginName.get());
+  }
+  return mServerModel;
+}
+
+CryptoPool *
+MozQuic::GetHandshakePool()
+{
+  if (mParent) {
+    return mParent->GetHandshakePool();
+  }
+  if (!mHandshakePool && mHandshakeWorkers) {
+    mHandshakePool.reset(new CryptoPool(mHandshakeWorkers));
+  }
+  return mHandshakePool.get();
+}
+
+uint32_t
+MozQuic::DriveServerHandshake(bool &pending)
+{
+  pending = false;
+  CryptoPool *pool = GetHandshakePool();
+  if (!pool) {
+    return mNSSHelper->DriveHandshake();
+  }
+  mNSSHelper->SetHandshakeOffload();
+
+  // move the client's handshake bytes from stream 0 to the helper
+  unsigned char buf[kMozQuicMSS];
+  uint32_t amt;
+  do {
+    amt = 0;
+    bool fin = false;
+    if (mStreamState->mStream0->Read(buf, kMozQuicMSS, amt, fin) != MOZQUIC_OK) {
+      break;
+    }
+    if (amt) {
+      mNSSHelper->HandshakeInput(buf, amt);
+    }
+  } while (amt);
+
+  uint32_t rv = MOZQUIC_OK;
+  bool running = mHandshakeTask && !mHandshakeTask->mDone.load(std::memory_order_acquire);
+  if (mHandshakeTask && !running) {
+    rv = mHandshakeTask->mResult;
+    mHandshakeTask.reset();
+  }
+
+  // and whatever the server has said so far back to stream 0
+  std::vector<unsigned char> out;
+  mNSSHelper->TakeHandshakeOutput(out);
+  if (!out.empty()) {
+    mStreamState->mStream0->Write(out.data(), out.size(), false);
+  }
+
+  if (running) {
+    pending = true;
+    return MOZQUIC_OK;
+  }
+  if (rv != MOZQUIC_OK || mNSSHelper->IsHandshakeComplete() || mNSSHelper->DoHRR()) {
+    return rv;
+  }
+  if (mNSSHelper->HandshakeInputPending()) {
+    mHandshakeTask.reset(new HandshakeTask(mNSSHelper.get()));
+    pool->Submit(mHandshakeTask.get());
+    pending = true;
+  }
+  return MOZQUIC_OK;
+}
+
 uint32_t
 MozQuic::Intake(bool *partialResult)
 {
@@ -507,6 +1025,7 @@ MozQuic::Intake(bool *partialResult)
           mConnectionState == SERVER_STATE_1RTT ||
           mConnectionState == SERVER_STATE_CLOSED ||
           mConnectionState == CLIENT_STATE_CONNECTED ||
+          mConnectionState == CLIENT_STATE_0RTT ||
           mConnectionState == CLIENT_STATE_1RTT ||
           mConnectionState == CLIENT_STATE_CLOSED);
   uint32_t rv = MOZQUIC_OK;
@@ -545,11 +1064,8 @@ MozQuic::Intake(bool *partialResult)
       assert(shortHeader.mConnectionID == tmpShortHeader.mConnectionID);
       ConnectionLogCID5(shortHeader.mConnectionID, "SHORTFORM PACKET[%d] pkt# %lx hdrsize=%d\n",
                      pktSize, shortHeader.mPacketNumber, shortHeader.mHeaderSize);
-      rv = session->ProcessGeneral(pkt, pktSize,
-                                   shortHeader.mHeaderSize, shortHeader.mPacketNumber, sendAck);
-      if (rv == MOZQUIC_OK) {
-        session->Acknowledge(shortHeader.mPacketNumber, keyPhase1Rtt);
-      }
+      rv = session->ReceiveProtected(pkt, pktSize,
+                                     shortHeader.mHeaderSize, shortHeader.mPacketNumber, sendAck);
 
     } else {
       if (pktSize < 17) {
@@ -612,6 +1128,20 @@ MozQuic::Intake(bool *partialResult)
         }
         break;
 
+      case PACKET_TYPE_0RTT_PROTECTED:
+        // usually sent before the client has heard the server's cid
+        if (!mIsClient) {
+          auto i = mConnectionHashOriginalNew.find(longHeader.mConnectionID);
+          tmpSession = FindSession((i != mConnectionHashOriginalNew.end()) ?
+                                   (*i).second.mServerConnectionID : longHeader.mConnectionID);
+        }
+        if (!tmpSession) {
+          rv = MOZQUIC_ERR_GENERAL;
+        } else {
+          session = tmpSession->mAlive;
+        }
+        break;
+
       default:
         ConnectionLog1("recv unexpected type\n");
         // todo this could actually be out of order protected packet even in handshake
@@ -657,10 +1187,10 @@ MozQuic::Intake(bool *partialResult)
         }
         break;
       case PACKET_TYPE_1RTT_PROTECTED_KP0:
-        rv = session->ProcessGeneral(pkt, pktSize, 17, longHeader.mPacketNumber, sendAck);
-        if (rv == MOZQUIC_OK) {
-          session->Acknowledge(longHeader.mPacketNumber, keyPhase1Rtt);
-        }
+        rv = session->ReceiveProtected(pkt, pktSize, 17, longHeader.mPacketNumber, sendAck);
+        break;
+      case PACKET_TYPE_0RTT_PROTECTED:
+        rv = session->ReceiveEarly(pkt, pktSize, longHeader.mPacketNumber, sendAck);
         break;
 
       default:
@@ -686,12 +1216,14 @@ MozQuic::IO()
   bool partialResult = false;
   do {
     Intake(&partialResult);
+    ReceiveQueueFlush();
     mStreamState->RetransmitTimer();
     ClearOldInitialConnectIdsTimer();
     mStreamState->Flush(false);
 
     if (mIsClient) {
       switch (mConnectionState) {
+      case CLIENT_STATE_0RTT:
       case CLIENT_STATE_1RTT:
         code = Client1RTT();
         if (code != MOZQUIC_OK) {
@@ -699,6 +1231,15 @@ MozQuic::IO()
         }
         break;
       case CLIENT_STATE_CONNECTED:
+        if (!mAppHandlesSendRecv && !mStreamState->mStream0->Empty()) {
+          // session tickets
+          code = mNSSHelper->DrivePostHandshake();
+          if (code != MOZQUIC_OK) {
+            RaiseError(code, (char *) "client post handshake failed");
+            return code;
+          }
+        }
+        break;
       case CLIENT_STATE_CLOSED:
       case SERVER_STATE_CLOSED:
         break;
@@ -714,17 +1255,24 @@ MozQuic::IO()
         }
       }
       if (!mIsChild) {
-        ssize_t len = mChildren.size();
-        for (auto iter = mChildren.begin();
-             len == mChildren.size() && iter != mChildren.end(); ++iter) {
+        // a child can leave mChildren (and be freed) from inside its own
+        // IO, e.g. when the app destroys it from an event callback
+        std::vector<std::shared_ptr<MozQuic>> children(mChildren.begin(), mChildren.end());
+        for (auto iter = children.begin(); iter != children.end(); ++iter) {
           (*iter)->IO();
         }
       }
     }
   } while (partialResult);
 
+  if (!mAlive) {
+    // destroyed from inside its own IO, e.g. after a stateless retry
+    return MOZQUIC_OK;
+  }
+
   if ((mConnectionState == SERVER_STATE_1RTT) &&
       (mNextTransmitPacketNumber - mOriginalTransmitPacketNumber) > 20) {
+    HalfOpenDone();
     RaiseError(MOZQUIC_ERR_GENERAL, (char *)"TimedOut Client In Handshake");
     return MOZQUIC_ERR_GENERAL;
   }
@@ -829,7 +1377,15 @@ uint32_t
 MozQuic::ClientConnected()
 {
   ConnectionLog4("CLIENT_STATE_CONNECTED\n");
-  assert(mConnectionState == CLIENT_STATE_1RTT);
+  assert(mConnectionState == CLIENT_STATE_1RTT || mConnectionState == CLIENT_STATE_0RTT);
+  if (mConnectionState == CLIENT_STATE_0RTT) {
+    bool accepted = mNSSHelper->EarlyDataAccepted();
+    TicketCache::CountEarlyData(true, accepted);
+    if (!accepted) {
+      ConnectionLog2("0-RTT rejected. early data sent again\n");
+      mStreamState->RetransmitEarlyData();
+    }
+  }
   unsigned char *extensionInfo = nullptr;
   uint16_t extensionInfoLen = 0;
   uint32_t peerVersionList[256];
@@ -843,6 +1399,8 @@ MozQuic::ClientConnected()
   } else {
     assert(sizeof(mStatelessResetToken) == 16);
     uint32_t peerMaxDataKB;
+    unsigned char addressToken[kAddressTokenMax];
+    uint16_t addressTokenLen = sizeof(addressToken);
     decodeResult =
       TransportExtension::
       DecodeServerTransportParameters(extensionInfo, extensionInfoLen,
@@ -850,7 +1408,13 @@ MozQuic::ClientConnected()
                                       mStreamState->mPeerMaxStreamData,
                                       peerMaxDataKB,
                                       mStreamState->mPeerMaxStreamID, mPeerIdleTimeout,
-                                      mStatelessResetToken);
+                                      mStatelessResetToken,
+                                      addressToken, addressTokenLen);
+    if (decodeResult == MOZQUIC_OK && addressTokenLen) {
+      ConnectionLog5("server sent an address token\n");
+      TicketCache::StoreAddressToken(TicketCache::Key(mOriginName.get(), mOriginPort),
+                                     addressToken, addressTokenLen);
+    }
     mStreamState->mPeerMaxData = peerMaxDataKB * (__uint128_t) 1024;
     if (decodeResult != MOZQUIC_OK) {
       ConnectionLog1("Decoding Server Transport Parameters: failed\n");
@@ -930,13 +1494,15 @@ MozQuic::ServerConnected()
     decodeResult = MOZQUIC_OK;
   } else {
     uint32_t peerMaxDataKB;
+    uint16_t addressTokenLen = 0; // already seen by the HRR callback
     decodeResult =
       TransportExtension::
       DecodeClientTransportParameters(extensionInfo, extensionInfoLen,
                                       peerNegotiatedVersion, peerInitialVersion,
                                       mStreamState->mPeerMaxStreamData,
                                       peerMaxDataKB,
-                                      mStreamState->mPeerMaxStreamID, mPeerIdleTimeout);
+                                      mStreamState->mPeerMaxStreamID, mPeerIdleTimeout,
+                                      nullptr, addressTokenLen);
     ConnectionLog6(
             "decode client parameters: "
             "maxstreamdata %ld "
@@ -978,6 +1544,10 @@ MozQuic::ServerConnected()
     }
   }
   
+  if (mNSSHelper->EarlyDataAccepted()) {
+    TicketCache::CountEarlyData(false, true);
+  }
+  HalfOpenDone();
   mConnectionState = SERVER_STATE_CONNECTED;
   if (decodeResult != MOZQUIC_OK) {
     assert(errorCode != ERROR_NO_ERROR);
@@ -994,30 +1564,40 @@ MozQuic::ServerConnected()
 }
 
 uint32_t
-MozQuic::ProcessGeneral(const unsigned char *pkt, uint32_t pktSize, uint32_t headerSize,
+MozQuic::ProcessGeneral(unsigned char *pkt, uint32_t pktSize, uint32_t headerSize,
                         uint64_t packetNum, bool &sendAck)
 {
   assert(pktSize >= headerSize);
   assert(pktSize <= kMozQuicMSS);
-  unsigned char out[kMozQuicMSS];
 
   if (mConnectionState == CLIENT_STATE_CLOSED ||
       mConnectionState == SERVER_STATE_CLOSED) {
     ConnectionLog4("processgeneral discarding %lX as closed\n", packetNum);
     return MOZQUIC_ERR_GENERAL;
   }
+  // decrypt over the ciphertext. A failed decrypt can scribble on the
+  // payload, so keep the 25 bytes a stateless reset is checked against
+  unsigned char resetCheck[25];
+  memcpy(resetCheck, pkt, (pktSize < sizeof(resetCheck)) ? pktSize : sizeof(resetCheck));
+
   uint32_t written;
   uint32_t rv = mNSSHelper->DecryptBlock(pkt, headerSize, pkt + headerSize,
-                                         pktSize - headerSize, packetNum, out,
-                                         kMozQuicMSS, written);
+                                         pktSize - headerSize, packetNum, pkt + headerSize,
+                                         kMozQuicMSS - headerSize, written);
   ConnectionLog6("decrypt (pktnum=%lX) rv=%d sz=%d\n", packetNum, rv, written);
   if (rv != MOZQUIC_OK) {
     ConnectionLog1("decrypt failed\n");
-    if (StatelessResetCheckForReceipt(pkt, pktSize)) {
+    if (StatelessResetCheckForReceipt(resetCheck, pktSize)) {
       return MOZQUIC_OK;
     }
     return rv;
   }
+  return ProcessGeneralDecrypted(pkt + headerSize, written, sendAck);
+}
+
+uint32_t
+MozQuic::ProcessGeneralDecrypted(const unsigned char *pkt, uint32_t pktSize, bool &sendAck)
+{
   if (!mDecodedOK) {
     mDecodedOK = true;
     StartPMTUD1();
@@ -1027,7 +1607,7 @@ MozQuic::ProcessGeneral(const unsigned char *pkt, uint32_t pktSize, uint32_t hea
     mConnEventCB(mClosure, MOZQUIC_EVENT_PING_OK, nullptr);
   }
 
-  return ProcessGeneralDecoded(out, written, sendAck, false);
+  return ProcessGeneralDecoded(pkt, pktSize, sendAck, false);
 }
 
 uint32_t
@@ -1040,6 +1620,7 @@ MozQuic::HandleCloseFrame(FrameHeaderData *result, bool fromCleartext,
     return MOZQUIC_ERR_GENERAL;
   }
   ConnectionLog5("RECVD CLOSE\n");
+  HalfOpenDone();
   mConnectionState = mIsClient ? CLIENT_STATE_CLOSED : SERVER_STATE_CLOSED;
   if (mConnEventCB) {
     mConnEventCB(mClosure, MOZQUIC_EVENT_CLOSE_CONNECTION, this);
@@ -1213,7 +1794,8 @@ MozQuic *
 MozQuic::Accept(struct sockaddr_in *clientAddr, uint64_t aConnectionID, uint64_t aCIPacketNumber)
 {
   MozQuic *child = new MozQuic(mHandleIO);
-  child->mStreamState.reset(new StreamState(child, mAdvertiseStreamWindow, mAdvertiseConnectionWindowKB));
+  child->mStreamState.reset(new StreamState(child, mAdvertiseStreamWindow, mAdvertiseConnectionWindowKB,
+                                            mWindowBudgetKB));
   child->mStreamState->InitIDs(2, 1);
   child->mIsChild = true;
   child->mIsClient = false;
@@ -1236,7 +1818,7 @@ MozQuic::Accept(struct sockaddr_in *clientAddr, uint64_t aConnectionID, uint64_t
 
   child->SetInitialPacketNumber();
 
-  child->mNSSHelper.reset(new NSSHelper(child, mTolerateBadALPN, mOriginName.get()));
+  child->mNSSHelper.reset(new NSSHelper(child, mTolerateBadALPN));
   child->mVersion = mVersion;
   child->mTimestampConnBegin = Timestamp();
   child->mOriginalConnectionID = aConnectionID;
@@ -1278,6 +1860,19 @@ MozQuic::MaybeDeleteStream(StreamPair *sp)
   }
 }
 
+void
+MozQuic::ReleaseAppBuffer(void *cookie, const void *data, uint32_t len)
+{
+  // memory given to mozquic_send_zc without its own release callback
+  if (mConnEventCB) {
+    struct mozquic_eventdata_release release;
+    release.data = data;
+    release.len = len;
+    release.cookie = cookie;
+    mConnEventCB(mClosure, MOZQUIC_EVENT_RELEASE_BUFFER, &release);
+  }
+}
+
 uint64_t
 MozQuic::Timestamp()
 {
@@ -46,6 +46,7 @@ extern "C" {
     MOZQUIC_EVENT_RECV                   =  9, // mozquic_eventdata_recv
     MOZQUIC_EVENT_TLSINPUT               = 10, // mozquic_eventdata_tlsinput
     MOZQUIC_EVENT_PING_OK                = 11, // nullptr
+    MOZQUIC_EVENT_RELEASE_BUFFER         = 12, // mozquic_eventdata_release
   };
 
   enum {
@@ -57,6 +58,12 @@ extern "C" {
   typedef void mozquic_connection_t;
   typedef void mozquic_stream_t;
 
+  struct mozquic_iovec
+  {
+    void *data;
+    uint32_t len;
+  };
+
   struct mozquic_config_t
   {
     const char *originName;
@@ -87,11 +94,96 @@ extern "C" {
   int mozquic_end_stream(mozquic_stream_t *stream);
   int mozquic_reset_stream(mozquic_stream_t *stream); // a more final version of end_stream
   int mozquic_stop_sending(mozquic_stream_t *stream);
+  // send_zc sends without copying - the library references data until all
+  // of it has been acked (or the stream is gone) and then calls release, or
+  // raises MOZQUIC_EVENT_RELEASE_BUFFER if release is NULL. data must not
+  // change until then. If an error is returned nothing was referenced.
+  int mozquic_send_zc(mozquic_stream_t *stream, const void *data, uint32_t amount, int fin,
+                      void (*release)(void *cookie, const void *data, uint32_t len),
+                      void *cookie);
+  // send_file sends len bytes of fd starting at offset. The data is read
+  // from the file as it is framed, so the file must not shrink until the
+  // stream is done; the library uses its own dup() of fd and the app may
+  // close fd as soon as this returns.
+  int mozquic_send_file(mozquic_stream_t *stream, int fd, uint64_t offset, uint64_t len, int fin);
   int mozquic_recv(mozquic_stream_t *stream, void *data, uint32_t aval, uint32_t *amount, int *fin);
+  // vectored forms of send and recv. sendv is one write of all the
+  // buffers; recvv fills the buffers in order and *amount is the total
+  int mozquic_sendv(mozquic_stream_t *stream, const struct mozquic_iovec *iov, int iovcnt, int fin);
+  int mozquic_recvv(mozquic_stream_t *stream, const struct mozquic_iovec *iov, int iovcnt,
+                    uint32_t *amount, int *fin);
+  // recv_all is recv that also reports how many more bytes can be read
+  // in order right now - so the app can drain a stream in one call
+  int mozquic_recv_all(mozquic_stream_t *stream, void *data, uint32_t aval, uint32_t *amount,
+                       int *fin, uint64_t *readable);
+  // zero copy recv. peek points *data at the next in order bytes held by
+  // the library (*amount of them, possibly fewer than are readable) and
+  // sets *fin if they end the stream. The memory is only valid until the
+  // next mozquic call on the connection. consume releases bytes that have
+  // been peeked - once the last of them is consumed the stream is finished.
+  int mozquic_recv_peek(mozquic_stream_t *stream, const void **data, uint32_t *amount, int *fin);
+  int mozquic_recv_consume(mozquic_stream_t *stream, uint32_t amount);
   int mozquic_set_event_callback(mozquic_connection_t *conn, int (*fx)(void *closure, uint32_t event, void *param));
   int mozquic_set_event_callback_closure(mozquic_connection_t *conn, void *closure);
   int mozquic_check_peer(mozquic_connection_t *conn, uint32_t deadlineMS);
   int mozquic_get_streamid(mozquic_stream_t *stream);
+  // urgency is 0 (most urgent) to 7 and defaults to 3. Data of a more
+  // urgent stream is always written first. Streams of the same urgency
+  // take turns if they are incremental (the default) - otherwise each
+  // one is written out before the next.
+  int mozquic_set_stream_priority(mozquic_stream_t *stream, int urgency, int incremental);
+
+  // TLS session tickets are cached in memory per origin:port and offered
+  // by later connections to the same place, which then resume with a PSK
+  // and skip certificate signing and verification. export copies the
+  // cache into buf so another process can import it - *used is the size
+  // needed and MOZQUIC_ERR_MEMORY means avail was too small.
+  struct mozquic_ticket_stats
+  {
+    uint64_t clientHandshakes;
+    uint64_t clientOffered; // a cached ticket was available
+    uint64_t clientResumed;
+    uint64_t serverHandshakes;
+    uint64_t serverResumed;
+    uint64_t clientEarlySent;     // connections that sent 0-RTT
+    uint64_t clientEarlyAccepted; // .. and had it accepted
+    uint64_t serverEarlyAccepted;
+  };
+  int mozquic_ticket_cache_export(void *buf, uint32_t avail, uint32_t *used);
+  int mozquic_ticket_cache_import(const void *buf, uint32_t len);
+  int mozquic_ticket_stats(struct mozquic_ticket_stats *stats);
+
+  // frames and stream ring storage are recycled through per thread free
+  // lists. These count, over every thread so far, how often one was
+  // served from a list (a hit) and how often from the heap.
+  struct mozquic_pool_stats
+  {
+    uint64_t frameHits;
+    uint64_t frameMisses;
+    uint64_t bufferHits;
+    uint64_t bufferMisses;
+  };
+  int mozquic_pool_stats(struct mozquic_pool_stats *stats);
+
+  // packet batches (cryptoWorkers) and server handshakes
+  // (handshakeWorkers) that have run on a worker thread rather than
+  // inline on the connection's thread
+  struct mozquic_worker_stats
+  {
+    uint64_t cryptoJobs;
+    uint64_t handshakes;
+  };
+  int mozquic_worker_stats(struct mozquic_worker_stats *stats);
+
+  // a listening server's children (connections it has accepted and that
+  // have not been destroyed) and how many of those are still in their
+  // handshake. MOZQUIC_ERR_INVALID for anything but a server.
+  struct mozquic_server_stats
+  {
+    uint32_t children;
+    uint32_t halfOpen;
+  };
+  int mozquic_server_stats(mozquic_connection_t *conn, struct mozquic_server_stats *stats);
 
   int mozquic_start_backpressure(mozquic_connection_t *conn);
   int mozquic_release_backpressure(mozquic_connection_t *conn);
@@ -130,6 +222,13 @@ extern "C" {
     uint32_t len;
   };
 
+  struct mozquic_eventdata_release
+  {
+    const void *data;
+    uint32_t len;
+    void *cookie;
+  };
+
   mozquic_socket_t mozquic_osfd(mozquic_connection_t *inSession);
   void mozquic_setosfd(mozquic_connection_t *inSession, mozquic_socket_t fd);
 
@@ -6,6 +6,7 @@
 #pragma once
 
 #include <netinet/ip.h>
+#include <deque>
 #include <list>
 #include <stdint.h>
 #include <unistd.h>
@@ -15,6 +16,7 @@
 #include <vector>
 #include <string.h>
 #include "prnetdb.h"
+#include "pk11pub.h"
 #include "MozQuic.h"
 #include "Packetization.h"
 
@@ -72,7 +74,7 @@ enum errorType {
   // FRAME_ERROR 0x8000001XX
 };
 
-enum keyPhase {
+enum keyPhase : uint8_t {
   keyPhaseUnknown,
   keyPhaseUnprotected,
   keyPhase0Rtt,
@@ -84,6 +86,9 @@ class StreamAck;
 class NSSHelper;
 class StreamState;
 class ReliableData;
+class CryptoJob;
+class CryptoPool;
+class HandshakeTask;
 
 class MozQuic final
 {
@@ -94,6 +99,12 @@ friend class StreamState;
 public:
   static const char *kAlpn;
   static const uint32_t kForgetInitialConnectionIDsThresh = 4000; // ms
+  static const uint32_t kAntiReplayWindowDefault = 10000; // ms
+  static const uint32_t kEarlyBacklogMax = 16; // packets
+  static const uint32_t kAddressTokenLifetime = 24 * 60 * 60 * 1000; // ms
+  static const uint32_t kAddressTokenSize = 40; // expiry + sha256
+  static const uint32_t kAddressTokenMax = 256; // from any server
+  static const uint32_t kAddressValidationHold = 2000; // ms, under load
 
   MozQuic(bool handleIO);
   MozQuic();
@@ -101,14 +112,17 @@ public:
 
   int StartClient();
   int StartServer();
+  int GetServerStats(struct mozquic_server_stats *stats);
   void SetInitialPacketNumber();
   uint32_t StartNewStream(StreamPair **outStream, const void *data, uint32_t amount, bool fin);
   void MaybeDeleteStream(StreamPair *sp);
+  void ReleaseAppBuffer(void *cookie, const void *data, uint32_t len);
   int IO();
   void HandshakeOutput(unsigned char *, uint32_t amt);
   void HandshakeComplete(uint32_t errCode, struct mozquic_handshake_info *keyInfo);
 
   void SetOriginPort(int port) { mOriginPort = port; }
+  int  GetOriginPort() { return mOriginPort; }
   void SetOriginName(const char *name);
   void SetStatelessResetKey(const unsigned char *key) { memcpy(mStatelessResetKey, key, 128); }
   void SetClosure(void *closure) { mClosure = closure; }
@@ -122,11 +136,29 @@ public:
   void SetTolerateNoTransportParams() { mTolerateNoTransportParams = true; }
   void SetSabotageVN() { mSabotageVN = true; }
   void SetForceAddressValidation() { mForceAddressValidation = true; }
-  bool GetForceAddressValidation() {
-    return mParent ? mParent->mForceAddressValidation : mForceAddressValidation;
+  // stateless retry also goes on by itself when the server parent has
+  // more than halfOpen handshakes going or more than perSecond new ones.
+  // 0 is no limit.
+  void SetAddressValidationThreshold(uint32_t halfOpen, uint32_t perSecond) {
+    mHalfOpenThreshold = halfOpen;
+    mInitialRateThreshold = perSecond;
+  }
+  // see NSSHelper::MakeServerModel. unless shared the caller closes it
+  PRFileDesc *GetServerModel(bool &shared);
+  void SetNoServerModel() { mNoServerModel = true; }
+  bool AddressValidationNeeded() {
+    MozQuic *p = mParent ? mParent : this;
+    return p->mForceAddressValidation || p->mLoadAddressValidation;
   }
   void SetStreamWindow(uint64_t w) { mAdvertiseStreamWindow = w; }
   void SetConnWindowKB(uint64_t kb) { mAdvertiseConnectionWindowKB = kb; }
+  void SetWindowBudgetKB(uint64_t kb) { mWindowBudgetKB = kb; }
+  void SetCryptoWorkers(uint32_t n) { mCryptoWorkers = n; }
+  void SetHandshakeWorkers(uint32_t n) { mHandshakeWorkers = n; }
+  void SetEnable0RTT() { mEnable0RTT = true; }
+  void SetAntiReplayWindow(uint32_t ms) { mAntiReplayWindow = ms; }
+  bool GetEnable0RTT() { return mParent ? mParent->mEnable0RTT : mEnable0RTT; }
+  uint32_t GetAntiReplayWindow() { return mParent ? mParent->mAntiReplayWindow : mAntiReplayWindow; }
 
   void SetAppHandlesSendRecv() { mAppHandlesSendRecv = true; }
   void SetAppHandlesLogging() { mAppHandlesLogging = true; }
@@ -143,6 +175,9 @@ public:
 
   bool DecodedOK() { return mDecodedOK; }
   void GetRemotePeerAddressHash(unsigned char *out, uint32_t *outLen);
+  // server child. true if token was made by AddressTokenMake for this
+  // peer address and has not expired. safe on a handshake worker.
+  bool AddressTokenCheck(const unsigned char *token, uint32_t len);
   static uint64_t Timestamp();
   void Shutdown(uint32_t, const char *);
 
@@ -164,9 +199,11 @@ private:
                            LongHeaderData &, MozQuic **outSession, bool &);
   int ProcessClientCleartext(unsigned char *pkt, uint32_t pktSize, LongHeaderData &, bool&);
   uint32_t ProcessGeneralDecoded(const unsigned char *, uint32_t size, bool &, bool fromClearText);
-  uint32_t ProcessGeneral(const unsigned char *, uint32_t size, uint32_t headerSize, uint64_t packetNumber, bool &);
+  uint32_t ProcessGeneral(unsigned char *, uint32_t size, uint32_t headerSize, uint64_t packetNumber, bool &);
+  uint32_t ProcessGeneralDecrypted(const unsigned char *, uint32_t size, bool &);
   bool IntegrityCheck(unsigned char *, uint32_t size);
   void ProcessAck(class FrameHeaderData *ackMetaInfo, const unsigned char *framePtr, bool fromCleartext);
+  void UpdateRTT(uint64_t sendTime, uint64_t ackDelay);
 
   uint32_t HandleAckFrame(FrameHeaderData *result, bool fromCleartext,
                           const unsigned char *pkt, const unsigned char *endpkt,
@@ -182,6 +219,12 @@ private:
   uint32_t ServerConnected();
 
   uint32_t Intake(bool *partialResult);
+  // 0-RTT. The client sends stream data in early packets until the
+  // handshake is done. The server holds early packets that arrive before
+  // its early key, and drops them if the handshake finishes without one.
+  uint32_t FlushEarlyData();
+  uint32_t ReceiveEarly(unsigned char *pkt, uint32_t pktSize, uint64_t packetNum, bool &sendAck);
+  void     ProcessEarlyBacklog();
   uint32_t FlushStream0(bool forceAck);
 
   int Client1RTT();
@@ -200,9 +243,35 @@ private:
 
   uint32_t Transmit(const unsigned char *, uint32_t len, struct sockaddr_in *peer);
   uint32_t CreateShortPacketHeader(unsigned char *pkt, uint32_t pktSize, uint32_t &used);
+  // data must directly follow the header - it is encrypted in place.
+  // A packet built in TransmitQueueSlot() is only numbered here and is
+  // encrypted and sent by TransmitQueueFlush() with the rest of its batch.
   uint32_t ProtectedTransmit(unsigned char *header, uint32_t headerLen,
                              unsigned char *data, uint32_t dataLen, uint32_t dataAllocation,
                              bool addAcks, uint32_t mtuOverride = 0);
+  unsigned char *TransmitQueueSlot();
+  uint32_t TransmitQueueFlush();
+
+  // Crypto workers. Sealing and opening are handed to the pool a batch at
+  // a time; the results are picked up here in order, so the wire order
+  // and all of the ack and loss bookkeeping stay on this thread.
+  CryptoPool *GetCryptoPool();
+  std::unique_ptr<CryptoJob> NewCryptoJob(bool encrypt);
+  void RecycleCryptoJob(std::unique_ptr<CryptoJob> &job);
+  uint32_t TransmitQueueSubmit();
+  uint32_t TransmitSealed(CryptoJob *job);
+  uint32_t TransmitCompleted(bool wait);
+  uint32_t ReceiveProtected(unsigned char *pkt, uint32_t pktSize, uint32_t headerSize,
+                            uint64_t packetNum, bool &sendAck);
+  void ReceiveQueueSubmit();
+  void ReceiveOpened(CryptoJob *job);
+  void ReceiveCompleted(bool wait);
+  void ReceiveQueueFlush();
+
+  // server handshakes can run on their own pool. pending means a worker
+  // still has it and the handshake state must not be looked at yet.
+  CryptoPool *GetHandshakePool();
+  uint32_t DriveServerHandshake(bool &pending);
 
   // Stateless Reset
   bool     StatelessResetCheckForReceipt(const unsigned char *pkt, uint32_t pktSize);
@@ -210,6 +279,16 @@ private:
   static uint32_t StatelessResetCalculateToken(const unsigned char *key128,
                                                uint64_t connID, unsigned char *out);
   uint32_t StatelessResetEnsureKey();
+
+  // server parent. called for each new client initial
+  void UpdateHandshakeLoad();
+  void HalfOpenDone(); // child, on connect and on every way a handshake ends
+  void StatelessRetrySent(); // child
+
+  // Address Validation Tokens
+  uint32_t AddressTokenEnsureKey(); // server parent
+  bool AddressTokenMake(unsigned char *out /* kAddressTokenSize */);
+  bool AddressTokenTag(const unsigned char *expires, unsigned char *out);
     
   mozquic_socket_t mFD;
 
@@ -234,9 +313,10 @@ private:
   std::unique_ptr<char []> mOriginName;
   struct sockaddr_in mPeer; // todo not a v4 world
 
-  // both only set in server parent
+  // only set in server parent
   unsigned char mStatelessResetKey[128];
   unsigned char mValidationKey[32];
+  PK11SymKey   *mAddressTokenKey; // hmac, see AddressToken.cpp
 
   // only set in client after exchange of transport params
   unsigned char mStatelessResetToken[16];
@@ -288,6 +368,40 @@ private:
 
   uint64_t mAdvertiseStreamWindow;
   uint64_t mAdvertiseConnectionWindowKB;
+  uint64_t mWindowBudgetKB; // receive windows are autotuned up to this
+
+  uint64_t mSmoothedRTT; // ms. 0 until the first sample
+
+
+  uint32_t mCryptoWorkers; // 0 seals and opens everything inline
+  std::unique_ptr<CryptoPool> mCryptoPool; // client or server parent only
+  std::unique_ptr<CryptoJob> mTransmitJob; // packets Flush is building
+  std::unique_ptr<CryptoJob> mReceiveJob; // packets read but not yet submitted
+  std::deque<std::unique_ptr<CryptoJob>> mCryptoTransmits; // on the pool, packet number order
+  std::deque<std::unique_ptr<CryptoJob>> mCryptoReceives; // on the pool, arrival order
+  std::vector<std::unique_ptr<CryptoJob>> mSpareCryptoJobs;
+
+  uint32_t mHandshakeWorkers; // server only. 0 drives handshakes inline
+  std::unique_ptr<CryptoPool> mHandshakePool; // server parent only
+  std::unique_ptr<HandshakeTask> mHandshakeTask; // child, while on a worker
+
+  bool     mEnable0RTT;
+  uint32_t mAntiReplayWindow; // ms, server
+  std::list<std::vector<unsigned char>> mEarlyBacklog; // server child
+
+  // handshake load, server parent. see UpdateHandshakeLoad
+  uint32_t mHalfOpenThreshold;
+  uint32_t mInitialRateThreshold; // per second
+  uint32_t mHalfOpen;
+  uint64_t mInitialRateStart; // ms
+  uint32_t mInitialRateCount; // since mInitialRateStart
+  uint32_t mInitialRateLast; // the second before that
+  bool     mLoadAddressValidation;
+  uint64_t mLoadAddressValidationSince; // ms
+  bool     mCountedHalfOpen; // child
+
+  PRFileDesc *mServerModel; // server parent, made on first accept
+  bool mNoServerModel; // server parent, a model per accept instead
       
 public: // callbacks from nsshelper
   int32_t NSSInput(void *buf, int32_t amount);
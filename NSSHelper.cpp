@@ -7,6 +7,8 @@
 #include "MozQuic.h"
 #include "MozQuicInternal.h"
 #include "NSSHelper.h"
+#include "TicketCache.h"
+#include "TransportExtension.h"
 #include "nss.h"
 #include "ssl.h"
 #include "sslexp.h"
@@ -205,6 +207,10 @@ namespace mozquic {
 static bool mozQuicInit = false;
 static PRDescIdentity nssHelperIdentity;
 static PRIOMethods nssHelperMethods;
+static bool sServerSessionCache = false;
+#ifdef MOZQUIC_EARLY_DATA
+static SSLAntiReplayContext *sAntiReplay = nullptr;
+#endif
 
 int
 NSSHelper::Init(char *dir)
@@ -218,7 +224,9 @@ NSSHelper::Init(char *dir)
 
   nssHelperMethods.getpeername = NSPRGetPeerName;
   nssHelperMethods.getsocketoption = NSPRGetSocketOption;
+  nssHelperMethods.setsocketoption = NSPRSetSocketOption;
   nssHelperMethods.connect = nssHelperConnect;
+  nssHelperMethods.close = nssHelperClose;
   nssHelperMethods.write = nssHelperWrite;
   nssHelperMethods.send = nssHelperSend;
   nssHelperMethods.recv = nssHelperRecv;
@@ -403,6 +411,25 @@ NSSHelper::HRRCallback(PRBool firstHello, const unsigned char *clientToken,
 
   NSSHelper *self = reinterpret_cast<NSSHelper *>(arg);
 
+  if (firstHello) {
+    // a client back with a token from us has its address validated already
+    uint32_t negotiatedVersion, initialVersion, maxStreamData, maxDataKB, maxStreamID;
+    uint16_t idleTimeout;
+    unsigned char addressToken[MozQuic::kAddressTokenSize];
+    uint16_t addressTokenLen = sizeof(addressToken);
+    if (TransportExtension::
+        DecodeClientTransportParameters(self->mRemoteTransportExtensionInfo,
+                                        self->mRemoteTransportExtensionLen,
+                                        negotiatedVersion, initialVersion,
+                                        maxStreamData, maxDataKB, maxStreamID, idleTimeout,
+                                        addressToken, addressTokenLen) == MOZQUIC_OK &&
+        addressTokenLen &&
+        self->mMozQuic->AddressTokenCheck(addressToken, addressTokenLen)) {
+      sTlsLog5("HRRCallback address token accepted - no retry\n");
+      return ssl_hello_retry_accept;
+    }
+  }
+
   unsigned char sourceAddressInfo[128];
   uint32_t sourceAddressLen = sizeof(sourceAddressInfo);
   self->mMozQuic->GetRemotePeerAddressHash(sourceAddressInfo, &sourceAddressLen);
@@ -485,6 +512,8 @@ NSSHelper::HandshakeCallback(PRFileDesc *fd, void *client_data)
     if (SSL_GetChannelInfo(fd, &info, sizeof(info)) != SECSuccess) {
       goto failure;
     } else {
+      sTlsLog5("handshake resumed=%d\n", info.resumed);
+      TicketCache::CountHandshake(self->mIsClient, self->mOfferedTicket, info.resumed);
       GetKeyParamsFromCipherSuite(info.cipherSuite,
                                   secretSize, keySize, hashType, self->mPacketProtectionMech,
                                   importMechanism1, importMechanism2);
@@ -526,79 +555,234 @@ failure:
   self->mHandshakeFailed = true;
 }
 
+static void
+MakeNonce(const unsigned char *iv, uint64_t packetNumber, unsigned char *nonce)
+{
+  memcpy(nonce, iv, 12);
+  packetNumber = PR_htonll(packetNumber);
+  unsigned char *tmp = (unsigned char *)&packetNumber;
+  for(int i = 0; i < 8; ++i) {
+    nonce[i + 4] ^= tmp[i];
+  }
+}
+
+bool
+NSSHelper::PacketProtectionReady()
+{
+  return mNSSReady && mHandshakeComplete && !mHandshakeFailed &&
+    mPacketProtectionSenderKey0 && mPacketProtectionReceiverKey0;
+}
+
 uint32_t
-NSSHelper::BlockOperation(bool encrypt,
-                          const unsigned char *aadData, uint32_t aadLen,
-                          const unsigned char *data, uint32_t dataLen,
-                          uint64_t packetNumber,
-                          unsigned char *out, uint32_t outAvail, uint32_t &written)
-// for encrypt outAvail should be at least dataLen + 16 (for tag), for decrypt out should be at
-// least dataLen - 16 (for tag removal)
-{
-  assert(outAvail >= (dataLen + 16));
-  if (!mNSSReady || !mHandshakeComplete || mHandshakeFailed ||
-      !mPacketProtectionSenderKey0 || !mPacketProtectionReceiverKey0) {
+NSSHelper::BatchOperation(bool encrypt, PacketBlock *blocks, uint32_t count)
+{
+  if (!PacketProtectionReady()) {
+    for (uint32_t i = 0; i < count; i++) {
+      blocks[i].mWritten = 0;
+      blocks[i].mResult = MOZQUIC_ERR_GENERAL;
+    }
     return MOZQUIC_ERR_GENERAL;
   }
 
+  PK11Context *context = nullptr;
+#ifdef MOZQUIC_AEAD_CONTEXT
+  if (!mPacketProtectionSenderContext0 && !mAEADContextFailed) {
+    CreateAEADContexts();
+  }
+  context = encrypt ? mPacketProtectionSenderContext0 : mPacketProtectionReceiverContext0;
+#endif
+  return ProtectBatch(encrypt, context, blocks, count);
+}
+
+void
+NSSHelper::SetCryptoWorkers(uint32_t count)
+{
+  if (mWorkerContexts.size() < count * 2) {
+    mWorkerContexts.resize(count * 2, nullptr);
+  }
+}
+
+uint32_t
+NSSHelper::WorkerBatch(uint32_t worker, bool encrypt, PacketBlock *blocks, uint32_t count)
+// runs on crypto worker number worker. The caller checked PacketProtectionReady()
+// and SetCryptoWorkers() before submitting, and each worker only touches its own
+// pair of contexts.
+{
+  assert(worker * 2 + 1 < mWorkerContexts.size());
+  PK11Context *context = nullptr;
+#ifdef MOZQUIC_AEAD_CONTEXT
+  PK11Context *&slot = mWorkerContexts[worker * 2 + (encrypt ? 0 : 1)];
+  if (!slot) {
+    slot = CreateAEADContext(encrypt);
+  }
+  context = slot;
+#endif
+  return ProtectBatch(encrypt, context, blocks, count);
+}
+
+uint32_t
+NSSHelper::ProtectBatch(bool encrypt, PK11Context *context, PacketBlock *blocks, uint32_t count)
+// for encrypt mOutAvail should be at least mDataLen + 16 (for tag), for decrypt it should be
+// at least mDataLen - 16 (for tag removal). The key state and mechanism parameters are set
+// up once for the whole batch - only the nonce and aad change from packet to packet.
+// Without a context the one shot PK11_Encrypt/PK11_Decrypt are used.
+{
+  return ProtectBlocks(encrypt, context,
+                       encrypt ? mPacketProtectionSenderKey0 : mPacketProtectionReceiverKey0,
+                       mPacketProtectionMech,
+                       encrypt ? mPacketProtectionSenderIV0 : mPacketProtectionReceiverIV0,
+                       blocks, count);
+}
+
+uint32_t
+NSSHelper::ProtectBlocks(bool encrypt, PK11Context *context, PK11SymKey *key,
+                         CK_MECHANISM_TYPE mech, const unsigned char *iv,
+                         PacketBlock *blocks, uint32_t count)
+{
+  unsigned char nonce[12];
+  uint32_t rv = MOZQUIC_OK;
+
+#ifdef MOZQUIC_AEAD_CONTEXT
+  if (context) {
+    for (uint32_t i = 0; i < count; i++) {
+      PacketBlock &b = blocks[i];
+      assert(encrypt ? (b.mOutAvail >= b.mDataLen + 16) : (b.mOutAvail + 16 >= b.mDataLen));
+      MakeNonce(iv, b.mPacketNumber, nonce);
+      // the tag follows the ciphertext
+      int outLen = 0;
+      SECStatus srv = SECFailure;
+      if (encrypt) {
+        srv = PK11_AEADOp(context, CKG_NO_GENERATE, 0,
+                          nonce, sizeof(nonce), b.mAAD, b.mAADLen,
+                          b.mOut, &outLen, b.mOutAvail - 16, b.mOut + b.mDataLen, 16,
+                          b.mData, b.mDataLen);
+        outLen += 16;
+      } else if (b.mDataLen >= 16) {
+        srv = PK11_AEADOp(context, CKG_NO_GENERATE, 0,
+                          nonce, sizeof(nonce), b.mAAD, b.mAADLen,
+                          b.mOut, &outLen, b.mOutAvail,
+                          const_cast<unsigned char *>(b.mData) + b.mDataLen - 16, 16,
+                          b.mData, b.mDataLen - 16);
+      }
+      b.mWritten = (srv == SECSuccess) ? outLen : 0;
+      b.mResult = (srv == SECSuccess) ? MOZQUIC_OK : MOZQUIC_ERR_GENERAL;
+      if (b.mResult != MOZQUIC_OK) {
+        rv = b.mResult;
+      }
+    }
+    return rv;
+  }
+#endif
+
   CK_GCM_PARAMS gcmParams;
   CK_NSS_AEAD_PARAMS polyParams;
   unsigned char *params;
   unsigned int paramsLength;
-  unsigned char nonce[12];
-  memcpy(nonce, encrypt ? mPacketProtectionSenderIV0 : mPacketProtectionReceiverIV0, 12);
-  packetNumber = PR_htonll(packetNumber);
-  unsigned char *tmp = (unsigned char *)&packetNumber;
-  for(int i = 0; i < 8; ++i) {
-    nonce[i + 4] ^= tmp[i];
-  }
 
-
-  if (mPacketProtectionMech == CKM_AES_GCM) {
+  if (mech == CKM_AES_GCM) {
     params = (unsigned char *) &gcmParams;
     paramsLength = sizeof(gcmParams);
     memset(&gcmParams, 0, sizeof(gcmParams));
     gcmParams.pIv = nonce;
     gcmParams.ulIvLen = sizeof(nonce);
-    gcmParams.pAAD = (unsigned char *)aadData;
-    gcmParams.ulAADLen = aadLen;
+#ifdef MOZQUIC_AEAD_CONTEXT
+    gcmParams.ulIvBits = sizeof(nonce) * 8; // pkcs11 v3 params
+#endif
     gcmParams.ulTagBits = 128;
   } else {
-    assert (mPacketProtectionMech == CKM_NSS_CHACHA20_POLY1305);
+    assert (mech == CKM_NSS_CHACHA20_POLY1305);
     params = (unsigned char *) &polyParams;
     paramsLength = sizeof(polyParams);
     memset(&polyParams, 0, sizeof(polyParams));
     polyParams.pNonce = nonce;
     polyParams.ulNonceLen = sizeof(nonce);
-    polyParams.pAAD = (unsigned char *)aadData;
-    polyParams.ulAADLen = aadLen;
     polyParams.ulTagLen = 16;
   }
-
-  unsigned int enlen = 0;
   SECItem param = {siBuffer, params, paramsLength};
-  uint32_t rv = MOZQUIC_OK;
-  if (encrypt) {
-    rv = PK11_Encrypt(mPacketProtectionSenderKey0, mPacketProtectionMech,
-                      &param, out, &enlen, outAvail,
-                      data, dataLen) == SECSuccess ? MOZQUIC_OK : MOZQUIC_ERR_GENERAL;
-  } else {
-    rv = PK11_Decrypt(mPacketProtectionReceiverKey0, mPacketProtectionMech,
-                      &param, out, &enlen, outAvail,
-                      data, dataLen) == SECSuccess ? MOZQUIC_OK : MOZQUIC_ERR_GENERAL;
+
+  for (uint32_t i = 0; i < count; i++) {
+    PacketBlock &b = blocks[i];
+    assert(encrypt ? (b.mOutAvail >= b.mDataLen + 16) : (b.mOutAvail + 16 >= b.mDataLen));
+    MakeNonce(iv, b.mPacketNumber, nonce);
+    if (mech == CKM_AES_GCM) {
+      gcmParams.pAAD = (unsigned char *)b.mAAD;
+      gcmParams.ulAADLen = b.mAADLen;
+    } else {
+      polyParams.pAAD = (unsigned char *)b.mAAD;
+      polyParams.ulAADLen = b.mAADLen;
+    }
+
+    unsigned int enlen = 0;
+    SECStatus srv;
+    if (encrypt) {
+      srv = PK11_Encrypt(key, mech,
+                         &param, b.mOut, &enlen, b.mOutAvail,
+                         b.mData, b.mDataLen);
+    } else {
+      srv = PK11_Decrypt(key, mech,
+                         &param, b.mOut, &enlen, b.mOutAvail,
+                         b.mData, b.mDataLen);
+    }
+    b.mWritten = (srv == SECSuccess) ? enlen : 0;
+    b.mResult = (srv == SECSuccess) ? MOZQUIC_OK : MOZQUIC_ERR_GENERAL;
+    if (b.mResult != MOZQUIC_OK) {
+      rv = b.mResult;
+    }
   }
-  written = enlen;
   return rv;
 }
 
+#ifdef MOZQUIC_AEAD_CONTEXT
+PK11Context *
+NSSHelper::CreateAEADContext(CK_MECHANISM_TYPE mech, PK11SymKey *key, bool encrypt)
+{
+  // message contexts use the pkcs11 v3 chacha mechanism
+  if (mech != CKM_AES_GCM) {
+    mech = CKM_CHACHA20_POLY1305;
+  }
+  SECItem noParam = {siBuffer, nullptr, 0};
+  return PK11_CreateContextBySymKey(mech, CKA_NSS_MESSAGE | (encrypt ? CKA_ENCRYPT : CKA_DECRYPT),
+                                    key, &noParam);
+}
+
+PK11Context *
+NSSHelper::CreateAEADContext(bool encrypt)
+{
+  return CreateAEADContext(mPacketProtectionMech,
+                           encrypt ? mPacketProtectionSenderKey0 : mPacketProtectionReceiverKey0,
+                           encrypt);
+}
+
+void
+NSSHelper::CreateAEADContexts()
+{
+  mPacketProtectionSenderContext0 = CreateAEADContext(true);
+  mPacketProtectionReceiverContext0 = CreateAEADContext(false);
+  if (!mPacketProtectionSenderContext0 || !mPacketProtectionReceiverContext0) {
+    if (mPacketProtectionSenderContext0) {
+      PK11_DestroyContext(mPacketProtectionSenderContext0, PR_TRUE);
+      mPacketProtectionSenderContext0 = nullptr;
+    }
+    if (mPacketProtectionReceiverContext0) {
+      PK11_DestroyContext(mPacketProtectionReceiverContext0, PR_TRUE);
+      mPacketProtectionReceiverContext0 = nullptr;
+    }
+    mAEADContextFailed = true;
+  }
+}
+#endif
+
 uint32_t
 NSSHelper::EncryptBlock(const unsigned char *aadData, uint32_t aadLen,
                         const unsigned char *plaintext, uint32_t plaintextLen,
                         uint64_t packetNumber, unsigned char *out,
                         uint32_t outAvail, uint32_t &written)
 {
-  return BlockOperation(true, aadData, aadLen, plaintext, plaintextLen,
-                        packetNumber, out, outAvail, written);
+  PacketBlock block = { aadData, aadLen, plaintext, plaintextLen, packetNumber,
+                        out, outAvail, 0, MOZQUIC_OK };
+  uint32_t rv = BatchOperation(true, &block, 1);
+  written = block.mWritten;
+  return rv;
 }
 
 uint32_t
@@ -607,8 +791,88 @@ NSSHelper::DecryptBlock(const unsigned char *aadData, uint32_t aadLen,
                         uint64_t packetNumber, unsigned char *out, uint32_t outAvail,
                         uint32_t &written)
 {
-  return BlockOperation(false, aadData, aadLen, ciphertext, ciphertextLen,
-                        packetNumber, out, outAvail, written);
+  PacketBlock block = { aadData, aadLen, ciphertext, ciphertextLen, packetNumber,
+                        out, outAvail, 0, MOZQUIC_OK };
+  uint32_t rv = BatchOperation(false, &block, 1);
+  written = block.mWritten;
+  return rv;
+}
+
+bool
+NSSHelper::MakeEarlyKeys()
+{
+  if (mEarlyKey) {
+    return true;
+  }
+#ifdef MOZQUIC_EARLY_DATA
+  SSLPreliminaryChannelInfo info;
+  if (!mNSSReady || mHandshakeFailed ||
+      SSL_GetPreliminaryChannelInfo(mFD, &info, sizeof(info)) != SECSuccess ||
+      !(info.valuesSet & ssl_preinfo_0rtt_cipher_suite)) {
+    return false;
+  }
+
+  unsigned int secretSize, keySize;
+  SSLHashType hashType;
+  CK_MECHANISM_TYPE importMechanism1, importMechanism2;
+  GetKeyParamsFromCipherSuite(info.zeroRttCipherSuite, secretSize, keySize, hashType,
+                              mEarlyMech, importMechanism1, importMechanism2);
+
+  const char *label = "EXPORTER-QUIC 0-RTT Secret";
+  unsigned char earlySecret[48];
+  assert(secretSize <= sizeof(earlySecret));
+  if (SSL_ExportEarlyKeyingMaterial(mFD, label, strlen(label), (const unsigned char *)"", 0,
+                                    earlySecret, secretSize) != SECSuccess) {
+    TlsLog1("early exporter failed: %s\n", PR_ErrorToName(PR_GetError()));
+    return false;
+  }
+  if (MakeKeyFromRaw(earlySecret, secretSize, keySize, hashType, importMechanism1,
+                     importMechanism2, mEarlyIV, &mEarlyKey) != MOZQUIC_OK) {
+    return false;
+  }
+  TlsLog5("0-RTT keys ready\n");
+  return true;
+#else
+  return false;
+#endif
+}
+
+uint32_t
+NSSHelper::EarlyBatch(bool encrypt, PacketBlock *blocks, uint32_t count)
+{
+  if (!mEarlyKey || (encrypt != mIsClient)) {
+    for (uint32_t i = 0; i < count; i++) {
+      blocks[i].mWritten = 0;
+      blocks[i].mResult = MOZQUIC_ERR_GENERAL;
+    }
+    return MOZQUIC_ERR_GENERAL;
+  }
+  return ProtectBlocks(encrypt, nullptr, mEarlyKey, mEarlyMech, mEarlyIV, blocks, count);
+}
+
+bool
+NSSHelper::EarlyDataAccepted()
+{
+#ifdef MOZQUIC_EARLY_DATA
+  SSLChannelInfo info;
+  return mHandshakeComplete && !mHandshakeFailed &&
+    (SSL_GetChannelInfo(mFD, &info, sizeof(info)) == SECSuccess) &&
+    info.earlyDataAccepted;
+#else
+  return false;
+#endif
+}
+
+uint32_t
+NSSHelper::EncryptBatch(PacketBlock *blocks, uint32_t count)
+{
+  return BatchOperation(true, blocks, count);
+}
+
+uint32_t
+NSSHelper::DecryptBatch(PacketBlock *blocks, uint32_t count)
+{
+  return BatchOperation(false, blocks, count);
 }
 
 SECStatus
@@ -624,8 +888,101 @@ NSSHelper::BadCertificate(void *client_data, PRFileDesc *fd)
   return self->mMozQuic->IgnorePKI() ? SECSuccess : SECFailure;
 }
 
+#ifdef MOZQUIC_RESUMPTION_TOKEN
+SECStatus
+NSSHelper::ResumptionTokenCallback(PRFileDesc *fd, const PRUint8 *token,
+                                   unsigned int len, void *ctx)
+{
+  NSSHelper *self = reinterpret_cast<NSSHelper *>(ctx);
+  sTlsLog5("session ticket for %s %d bytes\n", self->mTicketKey.c_str(), len);
+  TicketCache::Store(self->mTicketKey, token, len);
+  return SECSuccess;
+}
+#endif
+
+PRFileDesc *
+NSSHelper::MakeServerModel(MozQuic *parent, const char *originKey)
+{
+  PRFileDesc *model = PR_CreateIOLayerStub(nssHelperIdentity, &nssHelperMethods);
+  model->secret = nullptr; // never does io
+  PRFileDesc *fd = SSL_ImportFD(nullptr, model);
+  if (!fd) {
+    Log::sDoLog(Log::TLS, 1, parent, "server model socket failed\n");
+    model->dtor(model);
+    return nullptr;
+  }
+
+  // To disable any of the usual cipher suites..
+  // SSL_CipherPrefSet(fd, TLS_AES_128_GCM_SHA256, 0);
+  // SSL_CipherPrefSet(fd, TLS_AES_256_GCM_SHA384, 0);
+  // SSL_CipherPrefSet(fd, TLS_CHACHA20_POLY1305_SHA256, 0);
+
+  SSL_OptionSet(fd, SSL_SECURITY, true);
+  SSL_OptionSet(fd, SSL_HANDSHAKE_AS_CLIENT, false);
+  SSL_OptionSet(fd, SSL_HANDSHAKE_AS_SERVER, true);
+  SSL_OptionSet(fd, SSL_ENABLE_RENEGOTIATION, SSL_RENEGOTIATE_NEVER);
+  // tickets are sealed with keys nss makes for the process, so a
+  // resumed handshake needs no server side state beyond this
+  if (!sServerSessionCache) {
+    sServerSessionCache = true;
+    SSL_ConfigServerSessionIDCache(0, 0, 0, nullptr);
+  }
+  SSL_OptionSet(fd, SSL_NO_CACHE, false);
+  SSL_OptionSet(fd, SSL_ENABLE_SESSION_TICKETS, true);
+#ifdef MOZQUIC_EARLY_DATA
+  if (parent->GetEnable0RTT()) {
+    // one context for the process. nss turns early data away until a
+    // whole window has passed since it was made
+    if (!sAntiReplay &&
+        SSL_CreateAntiReplayContext(PR_Now(),
+                                    parent->GetAntiReplayWindow() * (PRTime) PR_USEC_PER_MSEC,
+                                    7, 14, &sAntiReplay) != SECSuccess) {
+      Log::sDoLog(Log::TLS, 1, parent, "anti replay context failed - no 0-RTT\n");
+      sAntiReplay = nullptr;
+    }
+    if (sAntiReplay) {
+      SSL_OptionSet(fd, SSL_ENABLE_0RTT_DATA, true);
+      SSL_SetAntiReplayContext(fd, sAntiReplay);
+    }
+  }
+#endif
+  SSL_OptionSet(fd, SSL_REQUEST_CERTIFICATE, false);
+  SSL_OptionSet(fd, SSL_REQUIRE_CERTIFICATE, SSL_REQUIRE_NEVER);
+
+  SSL_OptionSet(fd, SSL_ENABLE_NPN, false);
+  SSL_OptionSet(fd, SSL_ENABLE_ALPN, true);
+
+  SSLVersionRange range = {SSL_LIBRARY_VERSION_TLS_1_3,
+                           SSL_LIBRARY_VERSION_TLS_1_3};
+  SSL_VersionRangeSet(fd, &range);
+
+  unsigned char buffer[256];
+  assert(strlen(MozQuic::kAlpn) < 256);
+  buffer[0] = strlen(MozQuic::kAlpn);
+  memcpy(buffer + 1, MozQuic::kAlpn, strlen(MozQuic::kAlpn));
+  if (SSL_SetNextProtoNego(fd,
+                           buffer, strlen(MozQuic::kAlpn) + 1) != SECSuccess) {
+    Log::sDoLog(Log::TLS, 1, parent, "server model alpn failed\n");
+    PR_Close(fd);
+    return nullptr;
+  }
+
+  // the socket holds its own references to these
+  CERTCertificate *cert =
+    CERT_FindCertByNickname(CERT_GetDefaultCertDB(), originKey);
+  if (cert) {
+    SECKEYPrivateKey *key = PK11_FindKeyByAnyCert(cert, nullptr);
+    if (key) {
+      SSL_ConfigServerCert(fd, cert, key, nullptr, 0);
+      SECKEY_DestroyPrivateKey(key);
+    }
+    CERT_DestroyCertificate(cert);
+  }
+  return fd;
+}
+
 // server version
-NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *originKey)
+NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN)
   : mMozQuic(quicSession)
   , mNSSReady(false)
   , mHandshakeComplete(false)
@@ -633,11 +990,20 @@ NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *ori
   , mIsClient(false)
   , mTolerateBadALPN(tolerateBadALPN)
   , mDoHRR(false)
+  , mOfferedTicket(false)
   , mExternalCipherSuite(0)
   , mLocalTransportExtensionLen(0)
   , mRemoteTransportExtensionLen(0)
   , mPacketProtectionSenderKey0(nullptr)
   , mPacketProtectionReceiverKey0(nullptr)
+#ifdef MOZQUIC_AEAD_CONTEXT
+  , mPacketProtectionSenderContext0(nullptr)
+  , mPacketProtectionReceiverContext0(nullptr)
+  , mAEADContextFailed(false)
+#endif
+  , mEarlyMech(CKM_AES_GCM)
+  , mEarlyKey(nullptr)
+  , mHandshakeOffload(false)
 {
   PRNetAddr addr;
   memset(&addr,0,sizeof(addr));
@@ -647,56 +1013,20 @@ NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *ori
 
   mFD = PR_CreateIOLayerStub(nssHelperIdentity, &nssHelperMethods);
   mFD->secret = (struct PRFilePrivate *)this;
-  mFD = SSL_ImportFD(nullptr, mFD);
-
-  // To disable any of the usual cipher suites..
-  // SSL_CipherPrefSet(mFD, TLS_AES_128_GCM_SHA256, 0);
-  // SSL_CipherPrefSet(mFD, TLS_AES_256_GCM_SHA384, 0);
-  // SSL_CipherPrefSet(mFD, TLS_CHACHA20_POLY1305_SHA256, 0);
-
-  SSL_OptionSet(mFD, SSL_SECURITY, true);
-  SSL_OptionSet(mFD, SSL_HANDSHAKE_AS_CLIENT, false);
-  SSL_OptionSet(mFD, SSL_HANDSHAKE_AS_SERVER, true);
-  SSL_OptionSet(mFD, SSL_ENABLE_RENEGOTIATION, SSL_RENEGOTIATE_NEVER);
-  SSL_OptionSet(mFD, SSL_NO_CACHE, true);
-  SSL_OptionSet(mFD, SSL_ENABLE_SESSION_TICKETS, false);
-  SSL_OptionSet(mFD, SSL_REQUEST_CERTIFICATE, false);
-  SSL_OptionSet(mFD, SSL_REQUIRE_CERTIFICATE, SSL_REQUIRE_NEVER);
-
-  SSL_OptionSet(mFD, SSL_ENABLE_NPN, false);
-  SSL_OptionSet(mFD, SSL_ENABLE_ALPN, true);
+  bool sharedModel = true;
+  PRFileDesc *model = mMozQuic->GetServerModel(sharedModel);
+  mFD = SSL_ImportFD(model, mFD);
+  if (model && !sharedModel) {
+    PR_Close(model);
+  }
 
-  SSLVersionRange range = {SSL_LIBRARY_VERSION_TLS_1_3,
-                           SSL_LIBRARY_VERSION_TLS_1_3};
-  SSL_VersionRangeSet(mFD, &range);
+  // the callbacks are per connection
   SSL_HandshakeCallback(mFD, HandshakeCallback, nullptr);
-
-  if (mMozQuic->GetForceAddressValidation()) {
+  if (mMozQuic->AddressValidationNeeded()) {
     SSL_HelloRetryRequestCallback(mFD, HRRCallback, this);
   }
 
-  mNSSReady = true;
-
-  unsigned char buffer[256];
-  assert(strlen(MozQuic::kAlpn) < 256);
-  buffer[0] = strlen(MozQuic::kAlpn);
-  memcpy(buffer + 1, MozQuic::kAlpn, strlen(MozQuic::kAlpn));
-  if (SSL_SetNextProtoNego(mFD,
-                           buffer, strlen(MozQuic::kAlpn) + 1) != SECSuccess) {
-    mNSSReady = false;
-  }
-
-  CERTCertificate *cert =
-    CERT_FindCertByNickname(CERT_GetDefaultCertDB(), originKey);
-  if (cert) {
-    SECKEYPrivateKey *key = PK11_FindKeyByAnyCert(cert, nullptr);
-    if (key) {
-      SECStatus rv = SSL_ConfigServerCert(mFD, cert, key, nullptr, 0);
-      if (mNSSReady && rv == SECSuccess) {
-        mNSSReady = true;
-      }
-    }
-  }
+  mNSSReady = (model != nullptr);
 
   SSLExtensionSupport supportTransportParameters;
   if (SSL_GetExtensionSupport(kTransportParametersID, &supportTransportParameters) == SECSuccess &&
@@ -727,11 +1057,21 @@ NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *ori
   , mHandshakeFailed(false)
   , mIsClient(true)
   , mTolerateBadALPN(tolerateBadALPN)
+  , mDoHRR(false)
+  , mOfferedTicket(false)
   , mExternalCipherSuite(0)
   , mLocalTransportExtensionLen(0)
   , mRemoteTransportExtensionLen(0)
   , mPacketProtectionSenderKey0(nullptr)
   , mPacketProtectionReceiverKey0(nullptr)
+#ifdef MOZQUIC_AEAD_CONTEXT
+  , mPacketProtectionSenderContext0(nullptr)
+  , mPacketProtectionReceiverContext0(nullptr)
+  , mAEADContextFailed(false)
+#endif
+  , mEarlyMech(CKM_AES_GCM)
+  , mEarlyKey(nullptr)
+  , mHandshakeOffload(false)
 {
   // todo most of this can be put in an init routine shared between c/s
 
@@ -748,8 +1088,16 @@ NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *ori
   SSL_OptionSet(mFD, SSL_HANDSHAKE_AS_CLIENT, true);
   SSL_OptionSet(mFD, SSL_HANDSHAKE_AS_SERVER, false);
   SSL_OptionSet(mFD, SSL_ENABLE_RENEGOTIATION, SSL_RENEGOTIATE_NEVER);
+#ifdef MOZQUIC_RESUMPTION_TOKEN
+  // tickets go to TicketCache through ResumptionTokenCallback rather
+  // than the nss internal cache
+  SSL_OptionSet(mFD, SSL_NO_CACHE, false);
+  SSL_OptionSet(mFD, SSL_ENABLE_SESSION_TICKETS, true);
+  SSL_SetResumptionTokenCallback(mFD, ResumptionTokenCallback, this);
+#else
   SSL_OptionSet(mFD, SSL_NO_CACHE, true); // todo why does this cause fails?
   SSL_OptionSet(mFD, SSL_ENABLE_SESSION_TICKETS, false);
+#endif
   SSL_OptionSet(mFD, SSL_REQUEST_CERTIFICATE, false);
   SSL_OptionSet(mFD, SSL_REQUIRE_CERTIFICATE, SSL_REQUIRE_NEVER);
 
@@ -785,6 +1133,26 @@ NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *ori
 
   SSL_SetURL(mFD, originKey);
 
+#ifdef MOZQUIC_RESUMPTION_TOKEN
+  mTicketKey = TicketCache::Key(originKey, mMozQuic->GetOriginPort());
+  std::vector<unsigned char> token;
+  if (TicketCache::Lookup(mTicketKey, token)) {
+    // nss refuses tokens that have expired or don't parse
+    if (SSL_SetResumptionToken(mFD, token.data(), token.size()) == SECSuccess) {
+      mOfferedTicket = true;
+      TlsLog5("offering session ticket for %s\n", mTicketKey.c_str());
+#ifdef MOZQUIC_EARLY_DATA
+      if (mMozQuic->GetEnable0RTT()) {
+        // only used if the ticket allows it
+        SSL_OptionSet(mFD, SSL_ENABLE_0RTT_DATA, true);
+      }
+#endif
+    } else {
+      TicketCache::Remove(mTicketKey);
+    }
+  }
+#endif
+
   SSLExtensionSupport supportTransportParameters;
   if (SSL_GetExtensionSupport(kTransportParametersID, &supportTransportParameters) == SECSuccess &&
       supportTransportParameters != ssl_ext_native_only &&
@@ -806,6 +1174,15 @@ NSSHelper::nssHelperWrite(PRFileDesc *fd, const void *aBuf, int32_t aAmount)
   // data (e.g. server hello) has come from nss and needs to be written into MozQuic
   // to be written out to the network in stream 0
   NSSHelper *self = reinterpret_cast<NSSHelper *>(fd->secret);
+  if (!self) { // closing
+    return aAmount;
+  }
+  if (self->mHandshakeOffload) {
+    std::lock_guard<std::mutex> lock(self->mHandshakeLock);
+    const unsigned char *data = (const unsigned char *)aBuf;
+    self->mHandshakeOut.insert(self->mHandshakeOut.end(), data, data + aAmount);
+    return aAmount;
+  }
   self->mMozQuic->NSSOutput(aBuf, aAmount);
   return aAmount;
 }
@@ -823,9 +1200,49 @@ NSSHelper::nssHelperRead(PRFileDesc *fd, void *buf, int32_t amount)
   // nss is asking for input, i.e. a client hello from stream 0 after
   // stream reassembly
   NSSHelper *self = reinterpret_cast<NSSHelper *>(fd->secret);
+  if (!self) { // closing
+    PR_SetError(PR_WOULD_BLOCK_ERROR, 0);
+    return -1;
+  }
+  if (self->mHandshakeOffload) {
+    std::lock_guard<std::mutex> lock(self->mHandshakeLock);
+    if (self->mHandshakeIn.empty()) {
+      PR_SetError(PR_WOULD_BLOCK_ERROR, 0);
+      return -1;
+    }
+    int32_t amt = amount;
+    if ((size_t)amt > self->mHandshakeIn.size()) {
+      amt = self->mHandshakeIn.size();
+    }
+    memcpy(buf, self->mHandshakeIn.data(), amt);
+    self->mHandshakeIn.erase(self->mHandshakeIn.begin(), self->mHandshakeIn.begin() + amt);
+    return amt;
+  }
   return self->mMozQuic->NSSInput(buf, amount);
 }
 
+void
+NSSHelper::HandshakeInput(const unsigned char *data, uint32_t len)
+{
+  std::lock_guard<std::mutex> lock(mHandshakeLock);
+  mHandshakeIn.insert(mHandshakeIn.end(), data, data + len);
+}
+
+bool
+NSSHelper::HandshakeInputPending()
+{
+  std::lock_guard<std::mutex> lock(mHandshakeLock);
+  return !mHandshakeIn.empty();
+}
+
+void
+NSSHelper::TakeHandshakeOutput(std::vector<unsigned char> &out)
+{
+  std::lock_guard<std::mutex> lock(mHandshakeLock);
+  out.swap(mHandshakeOut);
+  mHandshakeOut.clear();
+}
+
 int32_t
 NSSHelper::nssHelperRecv(PRFileDesc *fd, void *buf, int32_t amount, int flags,
                            PRIntervalTime timeout)
@@ -851,12 +1268,29 @@ NSSHelper::NSPRGetSocketOption(PRFileDesc *aFD, PRSocketOptionData *aOpt)
   return PR_FAILURE;
 }
 
+PRStatus
+NSSHelper::NSPRSetSocketOption(PRFileDesc *aFD, const PRSocketOptionData *aOpt)
+{
+  // nss turns off nagle to push out the close_notify alert. The default
+  // method would pass that to a lower layer, and the stub has none
+  return PR_SUCCESS;
+}
+
 PRStatus
 NSSHelper::nssHelperConnect(PRFileDesc *fd, const PRNetAddr *addr, PRIntervalTime to)
 {
   return PR_SUCCESS;
 }
 
+PRStatus
+NSSHelper::nssHelperClose(PRFileDesc *fd)
+{
+  // there is no os socket under the stub
+  fd->secret = nullptr;
+  fd->dtor(fd);
+  return PR_SUCCESS;
+}
+
 uint32_t
 NSSHelper::DriveHandshake()
 {
@@ -890,6 +1324,23 @@ NSSHelper::DriveHandshake()
   return MOZQUIC_ERR_GENERAL;
 }
 
+uint32_t
+NSSHelper::DrivePostHandshake()
+{
+  if (!mHandshakeComplete || mHandshakeFailed) {
+    return MOZQUIC_OK;
+  }
+  // there is no application data on stream 0, reading just lets nss
+  // process whatever post handshake messages have arrived
+  char data[256];
+  if (PR_Read(mFD, data, sizeof(data)) >= 0 ||
+      PR_GetError() == PR_WOULD_BLOCK_ERROR) {
+    return MOZQUIC_OK;
+  }
+  TlsLog1("post handshake err: %s\n", PR_ErrorToName(PR_GetError()));
+  return MOZQUIC_ERR_CRYPTO;
+}
+
 PRBool
 NSSHelper::TransportExtensionWriter(PRFileDesc *fd, SSLHandshakeType m,
                                     PRUint8 *data, unsigned int *len, unsigned int maxlen, void *arg)
@@ -951,12 +1402,36 @@ NSSHelper::SetRemoteTransportExtensionInfo(const unsigned char *data, uint16_t d
 
 NSSHelper::~NSSHelper()
 {
+#ifdef MOZQUIC_AEAD_CONTEXT
+  if (mPacketProtectionSenderContext0) {
+    PK11_DestroyContext(mPacketProtectionSenderContext0, PR_TRUE);
+  }
+  if (mPacketProtectionReceiverContext0) {
+    PK11_DestroyContext(mPacketProtectionReceiverContext0, PR_TRUE);
+  }
+#endif
+  for (auto i = mWorkerContexts.begin(); i != mWorkerContexts.end(); ++i) {
+    if (*i) {
+      PK11_DestroyContext(*i, PR_TRUE);
+    }
+  }
   if (mPacketProtectionSenderKey0) {
     PK11_FreeSymKey(mPacketProtectionSenderKey0);
   }
   if (mPacketProtectionReceiverKey0) {
     PK11_FreeSymKey(mPacketProtectionReceiverKey0);
   }
+  if (mEarlyKey) {
+    PK11_FreeSymKey(mEarlyKey);
+  }
+  if (mFD) {
+    // nss may send an alert on the way out. mMozQuic can't take it now
+    PRFileDesc *stub = PR_GetIdentitiesLayer(mFD, nssHelperIdentity);
+    if (stub) {
+      stub->secret = nullptr;
+    }
+    PR_Close(mFD);
+  }
 }
 
 }
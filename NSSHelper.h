@@ -5,11 +5,34 @@
 
 #pragma once
 
+#include "nss.h"
 #include "prio.h"
 #include "ssl.h"
 #include "pk11pub.h"
 #include "ssl.h"
 #include "sslexp.h"
+#include <mutex>
+#include <string>
+#include <vector>
+
+// NSS 3.52 added message based AEAD contexts. One context keeps its key
+// schedule from packet to packet, where PK11_Encrypt/PK11_Decrypt set up
+// a new one for every call.
+#if (NSS_VMAJOR > 3) || ((NSS_VMAJOR == 3) && (NSS_VMINOR >= 52))
+#define MOZQUIC_AEAD_CONTEXT 1
+#endif
+
+// the external session cache API (resumption tokens) is complete as of
+// NSS 3.41. Without it tickets are neither kept nor offered.
+#if (NSS_VMAJOR > 3) || ((NSS_VMAJOR == 3) && (NSS_VMINOR >= 41))
+#define MOZQUIC_RESUMPTION_TOKEN 1
+#endif
+
+// 0-RTT needs NSS 3.43 - per socket anti-replay contexts and the 0-RTT
+// cipher suite in the preliminary channel info.
+#if (NSS_VMAJOR > 3) || ((NSS_VMAJOR == 3) && (NSS_VMINOR >= 43))
+#define MOZQUIC_EARLY_DATA 1
+#endif
 
 namespace mozquic {
 
@@ -19,10 +42,17 @@ class NSSHelper final
 {
 public:
   static int Init(char *dir);
-  NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *originKey);
+  NSSHelper(MozQuic *quicSession, bool tolerateBadALPN); // server, see MakeServerModel
   NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *originKey, bool clientindicator); // todo, subclass
   ~NSSHelper();
+  // a server parent makes one of these and each child's socket is
+  // imported from it - options, alpn and the cert/key are set up once
+  // instead of per connection. PR_Close it when the parent goes.
+  static PRFileDesc *MakeServerModel(MozQuic *parent, const char *originKey);
   uint32_t DriveHandshake();
+  // after the handshake the server still sends session tickets on
+  // stream 0. this reads them through the tls layer (client)
+  uint32_t DrivePostHandshake();
   bool IsHandshakeComplete() { return mHandshakeComplete; }
   uint32_t HandshakeSecret(unsigned int ciphersuite, unsigned char *sendSecret, unsigned char *recvSecret);
 
@@ -36,6 +66,53 @@ public:
                         uint64_t packetNumber, unsigned char *out, uint32_t outAvail,
                         uint32_t &written);
 
+  // one packet of a batch. mOut may be mData to work in place. mWritten
+  // and mResult are filled in for each block
+  struct PacketBlock
+  {
+    const unsigned char *mAAD;
+    uint32_t             mAADLen;
+    const unsigned char *mData;
+    uint32_t             mDataLen;
+    uint64_t             mPacketNumber;
+    unsigned char       *mOut;
+    uint32_t             mOutAvail;
+    uint32_t             mWritten;
+    uint32_t             mResult;
+  };
+
+  // protect or open count packets with one round of key and context
+  // setup. returns MOZQUIC_OK only if every block succeeded.
+  uint32_t EncryptBatch(PacketBlock *blocks, uint32_t count);
+  uint32_t DecryptBatch(PacketBlock *blocks, uint32_t count);
+
+  // 0-RTT. A resuming client offers early data when its ticket allows it.
+  // MakeEarlyKeys() derives the key once the ClientHello has been written
+  // (client) or read and the early data accepted (server) and fails if
+  // there is none. Early packets are only ever client to server, so the
+  // client seals with this key and the server opens with it.
+  bool OfferedTicket() { return mOfferedTicket; }
+  bool MakeEarlyKeys();
+  bool EarlyKeysReady() { return mEarlyKey != nullptr; }
+  uint32_t EarlyBatch(bool encrypt, PacketBlock *blocks, uint32_t count);
+  bool EarlyDataAccepted(); // once the handshake is complete
+
+  // crypto worker support (see CryptoPool). Workers each get their own
+  // contexts so no two threads share one.
+  bool PacketProtectionReady();
+  void SetCryptoWorkers(uint32_t count);
+  uint32_t WorkerBatch(uint32_t worker, bool encrypt, PacketBlock *blocks, uint32_t count);
+
+  // the per packet loop under the batches. With a context (see
+  // CreateAEADContext) each packet is one PK11_AEADOp, without one it is a
+  // PK11_Encrypt/PK11_Decrypt. tests/bench/aead-bench times the two.
+  static uint32_t ProtectBlocks(bool encrypt, PK11Context *context, PK11SymKey *key,
+                                CK_MECHANISM_TYPE mech, const unsigned char *iv,
+                                PacketBlock *blocks, uint32_t count);
+#ifdef MOZQUIC_AEAD_CONTEXT
+  static PK11Context *CreateAEADContext(CK_MECHANISM_TYPE mech, PK11SymKey *key, bool encrypt);
+#endif
+
   bool SetLocalTransportExtensionInfo(const unsigned char *data, uint16_t datalen); // local data to send
   bool SetRemoteTransportExtensionInfo(const unsigned char *data, uint16_t datalen); // remote data recvd
   void GetRemoteTransportExtensionInfo(unsigned char * &_output, uint16_t &actual) {
@@ -47,10 +124,25 @@ public:
 
   bool DoHRR() {return mDoHRR;}
 
+  // handshake offload (server). Once set, the TLS layer reads stream 0
+  // input from and writes its output to buffers here instead of calling
+  // into MozQuic, so DriveHandshake() can run on a worker while IO()
+  // shuttles the bytes on the connection thread.
+  void SetHandshakeOffload() {
+    if (!mHandshakeOffload) { // a running task reads it
+      mHandshakeOffload = true;
+    }
+  }
+  void HandshakeInput(const unsigned char *data, uint32_t len);
+  bool HandshakeInputPending();
+  void TakeHandshakeOutput(std::vector<unsigned char> &out);
+
 private:
   static PRStatus NSPRGetPeerName(PRFileDesc *aFD, PRNetAddr*addr);
   static PRStatus NSPRGetSocketOption(PRFileDesc *aFD, PRSocketOptionData *aOpt);
+  static PRStatus NSPRSetSocketOption(PRFileDesc *aFD, const PRSocketOptionData *aOpt);
   static PRStatus nssHelperConnect(PRFileDesc *fd, const PRNetAddr *addr, PRIntervalTime to);
+  static PRStatus nssHelperClose(PRFileDesc *fd);
   static int nssHelperWrite(PRFileDesc *aFD, const void *aBuf, int32_t aAmount);
   static int nssHelperSend(PRFileDesc *aFD, const void *aBuf, int32_t aAmount,
                            int , PRIntervalTime);
@@ -64,16 +156,22 @@ private:
                                                 void *arg);
   static void HandshakeCallback(PRFileDesc *fd, void *client_data);
   static SECStatus BadCertificate(void *client_data, PRFileDesc *fd);
+#ifdef MOZQUIC_RESUMPTION_TOKEN
+  static SECStatus ResumptionTokenCallback(PRFileDesc *fd, const PRUint8 *token,
+                                           unsigned int len, void *ctx);
+#endif
 
   static PRBool TransportExtensionWriter(PRFileDesc *fd, SSLHandshakeType m, PRUint8 *data,
                                          unsigned int *len, unsigned int maxlen, void *arg);
   static SECStatus TransportExtensionHandler(PRFileDesc *fd, SSLHandshakeType m, const PRUint8 *data,
                                              unsigned int len, SSLAlertDescription *alert, void *arg);
   
-  uint32_t BlockOperation(bool encrypt, const unsigned char *aeadData, uint32_t aeadLen,
-                          const unsigned char *plaintext, uint32_t plaintextLen,
-                          uint64_t packetNumber, unsigned char *out, uint32_t outAvail,
-                          uint32_t &written);
+  uint32_t BatchOperation(bool encrypt, PacketBlock *blocks, uint32_t count);
+  uint32_t ProtectBatch(bool encrypt, PK11Context *context, PacketBlock *blocks, uint32_t count);
+#ifdef MOZQUIC_AEAD_CONTEXT
+  PK11Context *CreateAEADContext(bool encrypt);
+  void CreateAEADContexts();
+#endif
   uint32_t MakeKeyFromNSS(PRFileDesc *fd, const char *label,
                           unsigned int secretSize, unsigned int keySize, SSLHashType hashType,
                           CK_MECHANISM_TYPE importMechanism1, CK_MECHANISM_TYPE importMechanism2,
@@ -99,6 +197,8 @@ private:
   bool                 mTolerateBadALPN;
 
   bool                mDoHRR;
+  std::string         mTicketKey;     // client, see TicketCache
+  bool                mOfferedTicket; // client
 
   unsigned char       mExternalSendSecret[48];
   unsigned char       mExternalRecvSecret[48];
@@ -114,6 +214,23 @@ private:
   unsigned char       mPacketProtectionSenderIV0[12];
   PK11SymKey         *mPacketProtectionReceiverKey0;
   unsigned char       mPacketProtectionReceiverIV0[12];
+#ifdef MOZQUIC_AEAD_CONTEXT
+  // made from the keys above on first use, then only the nonce and aad
+  // change per packet
+  PK11Context        *mPacketProtectionSenderContext0;
+  PK11Context        *mPacketProtectionReceiverContext0;
+  bool                mAEADContextFailed; // use PK11_Encrypt/Decrypt instead
+#endif
+  std::vector<PK11Context *> mWorkerContexts; // sender, receiver per crypto worker
+
+  CK_MECHANISM_TYPE   mEarlyMech;
+  PK11SymKey         *mEarlyKey; // client sends, server receives
+  unsigned char       mEarlyIV[12];
+
+  bool                       mHandshakeOffload;
+  std::mutex                 mHandshakeLock; // for the two buffers
+  std::vector<unsigned char> mHandshakeIn;
+  std::vector<unsigned char> mHandshakeOut;
 };
 
 } //namespace
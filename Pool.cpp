@@ -0,0 +1,314 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "Pool.h"
+#include "MozQuic.h"
+#include "MozQuicInternal.h"
+#include "Streams.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <mutex>
+#include <new>
+
+namespace mozquic  {
+
+FreeList::FreeList(size_t size, uint32_t max, size_t align, uint64_t *budget)
+  : mHead(nullptr)
+  , mSize(size)
+  , mAlign(align)
+  , mCount(0)
+  , mMax(max)
+  , mBudget(budget)
+{
+  assert(size >= sizeof(Block));
+}
+
+FreeList::~FreeList()
+{
+  while (mHead) {
+    Block *b = mHead;
+    mHead = b->mNext;
+    HeapFree(b, mAlign);
+  }
+}
+
+void *
+FreeList::HeapAlloc(size_t size, size_t align)
+{
+  if (!align) {
+    return ::operator new(size);
+  }
+  void *p = nullptr;
+  if (posix_memalign(&p, align, size)) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void
+FreeList::HeapFree(void *p, size_t align)
+{
+  if (!align) {
+    ::operator delete(p);
+  } else {
+    free(p);
+  }
+}
+
+void *
+FreeList::Alloc()
+{
+  if (mHead) {
+    Block *b = mHead;
+    mHead = b->mNext;
+    mCount--;
+    if (mBudget) {
+      *mBudget += mSize;
+    }
+    mStats.Hit();
+    return b;
+  }
+  mStats.Miss();
+  return HeapAlloc(mSize, mAlign);
+}
+
+void
+FreeList::Free(void *p)
+{
+  if (!p) {
+    return;
+  }
+  if ((mCount >= mMax) || (mBudget && (*mBudget < mSize))) {
+    HeapFree(p, mAlign);
+    return;
+  }
+  if (mBudget) {
+    *mBudget -= mSize;
+  }
+  Block *b = static_cast<Block *>(p);
+  b->mNext = mHead;
+  mHead = b;
+  mCount++;
+}
+
+// the lists are thread locals with destructors, so a thread can free (or
+// even allocate) after its lists are gone. These flags have no destructor
+// and stay readable for the whole life of the thread.
+static thread_local bool sReliableDataGone;
+static thread_local bool sBuffersGone;
+
+// Every thread's lists are linked here so GetStats can sum them. A
+// thread's counts move into the retired totals when its lists go away.
+// None of this has a destructor, so threads that exit late still find it.
+class ThreadLists;
+static std::mutex sThreadListsLock;
+static ThreadLists *sThreadLists;
+static uint64_t sRetired[4]; // frame hit, frame miss, buffer hit, buffer miss
+
+class ThreadLists
+{
+public:
+  ThreadLists()
+    : mPrev(nullptr)
+    , mNext(nullptr)
+  {
+  }
+
+  virtual ~ThreadLists()
+  {
+  }
+
+  // Link and Unlink are called by the most derived class while its lists
+  // exist
+  void Link()
+  {
+    std::lock_guard<std::mutex> lock(sThreadListsLock);
+    mNext = sThreadLists;
+    if (mNext) {
+      mNext->mPrev = this;
+    }
+    sThreadLists = this;
+  }
+
+  void Unlink()
+  {
+    std::lock_guard<std::mutex> lock(sThreadListsLock);
+    AddStats(sRetired);
+    if (mPrev) {
+      mPrev->mNext = mNext;
+    } else {
+      sThreadLists = mNext;
+    }
+    if (mNext) {
+      mNext->mPrev = mPrev;
+    }
+  }
+
+  virtual void AddStats(uint64_t *totals) = 0;
+
+  ThreadLists *mPrev;
+  ThreadLists *mNext;
+};
+
+class ReliableDataLists : public ThreadLists
+{
+public:
+  ReliableDataLists()
+    : mList(sizeof(ReliableData), kPoolMaxReliableData, alignof(ReliableData))
+  {
+    Link();
+  }
+
+  ~ReliableDataLists()
+  {
+    sReliableDataGone = true;
+    Unlink();
+  }
+
+  void AddStats(uint64_t *totals) override
+  {
+    totals[0] += mList.mStats.mHits.load(std::memory_order_relaxed);
+    totals[1] += mList.mStats.mMisses.load(std::memory_order_relaxed);
+  }
+
+  FreeList mList;
+};
+
+static FreeList &
+ReliableDataList()
+{
+  static thread_local ReliableDataLists lists;
+  return lists.mList;
+}
+
+class BufferLists : public ThreadLists
+{
+public:
+  BufferLists()
+    : mBudget(kPoolMaxBufferTotal)
+  {
+    for (int i = 0; i < kPoolBufferClasses; i++) {
+      uint64_t size = (uint64_t)kStreamRingMinimum << i;
+      uint32_t max = kPoolMaxBufferBytes / size;
+      mLists[i] = new FreeList(size, max > 64 ? 64 : max, 0, &mBudget);
+    }
+    Link();
+  }
+
+  ~BufferLists()
+  {
+    sBuffersGone = true;
+    Unlink();
+    for (int i = 0; i < kPoolBufferClasses; i++) {
+      delete mLists[i];
+      mLists[i] = nullptr;
+    }
+  }
+
+  void AddStats(uint64_t *totals) override
+  {
+    totals[3] += mUncached.mMisses.load(std::memory_order_relaxed);
+    for (int i = 0; i < kPoolBufferClasses; i++) {
+      totals[2] += mLists[i]->mStats.mHits.load(std::memory_order_relaxed);
+      totals[3] += mLists[i]->mStats.mMisses.load(std::memory_order_relaxed);
+    }
+  }
+
+  // nullptr for sizes that are not cached
+  FreeList *ForSize(uint64_t size)
+  {
+    for (int i = 0; i < kPoolBufferClasses; i++) {
+      if (size == ((uint64_t)kStreamRingMinimum << i)) {
+        return mLists[i];
+      }
+    }
+    return nullptr;
+  }
+
+  FreeList *mLists[kPoolBufferClasses];
+  PoolStats mUncached;
+  uint64_t  mBudget; // bytes the lists may still keep
+};
+
+static BufferLists &
+Buffers()
+{
+  static thread_local BufferLists lists;
+  return lists;
+}
+
+void *
+Pool::AllocReliableData(size_t size)
+{
+  assert(size == sizeof(ReliableData));
+  if (sReliableDataGone) {
+    return FreeList::HeapAlloc(sizeof(ReliableData), alignof(ReliableData));
+  }
+  return ReliableDataList().Alloc();
+}
+
+void
+Pool::FreeReliableData(void *p)
+{
+  if (sReliableDataGone) {
+    if (p) {
+      FreeList::HeapFree(p, alignof(ReliableData));
+    }
+    return;
+  }
+  ReliableDataList().Free(p);
+}
+
+unsigned char *
+Pool::AllocBuffer(uint64_t size)
+{
+  if (sBuffersGone) {
+    return static_cast<unsigned char *>(::operator new(size));
+  }
+  FreeList *list = Buffers().ForSize(size);
+  if (!list) {
+    Buffers().mUncached.Miss();
+    return static_cast<unsigned char *>(::operator new(size));
+  }
+  return static_cast<unsigned char *>(list->Alloc());
+}
+
+void
+Pool::FreeBuffer(unsigned char *p, uint64_t size)
+{
+  if (!p) {
+    return;
+  }
+  if (sBuffersGone) {
+    ::operator delete(p);
+    return;
+  }
+  FreeList *list = Buffers().ForSize(size);
+  if (!list) {
+    ::operator delete(p);
+    return;
+  }
+  list->Free(p);
+}
+
+void
+Pool::GetStats(struct mozquic_pool_stats *stats)
+{
+  uint64_t totals[4];
+  std::lock_guard<std::mutex> lock(sThreadListsLock);
+  for (int i = 0; i < 4; i++) {
+    totals[i] = sRetired[i];
+  }
+  for (ThreadLists *lists = sThreadLists; lists; lists = lists->mNext) {
+    lists->AddStats(totals);
+  }
+  stats->frameHits = totals[0];
+  stats->frameMisses = totals[1];
+  stats->bufferHits = totals[2];
+  stats->bufferMisses = totals[3];
+}
+
+} // namespace
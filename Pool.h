@@ -0,0 +1,89 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+struct mozquic_pool_stats;
+
+namespace mozquic  {
+
+enum {
+  kPoolMaxReliableData = 4096,           // cached per thread
+  kPoolBufferClasses = 9,                // ring sizes 4KB .. 1MB
+  kPoolMaxBufferBytes = 1024 * 1024,     // cached per thread per size class
+  kPoolMaxBufferTotal = 4 * 1024 * 1024  // cached per thread over all classes
+};
+
+// only the thread that owns a list writes its counters, any thread may
+// read them
+struct PoolStats
+{
+  PoolStats() : mHits(0), mMisses(0) {}
+
+  void Hit() { mHits.store(mHits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+  void Miss() { mMisses.store(mMisses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+
+  std::atomic<uint64_t> mHits;   // served from a free list
+  std::atomic<uint64_t> mMisses; // went to malloc
+};
+
+// FreeList keeps up to max released blocks of one size for reuse. If
+// align is given the blocks are allocated on that boundary. If budget is
+// given it is a byte count shared with other lists - a block is only kept
+// while the budget covers it.
+class FreeList
+{
+public:
+  FreeList(size_t size, uint32_t max, size_t align = 0, uint64_t *budget = nullptr);
+  ~FreeList();
+
+  void *Alloc();
+  void Free(void *p);
+
+  // what the list does when it has nothing cached, for use without one
+  static void *HeapAlloc(size_t size, size_t align);
+  static void HeapFree(void *p, size_t align);
+
+  PoolStats mStats;
+
+private:
+  struct Block
+  {
+    Block *mNext;
+  };
+
+  Block    *mHead;
+  size_t    mSize;
+  size_t    mAlign;
+  uint32_t  mCount;
+  uint32_t  mMax;
+  uint64_t *mBudget;
+};
+
+// Pool hands out the objects and buffers the frame path churns through:
+// ReliableData and the power of 2 sized storage behind stream rings. The
+// free lists are per thread so nothing is locked. Memory freed on a
+// different thread than it was allocated on just lands in the freeing
+// thread's list, and memory freed once the thread's lists are torn down
+// goes straight to the heap.
+class Pool
+{
+public:
+  static void *AllocReliableData(size_t size);
+  static void FreeReliableData(void *p);
+
+  // size must be a power of 2
+  static unsigned char *AllocBuffer(uint64_t size);
+  static void FreeBuffer(unsigned char *p, uint64_t size);
+
+  // summed over every thread that has used the pool
+  static void GetStats(struct mozquic_pool_stats *stats);
+};
+
+} // namespace
@@ -0,0 +1,467 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "StreamBuffer.h"
+#include "Pool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace mozquic  {
+
+StreamRing::StreamRing(uint64_t base)
+  : mBuffer(nullptr)
+  , mCapacity(0)
+  , mBase(base)
+  , mEnd(base)
+{
+}
+
+StreamRing::~StreamRing()
+{
+  FreeBuffer();
+}
+
+void
+StreamRing::FreeBuffer()
+{
+  Pool::FreeBuffer(mBuffer, mCapacity);
+  mBuffer = nullptr;
+  mCapacity = 0;
+}
+
+void
+StreamRing::Grow(uint64_t needed)
+{
+  uint64_t newCapacity = mCapacity ? mCapacity : (uint64_t)kStreamRingMinimum;
+  while (newCapacity < needed) {
+    newCapacity <<= 1;
+  }
+  if (newCapacity == mCapacity) {
+    return;
+  }
+
+  unsigned char *newBuffer = Pool::AllocBuffer(newCapacity);
+  // move the live bytes to their new positions. Do it in at most
+  // two runs - one for each side of the old wrap point.
+  uint64_t offset = mBase;
+  while (offset < mEnd) {
+    uint64_t pos = offset & (mCapacity - 1);
+    uint64_t run = mCapacity - pos;
+    if (run > mEnd - offset) {
+      run = mEnd - offset;
+    }
+    uint64_t newPos = offset & (newCapacity - 1);
+    // the new ring is bigger, so a run from the old ring can wrap at most once
+    uint64_t first = newCapacity - newPos;
+    if (first > run) {
+      first = run;
+    }
+    memcpy(newBuffer + newPos, mBuffer + pos, first);
+    if (run > first) {
+      memcpy(newBuffer, mBuffer + pos + first, run - first);
+    }
+    offset += run;
+  }
+  FreeBuffer();
+  mBuffer = newBuffer;
+  mCapacity = newCapacity;
+}
+
+void
+StreamRing::Append(const unsigned char *data, uint32_t len)
+{
+  if (!len) {
+    return;
+  }
+  if (mEnd + len - mBase > mCapacity) {
+    Grow(mEnd + len - mBase);
+  }
+  uint64_t pos = mEnd & (mCapacity - 1);
+  uint64_t first = mCapacity - pos;
+  if (first > len) {
+    first = len;
+  }
+  memcpy(mBuffer + pos, data, first);
+  if (len > first) {
+    memcpy(mBuffer, data + first, len - first);
+  }
+  mEnd += len;
+}
+
+void
+StreamRing::Write(uint64_t offset, const unsigned char *data, uint32_t len)
+{
+  assert(offset >= mBase);
+  if (!len) {
+    return;
+  }
+  if (offset + len - mBase > mCapacity) {
+    Grow(offset + len - mBase);
+  }
+  uint64_t pos = offset & (mCapacity - 1);
+  uint64_t first = mCapacity - pos;
+  if (first > len) {
+    first = len;
+  }
+  memcpy(mBuffer + pos, data, first);
+  if (len > first) {
+    memcpy(mBuffer, data + first, len - first);
+  }
+  if (offset + len > mEnd) {
+    mEnd = offset + len;
+  }
+}
+
+void
+StreamRing::Copy(uint64_t offset, unsigned char *dest, uint32_t len)
+{
+  assert(offset >= mBase);
+  assert(offset + len <= mEnd);
+  if (!len) {
+    return;
+  }
+  uint64_t pos = offset & (mCapacity - 1);
+  uint64_t first = mCapacity - pos;
+  if (first > len) {
+    first = len;
+  }
+  memcpy(dest, mBuffer + pos, first);
+  if (len > first) {
+    memcpy(dest + first, mBuffer, len - first);
+  }
+}
+
+uint32_t
+StreamRing::Peek(uint64_t offset, const unsigned char *&ptr, uint32_t len)
+{
+  assert(offset >= mBase);
+  assert(offset + len <= mEnd);
+  ptr = nullptr;
+  if (!len) {
+    return 0;
+  }
+  uint64_t pos = offset & (mCapacity - 1);
+  ptr = mBuffer + pos;
+  if (len > mCapacity - pos) {
+    len = mCapacity - pos;
+  }
+  return len;
+}
+
+void
+StreamRing::Release(uint64_t newBase)
+{
+  if (newBase <= mBase) {
+    return;
+  }
+  assert(newBase <= mEnd);
+  mBase = newBase;
+  if ((mBase == mEnd) && (mCapacity > kStreamRingMinimum)) {
+    // drained - don't hold on to a big buffer for an idle stream
+    FreeBuffer();
+  }
+}
+
+void
+StreamRing::Reset(uint64_t base)
+{
+  FreeBuffer();
+  mBase = base;
+  mEnd = base;
+}
+
+void
+IntervalSet::Insert(uint64_t start, uint64_t end)
+{
+  if (start >= end) {
+    return;
+  }
+
+  // merge with a range that starts before start and reaches it
+  auto i = mRanges.upper_bound(start);
+  if (i != mRanges.begin()) {
+    auto prev = i;
+    prev--;
+    if (prev->second >= start) {
+      if (prev->second >= end) {
+        return;
+      }
+      start = prev->first;
+      mRanges.erase(prev);
+    }
+  }
+
+  // swallow every range that starts inside [start, end]
+  i = mRanges.lower_bound(start);
+  while (i != mRanges.end() && i->first <= end) {
+    if (i->second > end) {
+      end = i->second;
+    }
+    i = mRanges.erase(i);
+  }
+  mRanges.insert( { start, end } );
+}
+
+uint64_t
+IntervalSet::ContiguousFrom(uint64_t start)
+{
+  auto i = mRanges.upper_bound(start);
+  if (i == mRanges.begin()) {
+    return start;
+  }
+  i--;
+  if (i->second > start) {
+    return i->second;
+  }
+  return start;
+}
+
+void
+IntervalSet::RemoveBelow(uint64_t offset)
+{
+  auto i = mRanges.begin();
+  while (i != mRanges.end() && i->first < offset) {
+    if (i->second > offset) {
+      uint64_t end = i->second;
+      mRanges.erase(i);
+      mRanges.insert( { offset, end } );
+      return;
+    }
+    i = mRanges.erase(i);
+  }
+}
+
+SendBuffer::SendBuffer(OwnerReleaseFn ownerRelease, void *owner)
+  : mRing(0)
+  , mBase(0)
+  , mEnd(0)
+  , mOwnerRelease(ownerRelease)
+  , mOwner(owner)
+{
+}
+
+SendBuffer::~SendBuffer()
+{
+  for (auto i = mExtents.begin(); i != mExtents.end(); ++i) {
+    ReleaseExtent(*i);
+  }
+}
+
+void
+SendBuffer::Append(const unsigned char *data, uint32_t len)
+{
+  if (!len) {
+    return;
+  }
+  if (!mExtents.empty() && (mExtents.back().mKind == Extent::kRing) &&
+      (mExtents.back().mPosition + mExtents.back().mLen == mRing.End())) {
+    // the common case - just grow the last extent
+    mExtents.back().mLen += len;
+  } else {
+    Extent e = { Extent::kRing, mEnd, len, nullptr, mRing.End(), -1, nullptr, nullptr };
+    mExtents.push_back(e);
+  }
+  mRing.Append(data, len);
+  mEnd += len;
+}
+
+void
+SendBuffer::AppendExternal(const unsigned char *data, uint32_t len,
+                           ReleaseFn release, void *cookie)
+{
+  Extent e = { Extent::kExternal, mEnd, len, data, 0, -1, release, cookie };
+  if (!len) {
+    ReleaseExtent(e); // nothing to hold on to
+    return;
+  }
+  mExtents.push_back(e);
+  mEnd += len;
+}
+
+void
+SendBuffer::AppendFile(int fd, uint64_t fileOffset, uint64_t len)
+{
+  Extent e = { Extent::kFile, mEnd, len, nullptr, fileOffset, fd, nullptr, nullptr };
+  if (!len) {
+    ReleaseExtent(e);
+    return;
+  }
+  mExtents.push_back(e);
+  mEnd += len;
+}
+
+void
+SendBuffer::ReleaseExtent(Extent &e)
+{
+  if (e.mKind == Extent::kRing) {
+    return;
+  }
+  if (e.mKind == Extent::kFile) {
+    close(e.mFD);
+  } else if (e.mRelease) {
+    e.mRelease(e.mCookie, e.mExternal, e.mLen);
+  } else if (mOwnerRelease) {
+    mOwnerRelease(mOwner, e.mCookie, e.mExternal, e.mLen);
+  }
+}
+
+bool
+SendBuffer::Copy(uint64_t offset, unsigned char *dest, uint32_t len)
+{
+  assert(offset >= mBase);
+  assert(offset + len <= mEnd);
+  if (!len) {
+    return true;
+  }
+
+  // find the last extent that starts at or before offset
+  auto i = mExtents.begin();
+  if (mExtents.size() > 1) {
+    size_t lo = 0, hi = mExtents.size();
+    while (hi - lo > 1) {
+      size_t mid = (lo + hi) / 2;
+      if (mExtents[mid].mOffset <= offset) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    i += lo;
+  }
+
+  while (len) {
+    assert(i != mExtents.end());
+    assert(offset >= i->mOffset && offset < i->mOffset + i->mLen);
+    uint64_t skip = offset - i->mOffset;
+    uint32_t amt = len;
+    if (amt > i->mLen - skip) {
+      amt = i->mLen - skip;
+    }
+    if (i->mKind == Extent::kExternal) {
+      memcpy(dest, i->mExternal + skip, amt);
+    } else if (i->mKind == Extent::kRing) {
+      mRing.Copy(i->mPosition + skip, dest, amt);
+    } else {
+      uint32_t done = 0;
+      while (done < amt) {
+        ssize_t rv = pread(i->mFD, dest + done, amt - done, i->mPosition + skip + done);
+        if (rv < 0 && errno == EINTR) {
+          continue;
+        }
+        if (rv <= 0) {
+          return false; // error or the file got shorter
+        }
+        done += rv;
+      }
+    }
+    dest += amt;
+    offset += amt;
+    len -= amt;
+    ++i;
+  }
+  return true;
+}
+
+void
+SendBuffer::ReleaseBelow(uint64_t newBase)
+{
+  mBase = newBase;
+  while (!mExtents.empty()) {
+    Extent &e = mExtents.front();
+    if (e.mOffset + e.mLen > newBase) {
+      if ((e.mKind == Extent::kRing) && (newBase > e.mOffset)) {
+        mRing.Release(e.mPosition + (newBase - e.mOffset));
+      }
+      break;
+    }
+    if (e.mKind == Extent::kRing) {
+      mRing.Release(e.mPosition + e.mLen);
+      mExtents.pop_front();
+    } else {
+      Extent done = e;
+      mExtents.pop_front();
+      ReleaseExtent(done);
+    }
+  }
+}
+
+void
+SendBuffer::Acked(uint64_t offset, uint32_t len)
+{
+  if (offset + len <= mBase) {
+    return;
+  }
+  mAcked.Insert(offset, offset + len);
+  uint64_t newBase = mAcked.ContiguousFrom(mBase);
+  if (newBase > mBase) {
+    mAcked.RemoveBelow(newBase);
+    ReleaseBelow(newBase);
+  }
+}
+
+void
+RecvBuffer::Insert(uint64_t offset, const unsigned char *data, uint32_t len)
+{
+  uint64_t base = mRing.Base();
+  if (offset + len <= base) {
+    return;
+  }
+  if (offset < base) {
+    data += base - offset;
+    len -= base - offset;
+    offset = base;
+  }
+  if (mFilled.ContiguousFrom(offset) >= offset + len) {
+    return; // dup
+  }
+  mRing.Write(offset, data, len);
+  mFilled.Insert(offset, offset + len);
+}
+
+uint32_t
+RecvBuffer::Read(unsigned char *dest, uint32_t len)
+{
+  uint64_t readable = Readable();
+  if (len > readable) {
+    len = readable;
+  }
+  if (!len) {
+    return 0;
+  }
+  mRing.Copy(mRing.Base(), dest, len);
+  Consume(len);
+  return len;
+}
+
+uint32_t
+RecvBuffer::Peek(const unsigned char *&ptr)
+{
+  uint64_t readable = Readable();
+  if (readable > 0xffffffff) {
+    readable = 0xffffffff;
+  }
+  return mRing.Peek(mRing.Base(), ptr, readable);
+}
+
+void
+RecvBuffer::Consume(uint32_t len)
+{
+  assert(len <= Readable());
+  uint64_t newBase = mRing.Base() + len;
+  mRing.Release(newBase);
+  mFilled.RemoveBelow(newBase);
+}
+
+void
+RecvBuffer::Reset(uint64_t base)
+{
+  mRing.Reset(base);
+  mFilled.Clear();
+}
+
+} // namespace
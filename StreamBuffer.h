@@ -0,0 +1,167 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <memory>
+
+namespace mozquic  {
+
+enum {
+  kStreamRingMinimum = 4096,
+};
+
+// StreamRing is a growable power of 2 sized ring of bytes addressed by
+// absolute stream offset. It holds the range [Base(), End()) - position
+// in the storage is just offset & (capacity - 1), so growing the ring or
+// releasing its front never moves the bytes that remain. The storage
+// comes from the size classed Pool buffers.
+class StreamRing
+{
+public:
+  StreamRing(uint64_t base);
+  ~StreamRing();
+
+  uint64_t Base() { return mBase; }
+  uint64_t End() { return mEnd; }
+
+  // append len bytes at End()
+  void Append(const unsigned char *data, uint32_t len);
+  // store len bytes at offset (>= Base()), growing End() if needed. Any
+  // hole between the old End() and offset is left uninitialized.
+  void Write(uint64_t offset, const unsigned char *data, uint32_t len);
+  // copy len bytes starting at offset into dest. [offset, offset+len)
+  // must be inside [Base(), End())
+  void Copy(uint64_t offset, unsigned char *dest, uint32_t len);
+  // point ptr at offset and return how many bytes (up to len) are
+  // stored contiguously from there - i.e. stop at the wrap
+  uint32_t Peek(uint64_t offset, const unsigned char *&ptr, uint32_t len);
+  // everything below newBase is no longer needed
+  void Release(uint64_t newBase);
+  // drop everything and restart empty at base
+  void Reset(uint64_t base);
+
+private:
+  void Grow(uint64_t needed);
+
+  void FreeBuffer();
+
+  unsigned char *mBuffer;
+  uint64_t mCapacity;
+  uint64_t mBase;
+  uint64_t mEnd;
+};
+
+// IntervalSet is a set of disjoint half open ranges [start, end),
+// merged as they are inserted.
+class IntervalSet
+{
+public:
+  void Insert(uint64_t start, uint64_t end);
+  // if a range contains start, return its end. otherwise start
+  uint64_t ContiguousFrom(uint64_t start);
+  void RemoveBelow(uint64_t offset);
+  bool Empty() { return mRanges.empty(); }
+  void Clear() { mRanges.clear(); }
+
+private:
+  std::map<uint64_t, uint64_t> mRanges; // start -> end
+};
+
+// SendBuffer holds the outbound bytes of one stream from the time the
+// application writes them until the peer acknowledges them. Frames
+// (queued, in flight, or being retransmitted) are just (offset, len)
+// views of it that share ownership through a shared_ptr.
+//
+// The stream is a sequence of extents. Bytes the library copied live in
+// the ring; bytes the app lent with AppendExternal stay in app memory
+// until every byte of the extent is acked, and then it is handed back
+// through its release function. AppendFile extents are read with pread
+// only when they are framed, and the fd is closed once they are acked.
+class SendBuffer
+{
+public:
+  typedef void (*ReleaseFn)(void *cookie, const void *data, uint32_t len);
+  // used for external extents that have no release function of their own
+  typedef void (*OwnerReleaseFn)(void *owner, void *cookie, const void *data, uint32_t len);
+
+  SendBuffer(OwnerReleaseFn ownerRelease = nullptr, void *owner = nullptr);
+  ~SendBuffer(); // anything still lent out is released
+
+  uint64_t Base() { return mBase; }
+  uint64_t End() { return mEnd; }
+  void Append(const unsigned char *data, uint32_t len);
+  void AppendExternal(const unsigned char *data, uint32_t len,
+                      ReleaseFn release, void *cookie);
+  // the buffer takes ownership of fd
+  void AppendFile(int fd, uint64_t fileOffset, uint64_t len);
+  // returns false if the bytes could not be produced (file read error)
+  bool Copy(uint64_t offset, unsigned char *dest, uint32_t len);
+
+  // [offset, offset+len) has been acked. Frees the storage for whatever
+  // prefix of the stream is now completely acked.
+  void Acked(uint64_t offset, uint32_t len);
+
+private:
+  struct Extent
+  {
+    enum { kRing, kExternal, kFile } mKind;
+    uint64_t mOffset; // stream offset
+    uint64_t mLen;
+    const unsigned char *mExternal; // for kExternal
+    uint64_t mPosition; // ring offset for kRing, file offset for kFile
+    int mFD;
+    ReleaseFn mRelease;
+    void *mCookie;
+  };
+
+  void ReleaseBelow(uint64_t newBase);
+  void ReleaseExtent(Extent &e);
+
+  std::deque<Extent> mExtents;
+  StreamRing  mRing; // backs the non external extents in its own offset space
+  IntervalSet mAcked; // acked ranges above Base()
+  uint64_t mBase;
+  uint64_t mEnd;
+
+  OwnerReleaseFn mOwnerRelease;
+  void *mOwner;
+};
+
+// RecvBuffer reassembles the inbound bytes of one stream. Frames are
+// written into the ring at their stream offset as they arrive, in any
+// order, and mFilled tracks which ranges are present. Base() is the
+// next offset the application will read. The ring never holds more than
+// the flow control window beyond Base().
+class RecvBuffer
+{
+public:
+  RecvBuffer() : mRing(0) {}
+
+  uint64_t Base() { return mRing.Base(); }
+
+  // anything below Base() or already held is ignored
+  void Insert(uint64_t offset, const unsigned char *data, uint32_t len);
+  // number of in order bytes available starting at Base()
+  uint64_t Readable() { return mFilled.ContiguousFrom(mRing.Base()) - mRing.Base(); }
+  // copy up to len in order bytes into dest and release them
+  uint32_t Read(unsigned char *dest, uint32_t len);
+  // borrow the in order bytes at Base() without copying. Only the part
+  // before the ring wraps is returned. The pointer is good until the
+  // next Insert, Consume or Read.
+  uint32_t Peek(const unsigned char *&ptr);
+  // release len in order bytes. len must be <= Readable()
+  void Consume(uint32_t len);
+  void Reset(uint64_t base);
+
+private:
+  StreamRing  mRing;
+  IntervalSet mFilled; // ranges at or above Base() that have arrived
+};
+
+} // namespace
@@ -6,6 +6,7 @@
 #include "Logging.h"
 #include "MozQuic.h"
 #include "MozQuicInternal.h"
+#include "NSSHelper.h"
 #include "Streams.h"
 
 #include "assert.h"
@@ -34,9 +35,7 @@ StreamState::StartNewStream(StreamPair **outStream, const void *data,
       mMaxStreamIDBlocked = true;
       StreamLog3("new stream BLOCKED on stream id flow control %d\n",
                  mPeerMaxStreamID);
-      std::unique_ptr<ReliableData> tmp(new ReliableData(0, 0, nullptr, 0, 0));
-      tmp->MakeStreamIDBlocked();
-      ConnectionWrite(tmp);
+      mStreamIDBlockedDirty = true;
     }
     return MOZQUIC_ERR_IO;
   }
@@ -54,7 +53,8 @@ StreamState::StartNewStream(StreamPair **outStream, const void *data,
 }
 
 uint32_t
-StreamState::FindStream(uint32_t streamID, std::unique_ptr<ReliableData> &d)
+StreamState::FindStream(uint32_t streamID, uint64_t offset,
+                        const unsigned char *data, uint32_t len, bool fin)
 {
   // Open a new stream and implicitly open all streams with ID smaller than
   // streamID that are not already opened.
@@ -81,9 +81,7 @@ StreamState::FindStream(uint32_t streamID, std::unique_ptr<ReliableData> &d)
         (mLocalMaxStreamID - mNextRecvStreamIDUsed < 512)) {
       mLocalMaxStreamID += 1024;
       StreamLog5("Increasing Peer's Max StreamID to %d\n", mLocalMaxStreamID);
-      std::unique_ptr<ReliableData> tmp(new ReliableData(0, 0, nullptr, 0, 0));
-      tmp->MakeMaxStreamID(mLocalMaxStreamID);
-      ConnectionWrite(tmp);
+      mMaxStreamIDDirty = true;
     }
   }
   
@@ -91,16 +89,16 @@ StreamState::FindStream(uint32_t streamID, std::unique_ptr<ReliableData> &d)
   if (i == mStreams.end()) {
     StreamLog4("Stream %d already closed.\n", streamID);
     // this stream is already closed and deleted. Discharge frame.
-    d.reset();
     return MOZQUIC_ERR_ALREADY_FINISHED;
   }
+  // reading the fin from the callback can erase the stream from mStreams
   std::shared_ptr<StreamPair> deleteProtector((*i).second);
-  (*i).second->Supply(d);
+  deleteProtector->Supply(offset, data, len, fin);
 
-  while (!(*i).second->Empty() && !(*i).second->mIn.Done() && mMozQuic->mConnEventCB) {
-    uint64_t offset = (*i).second->mIn.mOffset;
-    mMozQuic->mConnEventCB(mMozQuic->mClosure, MOZQUIC_EVENT_NEW_STREAM_DATA, (*i).second.get());
-    if (offset == (*i).second->mIn.mOffset) {
+  while (!deleteProtector->Empty() && !deleteProtector->mIn.Done() && mMozQuic->mConnEventCB) {
+    uint64_t offset = deleteProtector->mIn.mOffset;
+    mMozQuic->mConnEventCB(mMozQuic->mClosure, MOZQUIC_EVENT_NEW_STREAM_DATA, deleteProtector.get());
+    if (offset == deleteProtector->mIn.mOffset) {
       break;
     }
   }
@@ -141,25 +139,21 @@ StreamState::HandleStreamFrame(FrameHeaderData *result, bool fromCleartext,
     return MOZQUIC_ERR_GENERAL;
   }
 
-  // todo, ultimately the stream chunk could hold references to
-  // the packet buffer and _ptr into it for zero copy
-
   // parser checked for this, but jic
   assert(pkt + _ptr + result->u.mStream.mDataLen <= endpkt);
-  std::unique_ptr<ReliableData>
-    tmp(new ReliableData(result->u.mStream.mStreamID,
-                         result->u.mStream.mOffset,
-                         pkt + _ptr,
-                         result->u.mStream.mDataLen,
-                         result->u.mStream.mFinBit));
+  // the payload is copied straight from the packet into the stream's
+  // reassembly buffer
   if (!result->u.mStream.mStreamID) {
-    mStream0->Supply(tmp);
+    mStream0->Supply(result->u.mStream.mOffset, pkt + _ptr,
+                     result->u.mStream.mDataLen, result->u.mStream.mFinBit);
   } else {
     if (fromCleartext) {
       mMozQuic->RaiseError(MOZQUIC_ERR_GENERAL, (char *) "cleartext non 0 stream id\n");
       return MOZQUIC_ERR_GENERAL;
     }
-    uint32_t rv = FindStream(result->u.mStream.mStreamID, tmp);
+    uint32_t rv = FindStream(result->u.mStream.mStreamID, result->u.mStream.mOffset,
+                             pkt + _ptr, result->u.mStream.mDataLen,
+                             result->u.mStream.mFinBit);
     if (rv != MOZQUIC_OK) {
       return rv;
     }
@@ -191,7 +185,7 @@ StreamState::HandleMaxStreamDataFrame(FrameHeaderData *result, bool fromCleartex
              result->u.mMaxStreamData.mMaximumStreamData,
              i->second->mOut.mFlowControlLimit);
   if (i->second->mOut.mFlowControlLimit < result->u.mMaxStreamData.mMaximumStreamData) {
-    i->second->mOut.mFlowControlLimit = result->u.mMaxStreamData.mMaximumStreamData;
+    i->second->mOut.NewFlowControlLimit(result->u.mMaxStreamData.mMaximumStreamData);
   }
   return MOZQUIC_OK;
 }
@@ -317,13 +311,39 @@ StreamIn::HandleResetStream(uint64_t finalOffset)
     return MOZQUIC_ERR_IO;
   }
 
+  // the final offset is charged to the connection window even if the
+  // data never arrived, and everything unread is discarded - which is
+  // the same as the app consuming it
+  if (finalOffset > mNextStreamDataExpected) {
+    if (mStreamID) {
+      mFlowController->ConnectionReadBytes(finalOffset - mNextStreamDataExpected);
+    }
+    mNextStreamDataExpected = finalOffset;
+  }
+  uint64_t discarded = (finalOffset > mOffset) ? finalOffset - mOffset : 0;
+
   mFinalOffset = finalOffset;
   mFinRecvd = true;
   mRstRecvd = true;
   mOffset = mFinalOffset;
+  if (discarded && mStreamID) {
+    mFlowController->ConnectionConsumedBytes(discarded);
+  }
   return ScrubUnRead();
 }
 
+void
+StreamIn::Consumed(uint64_t amt)
+{
+  if (!amt) {
+    return;
+  }
+  if (mStreamID) {
+    mFlowController->ConnectionConsumedBytes(amt);
+  }
+  MaybeIssueFlowControlCredit();
+}
+
 uint32_t
 StreamState::HandleStopSendingFrame(FrameHeaderData *result, bool fromCleartext,
                                     const unsigned char *pkt, const unsigned char *endpkt,
@@ -351,9 +371,41 @@ StreamState::RstStream(uint32_t streamID, uint32_t code)
   return (*i).second->RstStream(code);
 }
 
+void
+StreamState::FailStreamSend(uint32_t streamID, uint64_t finalOffset)
+{
+  // the bytes of a file backed write could not be read at framing
+  // time. The stream may have already sent its fin (or even been
+  // deleted), so this resets it regardless.
+  StreamLog1("stream %d send data could not be read - resetting\n", streamID);
+  auto i = mStreams.find(streamID);
+  if (i != mStreams.end()) {
+    StreamOut &out = (*i).second->mOut;
+    if (out.mRst) {
+      return;
+    }
+    out.mFin = true;
+    out.mRst = true;
+    out.mOffsetPromoted = out.mOffset;
+    out.mFinPromoted = true;
+    StreamActive(&out);
+  }
+  ScrubUnWritten(streamID);
+
+  std::unique_ptr<ReliableData> tmp(new ReliableData(streamID, finalOffset));
+  tmp->MakeRstStream(ERROR_INTERNAL);
+  ConnectionWrite(tmp);
+}
+
 uint32_t
 StreamState::ScrubUnWritten(uint32_t streamID)
 {
+  StreamPair *sp = FindStreamPair(streamID);
+  if (sp) {
+    Unschedule(&sp->mOut);
+    sp->mOut.mUnWritten.clear();
+  }
+
   auto iter = mConnUnWritten.begin();
   while (iter != mConnUnWritten.end()) {
     auto chunk = (*iter).get();
@@ -380,182 +432,243 @@ StreamState::ScrubUnWritten(uint32_t streamID)
   return MOZQUIC_OK;
 }
 
-uint64_t
-StreamState::CalculateConnectionCharge(ReliableData *data, StreamOut *out)
+uint32_t
+StreamState::FlowControlPromotionForStream(StreamOut *out)
 {
-  uint64_t newConnectionCharge = 0;
-  if (data->mStreamID &&
-      (data->mOffset + data->mLen > out->mOffsetChargedToConnFlowControl)) {
-    newConnectionCharge = data->mOffset + data->mLen - out->mOffsetChargedToConnFlowControl;
+  uint64_t amount = out->mOffset - out->mOffsetPromoted;
+  bool finPending = out->mFin && !out->mFinPromoted;
+  if (!amount && !finPending) {
+    return MOZQUIC_OK;
   }
-  return newConnectionCharge;
-}
 
-uint32_t
-StreamState::FlowControlPromotionForStreamPair(StreamPair *sp)
-{
-  StreamOut *out = &sp->mOut;
-
-  for (auto iBuffer = out->mStreamUnWritten.begin();
-       iBuffer != out->mStreamUnWritten.end(); ) {
-
-    uint64_t newConnectionCharge = 0;
-    if ((*iBuffer)->mLen) {
-
-      newConnectionCharge = CalculateConnectionCharge((*iBuffer).get(), out);
-
-      if (newConnectionCharge) {
-      
-        if (mMaxDataSent >= mPeerMaxData) {
-          if (!mMaxDataBlocked) {
-            mMaxDataBlocked = true;
-            StreamLog2("BLOCKED by connection window 1\n");
-            std::unique_ptr<ReliableData> tmp(new ReliableData(0, 0, nullptr, 0, 0));
-            tmp->MakeBlocked();
-            ConnectionWrite(tmp);
-          }
-          iBuffer++;
-          continue;
-        }
-      
-        if (mMaxDataSent + newConnectionCharge > mPeerMaxData) {
-          // split buffer
-          uint64_t minCharge = 1; // for hypothetical 1 byte frame
-          if ((*iBuffer)->mOffset + 1 > out->mOffsetChargedToConnFlowControl) {
-            minCharge = (*iBuffer)->mOffset + 1 - out->mOffsetChargedToConnFlowControl;
-          }
-          if (mMaxDataSent + minCharge > mPeerMaxData) {
-            if (!mMaxDataBlocked) {
-              mMaxDataBlocked = true;
-              StreamLog2("BLOCKED by connection window 2\n");
-              std::unique_ptr<ReliableData> tmp(new ReliableData(0, 0, nullptr, 0, 0));
-              tmp->MakeBlocked();
-              ConnectionWrite(tmp);
-            }
-            iBuffer++;
-            continue;
-          }
-          uint64_t maxCharge = mPeerMaxData - mMaxDataSent;
-          uint64_t room = maxCharge - minCharge + 1;
-          assert (room < (*iBuffer)->mLen);
-
-          std::unique_ptr<ReliableData>
-            tmp(new ReliableData((*iBuffer)->mStreamID,
-                                 (*iBuffer)->mOffset + room,
-                                 (*iBuffer)->mData.get() + room,
-                                 (*iBuffer)->mLen - room,
-                                 (*iBuffer)->mFin));
-          (*iBuffer)->mLen = room;
-          (*iBuffer)->mFin = false;
-          StreamLog7("FlowControlPromotionForStreamPair ConnWindow splitting chunk into "
-                     "%ld.%d and %ld.%d\n",
-                     (*iBuffer)->mOffset, (*iBuffer)->mLen,
-                     tmp->mOffset, tmp->mLen);
-          auto iterReg = iBuffer++;
-          out->mStreamUnWritten.insert(iBuffer, std::move(tmp));
-          iBuffer = iterReg;
-
-          newConnectionCharge = CalculateConnectionCharge((*iBuffer).get(), out);
-        }
-      }
-            
-      if ((*iBuffer)->mOffset >= out->mFlowControlLimit) {
-        if (!out->mBlocked) {
-          StreamLog2("Stream %d BLOCKED flow control\n", (*iBuffer)->mStreamID);
-          out->mBlocked = true;
-          std::unique_ptr<ReliableData> tmp(new ReliableData((*iBuffer)->mStreamID, 0, nullptr, 0, 0));
-          tmp->MakeStreamBlocked();
-          ConnectionWrite(tmp);
+  if (amount) {
+    if (out->mStreamID) {
+      if (mMaxDataSent >= mPeerMaxData) {
+        if (!mMaxDataBlocked) {
+          mMaxDataBlocked = true;
+          StreamLog2("BLOCKED by connection window\n");
+          mBlockedDirty = true;
         }
-        iBuffer++;
-        continue;
+        return MOZQUIC_OK;
       }
-      if ((*iBuffer)->mOffset + (*iBuffer)->mLen > out->mFlowControlLimit) {
-        // need to split it!
-
-        uint64_t room = out->mFlowControlLimit - (*iBuffer)->mOffset;
-
-        std::unique_ptr<ReliableData>
-          tmp(new ReliableData((*iBuffer)->mStreamID,
-                               (*iBuffer)->mOffset + room,
-                               (*iBuffer)->mData.get() + room,
-                               (*iBuffer)->mLen - room,
-                               (*iBuffer)->mFin));
-        (*iBuffer)->mLen = room;
-        (*iBuffer)->mFin = false;
-        StreamLog7("FlowControlPromotionForStreamPair StreamWindow splitting chunk into "
-                   "%ld.%d and %ld.%d\n",
-                   (*iBuffer)->mOffset, (*iBuffer)->mLen,
-                   tmp->mOffset, tmp->mLen);
-        auto iterReg = iBuffer++;
-        out->mStreamUnWritten.insert(iBuffer, std::move(tmp));
-        iBuffer = iterReg;
-        newConnectionCharge = CalculateConnectionCharge((*iBuffer).get(), out);
+      if (mMaxDataSent + amount > mPeerMaxData) {
+        amount = mPeerMaxData - mMaxDataSent;
       }
     }
-  
-    assert((*iBuffer)->mOffset + (*iBuffer)->mLen <= out->mFlowControlLimit);
-    out->mOffsetChargedToConnFlowControl += newConnectionCharge;
-    mMaxDataSent += newConnectionCharge;
-    assert(mMaxDataSent <= mPeerMaxData);
-
-    if ((*iBuffer)->mLen) {
-      out->mBlocked = false;
-      if (((*iBuffer)->mStreamID)) {
-        mMaxDataBlocked = false;
+
+    if (out->mOffsetPromoted >= out->mFlowControlLimit) {
+      if (!out->mBlocked) {
+        StreamLog2("Stream %d BLOCKED flow control\n", out->mStreamID);
+        out->mBlocked = true;
+        out->mStreamBlockedDirty = true;
+        StreamPair *sp = FindStreamPair(out->mStreamID);
+        if (sp) {
+          MarkStreamControlDirty(sp);
+        }
       }
+      return MOZQUIC_OK;
     }
-    uint64_t pmd = mPeerMaxData; // will trunc, but just for logging
-    uint64_t mds = mMaxDataSent; // will trunc, but just for logging
-    StreamLog6("promoting chunk stream %d %ld.%d [stream limit=%ld] [conn limit %llu of %lld]\n",
-               (*iBuffer)->mStreamID, (*iBuffer)->mOffset, (*iBuffer)->mLen,
-               out->mFlowControlLimit, mds, pmd);
-    assert((*iBuffer)->mOffset + (*iBuffer)->mLen <= out->mFlowControlLimit);
-    std::unique_ptr<ReliableData> x(std::move(*iBuffer));
-    mConnUnWritten.push_back(std::move(x));
+    if (out->mOffsetPromoted + amount > out->mFlowControlLimit) {
+      amount = out->mFlowControlLimit - out->mOffsetPromoted;
+    }
+    if (amount > 0xffffffff) {
+      amount = 0xffffffff; // mLen is 32 bits, the rest is promoted next time
+    }
+  }
+
+  // the fin can only ride along with the last byte of the stream
+  bool fin = finPending && (out->mOffsetPromoted + amount == out->mOffset);
 
-    iBuffer = out->mStreamUnWritten.erase(iBuffer);
+  if (out->mStreamID) {
+    mMaxDataSent += amount;
+  }
+  assert(mMaxDataSent <= mPeerMaxData);
+
+  if (amount) {
+    out->mBlocked = false;
+    out->mStreamBlockedDirty = false;
+    if (out->mStreamID) {
+      mMaxDataBlocked = false;
+      mBlockedDirty = false;
+    }
   }
+  uint64_t pmd = mPeerMaxData; // will trunc, but just for logging
+  uint64_t mds = mMaxDataSent; // will trunc, but just for logging
+  StreamLog6("promoting stream %d %ld.%d fin=%d [stream limit=%ld] [conn limit %llu of %lld]\n",
+             out->mStreamID, out->mOffsetPromoted, (uint32_t)amount, fin,
+             out->mFlowControlLimit, mds, pmd);
+
+  // one view covers everything that flow control allows - it gets
+  // carved up to fit packets in CreateStreamFrames without copying
+  std::unique_ptr<ReliableData> tmp(new ReliableData(out->mStreamID, out->mOffsetPromoted,
+                                                     out->mSendBuffer, amount, fin));
+  QueueStreamData(out, tmp);
+  out->mOffsetPromoted += amount;
+  if (fin) {
+    out->mFinPromoted = true;
+  }
+  assert(out->mOffsetPromoted <= out->mFlowControlLimit);
   return MOZQUIC_OK;
 }
 
-// This fx() identifies buffers in streampair.out.mStreamUnWritten and
+// This fx() identifies unpromoted bytes in each active streampair.out and
 // promotoes them to the connection scoped mConnUnWritten according to
 // flow control rules
 uint32_t
 StreamState::FlowControlPromotion()
 {
-  // todo something better than polling
-  if (mStream0) {
-    FlowControlPromotionForStreamPair(mStream0.get());
-  }
-  for (auto iStreamPair = mStreams.begin(); iStreamPair != mStreams.end(); iStreamPair++) {
-    FlowControlPromotionForStreamPair(iStreamPair->second.get());
-    if (MaybeDeleteStream(iStreamPair->second->mStreamID)) {
-      return FlowControlPromotion(); // vector needs to be restarted
+  StreamOut *out = mActiveHead;
+  while (out) {
+    StreamOut *next = out->mActiveNext;
+    FlowControlPromotionForStream(out);
+    // stay listed while connection flow control holds data back - the
+    // whole list is retried when MAX_DATA arrives
+    if (!out->Unpromoted() || out->mBlocked) {
+      StreamInactive(out);
+      if (out->mStreamID) {
+        mMaybeDone.push_back(out->mStreamID);
+      }
     }
+    out = next;
+  }
+
+  // deleting can release app buffers and call back into the app, so it
+  // waits until the list walk is done
+  for (size_t i = 0; i < mMaybeDone.size(); i++) {
+    MaybeDeleteStream(mMaybeDone[i]);
   }
+  mMaybeDone.clear();
   return MOZQUIC_OK;
 }
 
 void
-StreamState::MaybeIssueFlowControlCredit()
+StreamState::StreamActive(StreamOut *out)
+{
+  if (out->mActiveListed) {
+    return;
+  }
+  out->mActiveListed = true;
+  out->mActivePrev = mActiveTail;
+  out->mActiveNext = nullptr;
+  if (mActiveTail) {
+    mActiveTail->mActiveNext = out;
+  } else {
+    mActiveHead = out;
+  }
+  mActiveTail = out;
+}
+
+void
+StreamState::StreamInactive(StreamOut *out)
+{
+  if (!out->mActiveListed) {
+    return;
+  }
+  if (out->mActivePrev) {
+    out->mActivePrev->mActiveNext = out->mActiveNext;
+  } else {
+    mActiveHead = out->mActiveNext;
+  }
+  if (out->mActiveNext) {
+    out->mActiveNext->mActivePrev = out->mActivePrev;
+  } else {
+    mActiveTail = out->mActivePrev;
+  }
+  out->mActiveListed = false;
+  out->mActivePrev = nullptr;
+  out->mActiveNext = nullptr;
+}
+
+void
+StreamState::QueueStreamData(StreamOut *out, std::unique_ptr<ReliableData> &p)
 {
-  // todo something better than polling
-  ConnectionReadBytes(0);
-  if (mStream0) {
-    mStream0->mIn.MaybeIssueFlowControlCredit();
+  if (!out || !out->mStreamID) {
+    mConnUnWritten.push_back(std::move(p));
+    return;
   }
-  for (auto iStreamPair = mStreams.begin(); iStreamPair != mStreams.end(); iStreamPair++) {
-    iStreamPair->second->mIn.MaybeIssueFlowControlCredit();
+  out->mUnWritten.push_back(std::move(p));
+  Schedule(out);
+}
+
+void
+StreamState::Schedule(StreamOut *out)
+{
+  if (out->mScheduled) {
+    return;
+  }
+  uint8_t u = out->mUrgency;
+  out->mScheduled = true;
+  out->mSchedPrev = mSchedTail[u];
+  out->mSchedNext = nullptr;
+  if (mSchedTail[u]) {
+    mSchedTail[u]->mSchedNext = out;
+  } else {
+    mSchedHead[u] = out;
+  }
+  mSchedTail[u] = out;
+  mScheduledCount++;
+}
+
+void
+StreamState::Unschedule(StreamOut *out)
+{
+  if (!out->mScheduled) {
+    return;
+  }
+  uint8_t u = out->mUrgency;
+  if (out->mSchedPrev) {
+    out->mSchedPrev->mSchedNext = out->mSchedNext;
+  } else {
+    mSchedHead[u] = out->mSchedNext;
+  }
+  if (out->mSchedNext) {
+    out->mSchedNext->mSchedPrev = out->mSchedPrev;
+  } else {
+    mSchedTail[u] = out->mSchedPrev;
+  }
+  out->mScheduled = false;
+  out->mSchedPrev = nullptr;
+  out->mSchedNext = nullptr;
+  mScheduledCount--;
+}
+
+void
+StreamState::SetPriority(StreamOut *out, uint8_t urgency, bool incremental)
+{
+  if (urgency >= kUrgencyLevels) {
+    urgency = kUrgencyLevels - 1;
+  }
+  bool scheduled = out->mScheduled;
+  Unschedule(out);
+  out->mUrgency = urgency;
+  out->mIncremental = incremental;
+  out->mDeficit = 0;
+  if (scheduled) {
+    Schedule(out);
+  }
+}
+
+void
+StreamState::MaybeIssueFlowControlCredit()
+{
+  // back pressure was released. Credit is normally issued as the app
+  // reads, so only the streams that were refused while it was on (and
+  // the connection) need another look.
+  ConnectionConsumedBytes(0);
+  std::vector<uint32_t> deferred;
+  deferred.swap(mCreditDeferredStreams);
+  for (auto i = deferred.begin(); i != deferred.end(); ++i) {
+    StreamPair *sp = FindStreamPair(*i);
+    if (sp) {
+      sp->mIn.mCreditDeferred = false;
+      sp->mIn.MaybeIssueFlowControlCredit();
+    }
   }
   if (mNextRecvStreamIDUsed >= mLocalMaxStreamID ||
       (mLocalMaxStreamID - mNextRecvStreamIDUsed < 512)) {
     mLocalMaxStreamID += 1024;
     StreamLog5("Increasing Peer's Max StreamID to %d\n", mLocalMaxStreamID);
-    std::unique_ptr<ReliableData> tmp(new ReliableData(0, 0, nullptr, 0, 0));
-    tmp->MakeMaxStreamID(mLocalMaxStreamID);
-    ConnectionWrite(tmp);
+    mMaxStreamIDDirty = true;
   }
 }
 
@@ -568,172 +681,445 @@ static uint8_t varSize(uint64_t input)
 uint32_t
 StreamState::CreateStreamFrames(unsigned char *&framePtr, const unsigned char *endpkt, bool justZero)
 {
+  if (!justZero) {
+    CreateControlFrames(framePtr, endpkt);
+  }
+
+  uint32_t rv = MOZQUIC_OK;
+  uint32_t failedID = 0;
+  uint64_t failedEnd = 0;
   auto iter = mConnUnWritten.begin();
   while (iter != mConnUnWritten.end()) {
     if (justZero && (((*iter)->mType != ReliableData::kStream)|| (*iter)->mStreamID)) {
       iter++;
       continue;
     }
-    if ((*iter)->mType == ReliableData::kRstStream) {
-      if (CreateRstStreamFrame(framePtr, endpkt, (*iter).get()) != MOZQUIC_OK) {
-        break;
-      }
-    } else if ((*iter)->mType == ReliableData::kMaxStreamData) {
-      if (CreateMaxStreamDataFrame(framePtr, endpkt, (*iter).get()) != MOZQUIC_OK) {
-        // this one sometimes fails and we should just delete the info and move on
-        // as the stream no longer needs flow control
-        iter = mConnUnWritten.erase(iter);
-        continue;
-      }
-    } else if ((*iter)->mType == ReliableData::kStopSending) {
-      if (CreateStopSendingFrame(framePtr, endpkt, (*iter).get()) != MOZQUIC_OK) {
-        break;
+    bool consumed;
+    uint32_t written;
+    rv = CreateStreamFrame(framePtr, endpkt, *iter, 0xffffffff, consumed, written);
+    if (rv != MOZQUIC_OK) {
+      break;
+    }
+    if (consumed) {
+      iter = mConnUnWritten.erase(iter);
+    }
+  }
+
+  // then the streams, most urgent class first
+  for (int u = 0; !justZero && (rv == MOZQUIC_OK) && (u < kUrgencyLevels); u++) {
+    while ((rv == MOZQUIC_OK) && mSchedHead[u]) {
+      StreamOut *out = mSchedHead[u];
+      assert(!out->mUnWritten.empty());
+      uint32_t limit = 0xffffffff;
+      if (out->mIncremental) {
+        if (out->mDeficit < kDeficitMinimum) {
+          out->mDeficit += mMozQuic->mMTU; // a new turn, plus any remainder
+        }
+        limit = out->mDeficit;
       }
-    } else if ((*iter)->mType == ReliableData::kMaxData) {
-      if (CreateMaxDataFrame(framePtr, endpkt, (*iter).get()) != MOZQUIC_OK) {
+      bool consumed;
+      uint32_t written;
+      rv = CreateStreamFrame(framePtr, endpkt, out->mUnWritten.front(), limit,
+                             consumed, written);
+      if (rv == MOZQUIC_ERR_IO) {
+        failedID = out->mStreamID;
+        failedEnd = out->mSendBuffer->End();
         break;
       }
-    } else if ((*iter)->mType == ReliableData::kMaxStreamID) {
-      if (CreateMaxStreamIDFrame(framePtr, endpkt, (*iter).get()) != MOZQUIC_OK) {
+      if (rv != MOZQUIC_OK) {
         break;
       }
-    } else if ((*iter)->mType == ReliableData::kStreamBlocked) {
-      if (CreateStreamBlockedFrame(framePtr, endpkt, (*iter).get()) != MOZQUIC_OK) {
-        break;
+      if (consumed) {
+        out->mUnWritten.pop_front();
       }
-    } else if ((*iter)->mType == ReliableData::kBlocked) {
-      if (CreateBlockedFrame(framePtr, endpkt, (*iter).get()) != MOZQUIC_OK) {
-        break;
+      if (out->mIncremental) {
+        out->mDeficit -= written;
       }
-    } else if ((*iter)->mType == ReliableData::kStreamIDBlocked) {
-      if (CreateStreamIDBlockedFrame(framePtr, endpkt, (*iter).get()) != MOZQUIC_OK) {
-        break;
+      if (out->mUnWritten.empty()) {
+        // an idle stream does not bank what is left of its turn
+        out->mDeficit = 0;
+        Unschedule(out);
+        if (out->Done()) {
+          mMaybeDone.push_back(out->mStreamID);
+        }
+      } else if (out->mIncremental && (out->mDeficit < kDeficitMinimum)) {
+        // too little left for a useful frame - the remainder is carried
+        // into the next turn instead of being sent as a tiny tail
+        Unschedule(out);
+        Schedule(out);
       }
-    } else {
-      assert ((*iter)->mType == ReliableData::kStream);
+    }
+  }
 
-      uint32_t room = endpkt - framePtr;
-      if (room < 1) {
-        break; // this is only for type, we will do a second check later.
-      }
+  if (rv == MOZQUIC_ERR_IO && !failedID) {
+    failedID = (*iter)->mStreamID;
+    failedEnd = (*iter)->mSendBuffer->End();
+  }
+  if (failedID) {
+    // the stream is reset now that the queues are not being walked
+    FailStreamSend(failedID, failedEnd);
+  }
 
-      // 11fssood -> 11000001 -> 0xC1. Fill in fin, offset-len and id-len below dynamically
-      auto typeBytePtr = framePtr;
-      framePtr[0] = 0xc1;
+  // deleting can release app buffers and call back into the app
+  for (size_t i = 0; i < mMaybeDone.size(); i++) {
+    MaybeDeleteStream(mMaybeDone[i]);
+  }
+  mMaybeDone.clear();
+  return MOZQUIC_OK;
+}
 
-      // Determine streamID size without varSize becuase we use 24 bit value
-      uint32_t tmp32 = (*iter)->mStreamID;
-      tmp32 = htonl(tmp32);
-      uint8_t idLen = 4;
-      for (int i=0; (i < 3) && (((uint8_t*)(&tmp32))[i] == 0); i++) {
-        idLen--;
+// write one frame for the front of a queue, with at most limit bytes of
+// stream data. consumed is set when queued has been written in full (or
+// dropped) and should be taken off the queue - otherwise the front of it
+// was framed as a split and the rest stays queued. written is the number
+// of stream bytes framed. Returns MOZQUIC_ERR_GENERAL when the packet
+// has no room and MOZQUIC_ERR_IO when file backed data could not be read.
+uint32_t
+StreamState::CreateStreamFrame(unsigned char *&framePtr, const unsigned char *endpkt,
+                               std::unique_ptr<ReliableData> &queued, uint32_t limit,
+                               bool &consumed, uint32_t &written)
+{
+  consumed = false;
+  written = 0;
+  std::unique_ptr<ReliableData> split;
+  if (queued->mType == ReliableData::kRstStream) {
+    if (CreateRstStreamFrame(framePtr, endpkt, queued.get()) != MOZQUIC_OK) {
+      return MOZQUIC_ERR_GENERAL;
+    }
+  } else if (queued->mType == ReliableData::kStopSending) {
+    if (CreateStopSendingFrame(framePtr, endpkt, queued.get()) != MOZQUIC_OK) {
+      return MOZQUIC_ERR_GENERAL;
+    }
+  } else {
+    assert (queued->mType == ReliableData::kStream);
+    ReliableData *chunk = queued.get();
+    assert(chunk->mSendBuffer);
+
+    // a retransmission can race the ack of the original. Anything below
+    // the buffer base is acked and no longer stored, so don't send it.
+    if (chunk->mOffset < chunk->mSendBuffer->Base()) {
+      uint64_t skip = chunk->mSendBuffer->Base() - chunk->mOffset;
+      if (skip >= chunk->mLen) {
+        if (!chunk->mFin) {
+          queued.reset();
+          consumed = true;
+          return MOZQUIC_OK;
+        }
+        skip = chunk->mLen;
       }
+      chunk->mOffset += skip;
+      chunk->mLen -= skip;
+    }
 
-      // determine offset size
-      uint64_t offsetValue = PR_htonll((*iter)->mOffset);
-      uint8_t offsetSizeType = varSize((*iter)->mOffset);
-      uint8_t offsetLen;
-      if (offsetSizeType == 0) {
-        // 0, 16, 32, 64 instead of usual 8, 16, 32, 64
-        if ((*iter)->mOffset) {
-          offsetSizeType = 1;
-          offsetLen = 2;
-        } else {
-          offsetLen = 0;
-        }
+    uint32_t room = endpkt - framePtr;
+    if (room < 1) {
+      return MOZQUIC_ERR_GENERAL; // this is only for type, we will do a second check later.
+    }
+
+    // 11fssood -> 11000001 -> 0xC1. Fill in fin, offset-len and id-len below dynamically
+    auto typeBytePtr = framePtr;
+    framePtr[0] = 0xc1;
+
+    // Determine streamID size without varSize becuase we use 24 bit value
+    uint32_t tmp32 = chunk->mStreamID;
+    tmp32 = htonl(tmp32);
+    uint8_t idLen = 4;
+    for (int i=0; (i < 3) && (((uint8_t*)(&tmp32))[i] == 0); i++) {
+      idLen--;
+    }
+
+    // determine offset size
+    uint64_t offsetValue = PR_htonll(chunk->mOffset);
+    uint8_t offsetSizeType = varSize(chunk->mOffset);
+    uint8_t offsetLen;
+    if (offsetSizeType == 0) {
+      // 0, 16, 32, 64 instead of usual 8, 16, 32, 64
+      if (chunk->mOffset) {
+        offsetSizeType = 1;
+        offsetLen = 2;
       } else {
-        offsetLen = 1 << offsetSizeType;
+        offsetLen = 0;
       }
+    } else {
+      offsetLen = 1 << offsetSizeType;
+    }
 
-      // 1(type) + idLen + offsetLen + 2(len) + 1(data)
-      if (room < (4 + idLen + offsetLen)) {
-        break;
-      }
+    // 1(type) + idLen + offsetLen + 2(len) + 1(data)
+    if (room < (4 + idLen + offsetLen)) {
+      return MOZQUIC_ERR_GENERAL;
+    }
 
-      // adjust the frame type:
-      framePtr[0] |= (idLen - 1) << 3;
-      assert(!(offsetSizeType & ~0x3));
-      framePtr[0] |= (offsetSizeType << 1);
-      framePtr++;
+    // adjust the frame type:
+    framePtr[0] |= (idLen - 1) << 3;
+    assert(!(offsetSizeType & ~0x3));
+    framePtr[0] |= (offsetSizeType << 1);
+    framePtr++;
 
-      // Set streamID
-      memcpy(framePtr, ((uint8_t*)(&tmp32)) + (4 - idLen), idLen);
-      framePtr += idLen;
+    // Set streamID
+    memcpy(framePtr, ((uint8_t*)(&tmp32)) + (4 - idLen), idLen);
+    framePtr += idLen;
 
-      // Set offset
-      if (offsetLen) {
-        memcpy(framePtr, ((uint8_t*)(&offsetValue)) + (8 - offsetLen), offsetLen);
-        framePtr += offsetLen;
-      }
+    // Set offset
+    if (offsetLen) {
+      memcpy(framePtr, ((uint8_t*)(&offsetValue)) + (8 - offsetLen), offsetLen);
+      framePtr += offsetLen;
+    }
 
-      room -= (3 + idLen + offsetLen); //  1(type) + idLen + offsetLen + 2(len)
-      if (room < (*iter)->mLen) {
-        // we need to split this chunk. its too big
-        // todo iterate on them all instead of doing this n^2
-        // as there is a copy involved
-        std::unique_ptr<ReliableData>
-          tmp(new ReliableData((*iter)->mStreamID,
-                               (*iter)->mOffset + room,
-                               (*iter)->mData.get() + room,
-                               (*iter)->mLen - room,
-                               (*iter)->mFin));
-        (*iter)->mLen = room;
-        (*iter)->mFin = false;
-        auto iterReg = iter++;
-        mConnUnWritten.insert(iter, std::move(tmp));
-        iter = iterReg;
-      }
-      assert(room >= (*iter)->mLen);
+    room -= (3 + idLen + offsetLen); //  1(type) + idLen + offsetLen + 2(len)
+    if (room > limit) {
+      room = limit;
+    }
+    if (room < chunk->mLen) {
+      // frame the front of the view and leave the rest queued
+      split.reset(new ReliableData(chunk->mStreamID, chunk->mOffset,
+                                   chunk->mSendBuffer, room, false));
+      split->mTransmitCount = chunk->mTransmitCount;
+      chunk->mOffset += room;
+      chunk->mLen -= room;
+      chunk = split.get();
+    }
+    assert(room >= chunk->mLen);
 
-      // set the len and fin bits after any potential split
-      uint16_t tmp16 = (*iter)->mLen;
-      tmp16 = htons(tmp16);
-      memcpy(framePtr, &tmp16, 2);
-      framePtr += 2;
+    // set the len and fin bits after any potential split
+    uint16_t tmp16 = chunk->mLen;
+    tmp16 = htons(tmp16);
+    memcpy(framePtr, &tmp16, 2);
+    framePtr += 2;
 
-      if ((*iter)->mFin) {
-        *typeBytePtr = *typeBytePtr | STREAM_FIN_BIT;
+    if (chunk->mFin) {
+      *typeBytePtr = *typeBytePtr | STREAM_FIN_BIT;
+    }
+
+    if (!chunk->mSendBuffer->Copy(chunk->mOffset, framePtr, chunk->mLen)) {
+      // unwind this frame - the caller resets the stream
+      framePtr = typeBytePtr;
+      if (split) {
+        queued->mOffset -= split->mLen;
+        queued->mLen += split->mLen;
       }
+      return MOZQUIC_ERR_IO;
+    }
+    StreamLog5("writing a stream %d frame %d @ offset %d [fin=%d] in packet %lX\n",
+               chunk->mStreamID, chunk->mLen, chunk->mOffset, chunk->mFin,
+               mMozQuic->mNextTransmitPacketNumber);
+    framePtr += chunk->mLen;
+    written = chunk->mLen;
+  }
+
+  // move it to the unacked list
+  if (split) {
+    SetTransmitted(split.get());
+    mUnAckedData.push_back(std::move(split));
+  } else {
+    SetTransmitted(queued.get());
+    mUnAckedData.push_back(std::move(queued));
+    consumed = true;
+  }
+  return MOZQUIC_OK;
+}
+
+void
+StreamState::SetTransmitted(ReliableData *sent)
+{
+  sent->mPacketNumber = mMozQuic->mNextTransmitPacketNumber;
+  sent->mTransmitTime = MozQuic::Timestamp();
+  // MozQuic::FlushEarlyData() marks what goes in 0-RTT packets
+  if ((mMozQuic->GetConnectionState() == CLIENT_STATE_CONNECTED) ||
+      (mMozQuic->GetConnectionState() == SERVER_STATE_CONNECTED)) {
+    sent->mTransmitKeyPhase = keyPhase1Rtt;
+  } else {
+    sent->mTransmitKeyPhase = keyPhaseUnprotected;
+  }
+  sent->mRetransmitted = false;
+}
+
+StreamPair *
+StreamState::FindStreamPair(uint32_t streamID)
+{
+  if (!streamID) {
+    return mStream0.get();
+  }
+  auto i = mStreams.find(streamID);
+  if (i == mStreams.end()) {
+    return nullptr;
+  }
+  return (*i).second.get();
+}
+
+void
+StreamState::MarkStreamControlDirty(StreamPair *sp)
+{
+  if (!sp->mControlDirtyListed) {
+    sp->mControlDirtyListed = true;
+    mControlDirtyStreams.push_back(sp->mStreamID);
+  }
+}
+
+bool
+StreamState::ControlFramesPending()
+{
+  return mMaxDataDirty || mBlockedDirty || mMaxStreamIDDirty || mStreamIDBlockedDirty ||
+    !mControlDirtyStreams.empty();
+}
+
+void
+StreamState::ControlFrameSent(std::unique_ptr<ReliableData> &frame)
+{
+  // only the type and stream are needed to redirty it if it is lost
+  SetTransmitted(frame.get());
+  mUnAckedData.push_back(std::move(frame));
+}
 
-      memcpy(framePtr, (*iter)->mData.get(), (*iter)->mLen);
-      StreamLog5("writing a stream %d frame %d @ offset %d [fin=%d] in packet %lX\n",
-                 (*iter)->mStreamID, (*iter)->mLen, (*iter)->mOffset, (*iter)->mFin,
-                 mMozQuic->mNextTransmitPacketNumber);
-      framePtr += (*iter)->mLen;
+// returns false if lost is not a flow control frame
+bool
+StreamState::RedirtyControlFrame(ReliableData *lost)
+{
+  StreamPair *sp;
+  switch (lost->mType) {
+  case ReliableData::kMaxData:
+    mMaxDataDirty = true;
+    return true;
+  case ReliableData::kBlocked:
+    mBlockedDirty = mMaxDataBlocked;
+    return true;
+  case ReliableData::kMaxStreamID:
+    mMaxStreamIDDirty = true;
+    return true;
+  case ReliableData::kStreamIDBlocked:
+    mStreamIDBlockedDirty = mMaxStreamIDBlocked;
+    return true;
+  case ReliableData::kMaxStreamData:
+    sp = FindStreamPair(lost->mStreamID);
+    if (sp && !sp->mIn.mFinRecvd && !sp->mIn.mRstRecvd) {
+      sp->mIn.mMaxStreamDataDirty = true;
+      MarkStreamControlDirty(sp);
     }
-  
-    (*iter)->mPacketNumber = mMozQuic->mNextTransmitPacketNumber;
-    (*iter)->mTransmitTime = MozQuic::Timestamp();
-    if ((mMozQuic->GetConnectionState() == CLIENT_STATE_CONNECTED) ||
-        (mMozQuic->GetConnectionState() == SERVER_STATE_CONNECTED) ||
-        (mMozQuic->GetConnectionState() == CLIENT_STATE_0RTT)) {
-      (*iter)->mTransmitKeyPhase = keyPhase1Rtt;
-    } else {
-      (*iter)->mTransmitKeyPhase = keyPhaseUnprotected;
+    return true;
+  case ReliableData::kStreamBlocked:
+    sp = FindStreamPair(lost->mStreamID);
+    if (sp && sp->mOut.mBlocked) {
+      sp->mOut.mStreamBlockedDirty = true;
+      MarkStreamControlDirty(sp);
     }
-    (*iter)->mRetransmitted = false;
+    return true;
+  default:
+    return false;
+  }
+}
 
-    // move it to the unacked list
-    std::unique_ptr<ReliableData> x(std::move(*iter));
-    mUnAckedData.push_back(std::move(x));
-    iter = mConnUnWritten.erase(iter);
+uint32_t
+StreamState::CreateControlFrames(unsigned char *&framePtr, const unsigned char *endpkt)
+{
+  if (mMaxDataDirty) {
+    assert(!(mLocalMaxData & 0x3ff));
+    if (CreateMaxDataFrame(framePtr, endpkt, mLocalMaxData >> 10) != MOZQUIC_OK) {
+      return MOZQUIC_OK;
+    }
+    mMaxDataDirty = false;
+    std::unique_ptr<ReliableData> sent(new ReliableData(0, 0));
+    sent->MakeMaxData();
+    ControlFrameSent(sent);
+  }
+  if (mBlockedDirty) {
+    if (CreateBlockedFrame(framePtr, endpkt) != MOZQUIC_OK) {
+      return MOZQUIC_OK;
+    }
+    mBlockedDirty = false;
+    std::unique_ptr<ReliableData> sent(new ReliableData(0, 0));
+    sent->MakeBlocked();
+    ControlFrameSent(sent);
+  }
+  if (mMaxStreamIDDirty) {
+    if (CreateMaxStreamIDFrame(framePtr, endpkt, mLocalMaxStreamID) != MOZQUIC_OK) {
+      return MOZQUIC_OK;
+    }
+    mMaxStreamIDDirty = false;
+    std::unique_ptr<ReliableData> sent(new ReliableData(0, 0));
+    sent->MakeMaxStreamID();
+    ControlFrameSent(sent);
   }
+  if (mStreamIDBlockedDirty) {
+    if (CreateStreamIDBlockedFrame(framePtr, endpkt) != MOZQUIC_OK) {
+      return MOZQUIC_OK;
+    }
+    mStreamIDBlockedDirty = false;
+    std::unique_ptr<ReliableData> sent(new ReliableData(0, 0));
+    sent->MakeStreamIDBlocked();
+    ControlFrameSent(sent);
+  }
+
+  // streams that are still dirty (out of room) are compacted to the front
+  size_t kept = 0;
+  size_t idx = 0;
+  for (; idx < mControlDirtyStreams.size(); idx++) {
+    uint32_t streamID = mControlDirtyStreams[idx];
+    StreamPair *sp = FindStreamPair(streamID);
+    if (!sp) {
+      continue; // the stream is gone and needs no flow control
+    }
+    sp->mControlDirtyListed = false;
+    if (sp->mIn.mMaxStreamDataDirty) {
+      if (sp->mIn.mFinRecvd || sp->mIn.mRstRecvd) {
+        sp->mIn.mMaxStreamDataDirty = false;
+      } else if (CreateMaxStreamDataFrame(framePtr, endpkt, streamID,
+                                          sp->mIn.mLocalMaxStreamData) == MOZQUIC_OK) {
+        sp->mIn.mMaxStreamDataDirty = false;
+        std::unique_ptr<ReliableData> sent(new ReliableData(streamID, 0));
+        sent->MakeMaxStreamData();
+        ControlFrameSent(sent);
+      }
+    }
+    if (sp->mOut.mStreamBlockedDirty) {
+      if (!sp->mOut.mBlocked) {
+        sp->mOut.mStreamBlockedDirty = false;
+      } else if (CreateStreamBlockedFrame(framePtr, endpkt, streamID) == MOZQUIC_OK) {
+        sp->mOut.mStreamBlockedDirty = false;
+        std::unique_ptr<ReliableData> sent(new ReliableData(streamID, 0));
+        sent->MakeStreamBlocked();
+        ControlFrameSent(sent);
+      }
+    }
+    if (sp->mIn.mMaxStreamDataDirty || sp->mOut.mStreamBlockedDirty) {
+      sp->mControlDirtyListed = true;
+      mControlDirtyStreams[kept++] = streamID;
+      if (endpkt - framePtr < 13) {
+        idx++;
+        break; // the packet is full
+      }
+    }
+  }
+  for (; idx < mControlDirtyStreams.size(); idx++) {
+    mControlDirtyStreams[kept++] = mControlDirtyStreams[idx];
+  }
+  mControlDirtyStreams.resize(kept);
   return MOZQUIC_OK;
 }
 
 uint32_t
 StreamState::Flush(bool forceAck)
 {
-  if (!mMozQuic->DecodedOK()) {
+  // stream 0 goes in cleartext until the peer is known to have keys. A
+  // connected server knows that, and a connected client drops cleartext,
+  // so post handshake messages (session tickets) are protected
+  if (!mMozQuic->DecodedOK() &&
+      (mMozQuic->GetConnectionState() != SERVER_STATE_CONNECTED)) {
     mMozQuic->FlushStream0(forceAck);
   }
 
   FlowControlPromotion();
-  if (mConnUnWritten.empty() && !forceAck) {
-    return MOZQUIC_OK;
+  if (!UnWrittenPending() && !ControlFramesPending() && !forceAck) {
+    return mMozQuic->TransmitQueueFlush();
   }
 
-  unsigned char plainPkt[kMaxMTU];
+  if (!mMozQuic->mNSSHelper || !mMozQuic->mNSSHelper->PacketProtectionReady()) {
+    // stream data waits for the handshake - unless this is a resuming
+    // client that can send it as 0-RTT
+    return mMozQuic->FlushEarlyData();
+  }
+
+  // build the packet in the transmit queue. A burst of them is encrypted
+  // and sent together once the queue fills or the burst is over
+  unsigned char *plainPkt = mMozQuic->TransmitQueueSlot();
   uint32_t headerLen;
   uint32_t mtu = mMozQuic->mMTU;
   assert(mtu <= kMaxMTU);
@@ -751,10 +1137,10 @@ StreamState::Flush(bool forceAck)
     return rv;
   }
 
-  if (!mConnUnWritten.empty()) {
+  if (UnWrittenPending() || ControlFramesPending()) {
     return Flush(false);
   }
-  return MOZQUIC_OK;
+  return mMozQuic->TransmitQueueFlush();
 }
 
 uint32_t
@@ -764,18 +1150,41 @@ StreamState::ConnectionWrite(std::unique_ptr<ReliableData> &p)
   // transmitted after prioritization by flush()
   assert (mMozQuic->GetConnectionState() != STATE_UNINITIALIZED);
 
-  mConnUnWritten.push_back(std::move(p));
+  StreamPair *sp = nullptr;
+  if ((p->mType == ReliableData::kStream) && p->mStreamID) {
+    sp = FindStreamPair(p->mStreamID);
+  }
+  QueueStreamData(sp ? &sp->mOut : nullptr, p);
 
   return MOZQUIC_OK;
 }
 
-uint32_t
-StreamState::GetIncrement()
+uint64_t
+StreamState::TuneWindow(uint64_t window, uint64_t lastUpdate, uint64_t cap)
+{
+  uint64_t rtt = mMozQuic->mSmoothedRTT;
+  if (!rtt || !lastUpdate || (window >= cap)) {
+    return window;
+  }
+  if (MozQuic::Timestamp() - lastUpdate >= 2 * rtt) {
+    return window; // the peer (or the app) is slower than the window
+  }
+  window *= 2;
+  if (window > cap) {
+    window = cap;
+  }
+  return window;
+}
+
+uint64_t
+StreamState::TuneStreamWindow(uint64_t window, uint64_t lastUpdate)
 {
-  if (mLocalMaxStreamData < 1024 * 1024) {
-    return mLocalMaxStreamData;
+  uint64_t cap = (mConnWindow < mWindowBudget) ? mConnWindow : mWindowBudget;
+  uint64_t rv = TuneWindow(window, lastUpdate, cap);
+  if (rv != window) {
+    StreamLog6("stream window grows to %ld\n", rv);
   }
-  return 4 * 1024 * 1024; // todo
+  return rv;
 }
 
 uint32_t
@@ -785,15 +1194,25 @@ StreamState::IssueStreamCredit(uint32_t streamID, uint64_t newMax)
       (mMozQuic->GetConnectionState() != SERVER_STATE_CONNECTED)) {
     return MOZQUIC_ERR_GENERAL;
   }
+  StreamPair *sp = FindStreamPair(streamID);
+  if (!sp) {
+    return MOZQUIC_ERR_GENERAL;
+  }
   if (mMozQuic->mBackPressure) {
+    if (!sp->mIn.mCreditDeferred) {
+      sp->mIn.mCreditDeferred = true;
+      mCreditDeferredStreams.push_back(streamID);
+    }
     return MOZQUIC_ERR_GENERAL;
   }
 
   StreamLog5("Issue a stream credit id=%d maxoffset=%ld\n", streamID, newMax);
 
-  std::unique_ptr<ReliableData> tmp(new ReliableData(streamID, 0, nullptr, 0, 0));
-  tmp->MakeMaxStreamData(newMax);
-  return ConnectionWrite(tmp);
+  // newMax is already the stream's mLocalMaxStreamData, which is what
+  // gets written
+  sp->mIn.mMaxStreamDataDirty = true;
+  MarkStreamControlDirty(sp);
+  return MOZQUIC_OK;
 }
 
 uint32_t
@@ -811,24 +1230,44 @@ StreamState::ConnectionReadBytes(uint64_t amt)
     return MOZQUIC_ERR_IO;
   }
   mLocalMaxDataUsed += amt;
+  return MOZQUIC_OK;
+}
 
-  // todo - credit scheme should be based on how much is queued here.
-  // todo - autotuning
-  uint64_t available = mLocalMaxData - mLocalMaxDataUsed;
+uint32_t
+StreamState::ConnectionConsumedBytes(uint64_t amt)
+{
+  mLocalMaxDataConsumed += amt;
+  if ((mMozQuic->GetConnectionState() != CLIENT_STATE_CONNECTED) &&
+      (mMozQuic->GetConnectionState() != SERVER_STATE_CONNECTED)) {
+    return MOZQUIC_ERR_GENERAL;
+  }
 
-  if (mMozQuic->mBackPressure || (available > 4 * 1024 * 1024)) {
+  // bytes that arrived but have not been read still count against the
+  // window, so the peer can never have more than a window outstanding
+  // in our buffers.
+  uint64_t available = (mLocalMaxData > mLocalMaxDataConsumed) ?
+    (uint64_t)(mLocalMaxData - mLocalMaxDataConsumed) : 0;
+
+  if (mMozQuic->mBackPressure || (available >= mConnWindow / 2)) {
     return MOZQUIC_OK;
   }
 
-  mLocalMaxData += 8 * 1024 * 1024;
-  mLocalMaxData -= mLocalMaxData & 0x3ff;
+  uint64_t window = TuneWindow(mConnWindow, mConnWindowUpdateTime, mWindowBudget);
+  __uint128_t newMax = mLocalMaxDataConsumed + window;
+  newMax -= newMax & 0x3ff; // MAX_DATA is in KB
+  if (newMax <= mLocalMaxData) {
+    return MOZQUIC_OK;
+  }
+  if (window != mConnWindow) {
+    StreamLog6("connection window grows to %ld\n", window);
+  }
+  mConnWindow = window;
+  mConnWindowUpdateTime = MozQuic::Timestamp();
+  mLocalMaxData = newMax;
   uint64_t lmd = mLocalMaxData;
   StreamLog5("Issue a connection credit newmax %ld\n", lmd);
-
-  std::unique_ptr<ReliableData> tmp(new ReliableData(0, 0, nullptr, 0, 0));
-  assert(!(mLocalMaxData & 0x3ff));
-  tmp->MakeMaxData(mLocalMaxData >> 10);
-  return ConnectionWrite(tmp);
+  mMaxDataDirty = true;
+  return MOZQUIC_OK;
 }
 
 uint32_t
@@ -853,18 +1292,19 @@ StreamState::RetransmitTimer()
       // this is only on packets that we are keeping around for timestamp purposes
       StreamLog7("old unacked packet forgotten %lX\n",
                  (*i)->mPacketNumber);
-      assert(!(*i)->mData);
       i = mUnAckedData.erase(i);
     } else if (!(*i)->mRetransmitted) {
-      assert((*i)->mData);
       StreamLog4("data associated with packet %lX retransmitted\n",
                  (*i)->mPacketNumber);
       (*i)->mRetransmitted = true;
 
-      // move the data pointer from iter to tmp
+      if (RedirtyControlFrame((*i).get())) {
+        i++;
+        continue; // resent from current state by CreateControlFrames
+      }
+
+      // stream data is a view of the send buffer, which the copy shares
       std::unique_ptr<ReliableData> tmp(new ReliableData(*(*i)));
-      assert(!(*i)->mData);
-      assert(tmp->mData);
 
       // its ok to bypass the per out stream flow control window on rexmit
       ConnectionWrite(tmp);
@@ -877,6 +1317,25 @@ StreamState::RetransmitTimer()
   return MOZQUIC_OK;
 }
 
+uint32_t
+StreamState::RetransmitEarlyData()
+{
+  // the server never saw any of it, so it all goes again now
+  for (auto i = mUnAckedData.begin(); i != mUnAckedData.end(); i++) {
+    if (((*i)->mTransmitKeyPhase != keyPhase0Rtt) || (*i)->mRetransmitted) {
+      continue;
+    }
+    StreamLog4("0-RTT data of packet %lX retransmitted\n", (*i)->mPacketNumber);
+    (*i)->mRetransmitted = true;
+    if (RedirtyControlFrame((*i).get())) {
+      continue;
+    }
+    std::unique_ptr<ReliableData> tmp(new ReliableData(*(*i)));
+    ConnectionWrite(tmp);
+  }
+  return MOZQUIC_OK;
+}
+
 uint32_t
 StreamState::CreateRstStreamFrame(unsigned char *&framePtr, const unsigned char *endpkt,
                                   ReliableData *chunk)
@@ -894,7 +1353,7 @@ StreamState::CreateRstStreamFrame(unsigned char *&framePtr, const unsigned char
   framePtr[0] = FRAME_TYPE_RST_STREAM;
   uint32_t tmp32 = htonl(chunk->mStreamID);
   memcpy(framePtr + 1, &tmp32, 4);
-  tmp32 = htonl(chunk->mRstCode);
+  tmp32 = htonl(chunk->u.mRstCode);
   memcpy(framePtr + 5, &tmp32, 4);
   uint64_t tmp64 = PR_htonll(chunk->mOffset);
   memcpy(framePtr + 9, &tmp64, 8);
@@ -904,32 +1363,21 @@ StreamState::CreateRstStreamFrame(unsigned char *&framePtr, const unsigned char
 
 uint32_t
 StreamState::CreateMaxStreamDataFrame(unsigned char *&framePtr, const unsigned char *endpkt,
-                                      ReliableData *chunk)
+                                      uint32_t streamID, uint64_t maxStreamData)
 {
   StreamLog5("generating max stream data id=%d val=%ld into pkt=%lx\n",
-             chunk->mStreamID, chunk->mStreamCreditValue,
+             streamID, maxStreamData,
              mMozQuic->mNextTransmitPacketNumber);
-  assert(chunk->mType == ReliableData::kMaxStreamData);
-  assert(chunk->mStreamCreditValue);
-  assert(!chunk->mLen);
-
-  if (chunk->mStreamID) {
-    auto i = mStreams.find(chunk->mStreamID);
-    if (i == mStreams.end() ||
-        (*i).second->mIn.mFinRecvd ||
-        (*i).second->mIn.mRstRecvd) {
-      return MOZQUIC_ERR_GENERAL;
-    }
-  }
+  assert(maxStreamData);
 
   uint32_t room = endpkt - framePtr;
   if (room < 13) {
     return MOZQUIC_ERR_GENERAL;
   }
   framePtr[0] = FRAME_TYPE_MAX_STREAM_DATA;
-  uint32_t tmp32 = htonl(chunk->mStreamID);
+  uint32_t tmp32 = htonl(streamID);
   memcpy(framePtr + 1, &tmp32, 4);
-  uint64_t tmp64 = PR_htonll(chunk->mStreamCreditValue);
+  uint64_t tmp64 = PR_htonll(maxStreamData);
   memcpy(framePtr + 5, &tmp64, 8);
   framePtr += 13;
   return MOZQUIC_OK;
@@ -937,21 +1385,19 @@ StreamState::CreateMaxStreamDataFrame(unsigned char *&framePtr, const unsigned c
 
 uint32_t
 StreamState::CreateMaxStreamIDFrame(unsigned char *&framePtr, const unsigned char *endpkt,
-                                    ReliableData *chunk)
+                                    uint32_t maxStreamID)
 {
   StreamLog5("generating max stream id=%d into pkt=%lx\n",
-             chunk->mMaxStreamID,
+             maxStreamID,
              mMozQuic->mNextTransmitPacketNumber);
-  assert(chunk->mType == ReliableData::kMaxStreamID);
-  assert(chunk->mMaxStreamID);
-  assert(!chunk->mLen);
+  assert(maxStreamID);
 
   uint32_t room = endpkt - framePtr;
   if (room < 5) {
     return MOZQUIC_ERR_GENERAL;
   }
   framePtr[0] = FRAME_TYPE_MAX_STREAM_ID;
-  uint32_t tmp32 = htonl(chunk->mMaxStreamID);
+  uint32_t tmp32 = htonl(maxStreamID);
   memcpy(framePtr + 1, &tmp32, 4);
   framePtr += 5;
   return MOZQUIC_OK;
@@ -962,7 +1408,7 @@ StreamState::CreateStopSendingFrame(unsigned char *&framePtr, const unsigned cha
                                     ReliableData *chunk)
 {
   StreamLog5("generating stop sending code stream %d %x\n",
-             chunk->mStreamID, chunk->mStopSendingCode);
+             chunk->mStreamID, chunk->u.mStopSendingCode);
   assert(chunk->mType == ReliableData::kStopSending);
   assert(chunk->mStreamID);
   assert(!chunk->mLen);
@@ -974,7 +1420,7 @@ StreamState::CreateStopSendingFrame(unsigned char *&framePtr, const unsigned cha
   framePtr[0] = FRAME_TYPE_STOP_SENDING;
   uint32_t tmp32 = htonl(chunk->mStreamID);
   memcpy(framePtr + 1, &tmp32, 4);
-  tmp32 = htonl(chunk->mStopSendingCode);
+  tmp32 = htonl(chunk->u.mStopSendingCode);
   memcpy(framePtr + 5, &tmp32, 4);
   framePtr += 9;
   return MOZQUIC_OK;
@@ -982,22 +1428,19 @@ StreamState::CreateStopSendingFrame(unsigned char *&framePtr, const unsigned cha
 
 uint32_t
 StreamState::CreateMaxDataFrame(unsigned char *&framePtr, const unsigned char *endpkt,
-                                ReliableData *chunk)
+                                uint64_t maxDataKB)
 {
   StreamLog5("generating max data val=%ld (KB) into pkt=%lx\n",
-             chunk->mConnectionCreditKB,
+             maxDataKB,
              mMozQuic->mNextTransmitPacketNumber);
-  assert(chunk->mType == ReliableData::kMaxData);
-  assert(chunk->mConnectionCreditKB);
-  assert(!chunk->mLen);
-  assert(!chunk->mStreamID);
+  assert(maxDataKB);
 
   uint32_t room = endpkt - framePtr;
   if (room < 9) {
     return MOZQUIC_ERR_GENERAL;
   }
   framePtr[0] = FRAME_TYPE_MAX_DATA;
-  uint64_t tmp64 = PR_htonll(chunk->mConnectionCreditKB);
+  uint64_t tmp64 = PR_htonll(maxDataKB);
   memcpy(framePtr + 1, &tmp64, 8);
   framePtr += 9;
   return MOZQUIC_OK;
@@ -1005,33 +1448,28 @@ StreamState::CreateMaxDataFrame(unsigned char *&framePtr, const unsigned char *e
 
 uint32_t
 StreamState::CreateStreamBlockedFrame(unsigned char *&framePtr, const unsigned char *endpkt,
-                                      ReliableData *chunk)
+                                      uint32_t streamID)
 {
   StreamLog2("generating stream blocked id=%d into pkt=%lx\n",
-             chunk->mStreamID,
+             streamID,
              mMozQuic->mNextTransmitPacketNumber);
-  assert(chunk->mType == ReliableData::kStreamBlocked);
-  assert(!chunk->mLen);
 
   uint32_t room = endpkt - framePtr;
   if (room < 5) {
     return MOZQUIC_ERR_GENERAL;
   }
   framePtr[0] = FRAME_TYPE_STREAM_BLOCKED;
-  uint32_t tmp32 = htonl(chunk->mStreamID);
+  uint32_t tmp32 = htonl(streamID);
   memcpy(framePtr + 1, &tmp32, 4);
   framePtr += 5;
   return MOZQUIC_OK;
 }
 
 uint32_t
-StreamState::CreateBlockedFrame(unsigned char *&framePtr, const unsigned char *endpkt,
-                                ReliableData *chunk)
+StreamState::CreateBlockedFrame(unsigned char *&framePtr, const unsigned char *endpkt)
 {
   StreamLog2("generating blocked into pkt=%lx\n",
              mMozQuic->mNextTransmitPacketNumber);
-  assert(chunk->mType == ReliableData::kBlocked);
-  assert(!chunk->mLen);
 
   uint32_t room = endpkt - framePtr;
   if (room < 1) {
@@ -1043,13 +1481,10 @@ StreamState::CreateBlockedFrame(unsigned char *&framePtr, const unsigned char *e
 }
 
 uint32_t
-StreamState::CreateStreamIDBlockedFrame(unsigned char *&framePtr, const unsigned char *endpkt,
-                                        ReliableData *chunk)
+StreamState::CreateStreamIDBlockedFrame(unsigned char *&framePtr, const unsigned char *endpkt)
 {
   StreamLog2("generating streamID needed into pkt=%lx\n",
              mMozQuic->mNextTransmitPacketNumber);
-  assert(chunk->mType == ReliableData::kStreamIDBlocked);
-  assert(!chunk->mLen);
 
   uint32_t room = endpkt - framePtr;
   if (room < 1) {
@@ -1061,7 +1496,8 @@ StreamState::CreateStreamIDBlockedFrame(unsigned char *&framePtr, const unsigned
 }
 
 StreamState::StreamState(MozQuic *q, uint64_t initialStreamWindow,
-                         uint64_t initialConnectionWindowKB)
+                         uint64_t initialConnectionWindowKB,
+                         uint64_t windowBudgetKB)
   : mMozQuic(q)
   , mNextStreamID(1)
   , mPeerMaxStreamData(kMaxStreamDataDefault)
@@ -1071,11 +1507,40 @@ StreamState::StreamState(MozQuic *q, uint64_t initialStreamWindow,
   , mMaxDataBlocked(false)
   , mLocalMaxData(((__uint128_t)initialConnectionWindowKB) << 10)
   , mLocalMaxDataUsed(0)
+  , mLocalMaxDataConsumed(0)
+  , mConnWindow(initialConnectionWindowKB << 10)
+  , mConnWindowUpdateTime(0)
+  , mWindowBudget(windowBudgetKB << 10)
   , mPeerMaxStreamID(kMaxStreamIDDefault)
   , mLocalMaxStreamID(kMaxStreamIDDefault) // todo config
   , mMaxStreamIDBlocked(false)
   , mNextRecvStreamIDUsed(1)
+  , mActiveHead(nullptr)
+  , mActiveTail(nullptr)
+  , mScheduledCount(0)
+  , mMaxDataDirty(false)
+  , mBlockedDirty(false)
+  , mMaxStreamIDDirty(false)
+  , mStreamIDBlockedDirty(false)
 {
+  for (int i = 0; i < kUrgencyLevels; i++) {
+    mSchedHead[i] = nullptr;
+    mSchedTail[i] = nullptr;
+  }
+}
+
+StreamState::~StreamState()
+{
+  // unhook the streams so they don't unlink themselves from a list that
+  // is being torn down
+  while (mActiveHead) {
+    StreamInactive(mActiveHead);
+  }
+  for (int i = 0; i < kUrgencyLevels; i++) {
+    while (mSchedHead[i]) {
+      Unschedule(mSchedHead[i]);
+    }
+  }
 }
 
 StreamPair::StreamPair(uint32_t id, MozQuic *m,
@@ -1085,6 +1550,7 @@ StreamPair::StreamPair(uint32_t id, MozQuic *m,
   , mOut(m, id, flowController, peerMaxStreamData)
   , mIn(m, id, flowController, localMaxStreamData)
   , mMozQuic(m)
+  , mControlDirtyListed(false)
 {
 }
 
@@ -1097,24 +1563,46 @@ StreamPair::Done()
 int
 StreamPair::StopSending(uint32_t code)
 {
-  std::unique_ptr<ReliableData> tmp(new ReliableData(mStreamID, 0, nullptr, 0, 0));
+  std::unique_ptr<ReliableData> tmp(new ReliableData(mStreamID, 0));
   tmp->MakeStopSending(code);
   return mOut.ConnectionWrite(tmp);
 }
 
 uint32_t
-StreamPair::Supply(std::unique_ptr<ReliableData> &p) {
-  assert(p->mType != ReliableData::kRstStream);
-  return mIn.Supply(p);
+StreamPair::Write(const unsigned char *data, uint32_t len, bool fin)
+{
+  if (!mMozQuic->IsOpen()) {
+    return MOZQUIC_ERR_IO;
+  }
+  return mOut.Write(data, len, fin);
 }
 
 uint32_t
-StreamPair::Write(const unsigned char *data, uint32_t len, bool fin)
+StreamPair::Writev(const struct mozquic_iovec *iov, int iovcnt, bool fin)
 {
   if (!mMozQuic->IsOpen()) {
     return MOZQUIC_ERR_IO;
   }
-  return mOut.Write(data, len, fin);
+  return mOut.Writev(iov, iovcnt, fin);
+}
+
+uint32_t
+StreamPair::WriteExternal(const unsigned char *data, uint32_t len, bool fin,
+                          SendBuffer::ReleaseFn release, void *cookie)
+{
+  if (!mMozQuic->IsOpen()) {
+    return MOZQUIC_ERR_IO;
+  }
+  return mOut.WriteExternal(data, len, fin, release, cookie);
+}
+
+uint32_t
+StreamPair::WriteFile(int fd, uint64_t fileOffset, uint64_t len, bool fin)
+{
+  if (!mMozQuic->IsOpen()) {
+    return MOZQUIC_ERR_IO;
+  }
+  return mOut.WriteFile(fd, fileOffset, len, fin);
 }
 
 StreamIn::StreamIn(MozQuic *m, uint32_t id,
@@ -1125,10 +1613,14 @@ StreamIn::StreamIn(MozQuic *m, uint32_t id,
   , mFinalOffset(0)
   , mLocalMaxStreamData(localMaxStreamData)
   , mNextStreamDataExpected(0)
+  , mWindow(localMaxStreamData)
+  , mWindowUpdateTime(0)
   , mFlowController(flowcontroller)
   , mFinRecvd(false)
   , mRstRecvd(false)
   , mEndGivenToApp(false)
+  , mMaxStreamDataDirty(false)
+  , mCreditDeferred(false)
 {
 }
 
@@ -1149,6 +1641,7 @@ StreamIn::ResetInbound()
 {
   assert(Empty());
   mOffset = 0;
+  mBuffer.Reset(0);
   mFinalOffset = 0;
   mFinRecvd = false;
   mRstRecvd = false;
@@ -1171,31 +1664,83 @@ StreamIn::Read(unsigned char *buffer, uint32_t avail, uint32_t &amt, bool &fin)
     return MOZQUIC_OK;
   }
 
-  auto i = mAvailable.begin();
-  if ((*i)->mOffset > mOffset) {
+  if (!mBuffer.Readable()) {
+    // not empty, but nothing to read.. there is a hole before a rst
     assert (mRstRecvd);
     mEndGivenToApp = true;
     return MOZQUIC_ERR_IO;
   }
 
-  uint64_t skip = mOffset - (*i)->mOffset;
-  const unsigned char *src = (*i)->mData.get() + skip;
-  assert((*i)->mLen > skip);
-  uint64_t copyLen = (*i)->mLen - skip;
-  if (copyLen > avail) {
-    copyLen = avail;
+  amt = mBuffer.Read(buffer, avail);
+  mOffset += amt;
+  assert(mOffset == mBuffer.Base());
+  Consumed(amt);
+  if (mFinRecvd && mFinalOffset == mOffset) {
+    fin = true;
+    mEndGivenToApp = true;
+  }
+  return MOZQUIC_OK;
+}
+
+uint32_t
+StreamIn::Readv(const struct mozquic_iovec *iov, int iovcnt, uint32_t &amt, bool &fin)
+{
+  amt = 0;
+  fin = false;
+  uint32_t rv = MOZQUIC_OK;
+  for (int i = 0; i < iovcnt; i++) {
+    uint32_t a;
+    rv = Read((unsigned char *)iov[i].data, iov[i].len, a, fin);
+    amt += a;
+    if ((rv != MOZQUIC_OK) || fin || (a < iov[i].len)) {
+      break;
+    }
   }
-  memcpy (buffer, src, copyLen);
-  amt = copyLen;
-  mOffset += copyLen;
+  return rv;
+}
+
+uint32_t
+StreamIn::Peek(const unsigned char *&data, uint32_t &amt, bool &fin)
+{
+  data = nullptr;
+  amt = 0;
+  fin = false;
   if (mFinRecvd && mFinalOffset == mOffset) {
     fin = true;
     mEndGivenToApp = true;
+    return mRstRecvd ? MOZQUIC_ERR_IO : MOZQUIC_OK;
   }
-  assert(mOffset <= (*i)->mOffset + (*i)->mLen);
-  if (mOffset == (*i)->mOffset + (*i)->mLen) {
-    // we dont need this buffer anymore
-    mAvailable.erase(i);
+  if (Empty()) {
+    return MOZQUIC_OK;
+  }
+
+  if (!mBuffer.Readable()) {
+    assert (mRstRecvd);
+    mEndGivenToApp = true;
+    return MOZQUIC_ERR_IO;
+  }
+
+  amt = mBuffer.Peek(data);
+  // the fin is only reported along with the last bytes, and isn't
+  // given to the app until they are consumed
+  fin = mFinRecvd && (mFinalOffset == mOffset + amt);
+  return MOZQUIC_OK;
+}
+
+uint32_t
+StreamIn::Consume(uint32_t amt, bool &fin)
+{
+  fin = false;
+  if (amt > mBuffer.Readable()) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  mBuffer.Consume(amt);
+  mOffset += amt;
+  assert(mOffset == mBuffer.Base());
+  Consumed(amt);
+  if (mFinRecvd && mFinalOffset == mOffset) {
+    fin = true;
+    mEndGivenToApp = true;
   }
   return MOZQUIC_OK;
 }
@@ -1203,65 +1748,66 @@ StreamIn::Read(unsigned char *buffer, uint32_t avail, uint32_t &amt, bool &fin)
 void
 StreamIn::MaybeIssueFlowControlCredit()
 {
-  uint64_t available = mLocalMaxStreamData - mNextStreamDataExpected;
-  uint32_t increment = mFlowController->GetIncrement();
+  // credit is measured from what the app has consumed, not from what
+  // has arrived - bytes sitting unread in mBuffer keep using the window
+  uint64_t available = mLocalMaxStreamData - mOffset;
   StreamLog7("peer has %ld stream flow control credits available on stream %d\n",
              available, mStreamID);
   if (mFinRecvd || mRstRecvd) {
     return; // does not need more
   }
+  if (available >= mWindow / 2) {
+    return;
+  }
 
-  if ((available < 32 * 1024) ||
-      (available < (increment / 2))) {
-    if (mLocalMaxStreamData > (0xffffffffffffffffULL - increment)) {
-      return;
-    }
-    mLocalMaxStreamData += increment;
-
-    if (mFlowController->IssueStreamCredit(mStreamID, mLocalMaxStreamData) != MOZQUIC_OK) {
-      mLocalMaxStreamData -= increment;
-    }
+  uint64_t window = mFlowController->TuneStreamWindow(mWindow, mWindowUpdateTime);
+  if (mOffset > (0xffffffffffffffffULL - window)) {
+    return;
+  }
+  uint64_t oldMax = mLocalMaxStreamData;
+  mLocalMaxStreamData = mOffset + window;
+  if (mFlowController->IssueStreamCredit(mStreamID, mLocalMaxStreamData) != MOZQUIC_OK) {
+    mLocalMaxStreamData = oldMax;
+    return;
   }
+  mWindow = window;
+  mWindowUpdateTime = MozQuic::Timestamp();
 }
 
 uint32_t
-StreamIn::Supply(std::unique_ptr<ReliableData> &d)
+StreamIn::Supply(uint64_t offset, const unsigned char *data, uint32_t len, bool fin)
 {
-  // new frame segment goes into a linked list ordered by seqno
-  // any overlapping data is dropped
+  // new frame segment is written into the reassembly buffer at its
+  // offset. any overlapping data is dropped
 
   if (mRstRecvd) {
-    d.reset(); // drop it
-    return MOZQUIC_OK;
+    return MOZQUIC_OK; // drop it
   }
 
-  assert(d->mType != ReliableData::kRstStream);
-
-  if (d->mFin) {
+  if (fin) {
     if (!mFinRecvd) {
       mFinRecvd = true;
-      mFinalOffset = d->mOffset + d->mLen;
+      mFinalOffset = offset + len;
     } else {
-      if (mFinalOffset != d->mOffset + d->mLen) {
+      if (mFinalOffset != offset + len) {
         StreamLog1("stream %d recvd fin with offset of %ld.%ld expected %ld\n",
-                   mStreamID, d->mOffset, d->mLen, mFinalOffset);
+                   mStreamID, offset, len, mFinalOffset);
         mMozQuic->Shutdown(FINAL_OFFSET_ERROR, "offset too large");
         return MOZQUIC_ERR_IO;
       }
     }
   }
 
-  if (mFinalOffset && (d->mOffset + d->mLen > mFinalOffset)) {
+  if (mFinalOffset && (offset + len > mFinalOffset)) {
     StreamLog1("stream %d has finoffset of %ld and new packet %ld.%ld\n",
-               mStreamID, mFinalOffset, d->mOffset, d->mLen);
+               mStreamID, mFinalOffset, offset, len);
     mMozQuic->Shutdown(FINAL_OFFSET_ERROR, "offset too large");
     return MOZQUIC_ERR_IO;
   }
   
-  uint64_t endData = d->mOffset + d->mLen;
+  uint64_t endData = offset + len;
   if (endData <= mOffset) {
     // this is 100% old data. we can drop it
-    d.reset();
     return MOZQUIC_OK;
   }
 
@@ -1271,92 +1817,16 @@ StreamIn::Supply(std::unique_ptr<ReliableData> &d)
     }
 
     mNextStreamDataExpected = endData;
-    // todo - credit scheme should be based on how much is queued here.
-    // todo - autotuning
     if (mNextStreamDataExpected > mLocalMaxStreamData) {
       mMozQuic->Shutdown(FLOW_CONTROL_ERROR, "stream flow control error");
       StreamLog1("stream flow control recvd too much data\n");
       return MOZQUIC_ERR_IO;
     }
-    MaybeIssueFlowControlCredit();
-  }
-
-  // if the list is empty, add it to the list!
-  if (mAvailable.empty()) {
-    mAvailable.push_front(std::move(d));
-    return MOZQUIC_OK;
   }
 
-  // note these are reverse iterators so iter++ moves to the left (earlier seqno)
-  // and insert puts new node to the right (later seqno)
-  auto i = mAvailable.rbegin();
-  auto end = mAvailable.rend();
-
-  while (i != end) {
-    // we don't need empty chunks
-    if (!d->mLen) {
-      // todo log
-      std::unique_ptr<ReliableData> x(std::move(d));
-      return MOZQUIC_OK;
-    }
-
-    // check for dup
-    // if i offset && len == d offset && len drop it
-    if ((d->mOffset == (*i)->mOffset) && (d->mLen == (*i)->mLen)) {
-      // todo log
-      // this is a dup. ignore it.
-      std::unique_ptr<ReliableData> x(std::move(d));
-      return MOZQUIC_OK;
-    }
-
-    // check for full append to the right (later seq [d is after i])
-    // if i offset + len <= d.offset then append after
-    if (((*i)->mOffset + (*i)->mLen) <= d->mOffset) {
-      mAvailable.insert(i.base(), std::move(d));
-      return MOZQUIC_OK;
-    }
-
-    // check for full location to the left (earlier seq [d is before i])
-    // if d offset + len <= i.offset then iter left and rpt
-    if ((d->mOffset + d->mLen) <= (*i)->mOffset){
-      i++;
-      continue;
-    }
-
-    // d overlaps with i. Form a new chunk with any portion that
-    // exists to the right and append that (if it exists), and then
-    // adjust the current chunk to only cover data to the left (not
-    // any overlap) and iter to the left.
-    if ((d->mOffset + d->mLen) > ((*i)->mOffset + (*i)->mLen)) {
-      // we need a new chunk
-      uint64_t skip = (*i)->mOffset + (*i)->mLen - d->mOffset;
-      std::unique_ptr<ReliableData>
-        newChunk(new ReliableData(d->mStreamID,
-                                  (*i)->mOffset + (*i)->mLen,
-                                  d->mData.get() + skip,
-                                  d->mLen - skip, false));
-      d->mLen = skip;
-
-      // todo log
-      // append it to the right
-      mAvailable.insert(i.base(), std::move(newChunk));
-      // dont continue or return, still need to deal with remainder
-    }
-
-    if ((*i)->mOffset <= d->mOffset) {
-      // there is no more data to the left. drop it.
-      // todo log
-      std::unique_ptr<ReliableData> x(std::move(d));
-      return MOZQUIC_OK;
-    }
-
-    // adjust data to be non overlapping
-    d->mLen = (*i)->mOffset - d->mOffset;
-    // todo log
-    i++;
-  }
-
-  mAvailable.push_front(std::move(d));
+  // flow control was checked above, so the buffer never grows past
+  // the window we have advertised
+  mBuffer.Insert(offset, data, len);
   return MOZQUIC_OK;
 }
 
@@ -1370,47 +1840,104 @@ StreamIn::Empty()
   if (mFinRecvd && mFinalOffset == mOffset) {
     return false;
   }
-  if (mAvailable.empty()) {
-    return true;
-  }
-
-  auto i = mAvailable.begin();
-  if ((*i)->mOffset > mOffset) {
-    return true;
-  }
+  return !mBuffer.Readable();
+}
 
-  return false;
+static void
+ReleaseAppBuffer(void *owner, void *cookie, const void *data, uint32_t len)
+{
+  reinterpret_cast<MozQuic *>(owner)->ReleaseAppBuffer(cookie, data, len);
 }
 
 StreamOut::StreamOut(MozQuic *m, uint32_t id, FlowController *fc,
                      uint64_t flowControlLimit)
   : mMozQuic(m)
   , mWriter(fc)
+  , mSendBuffer(new SendBuffer(ReleaseAppBuffer, m))
   , mStreamID(id)
   , mOffset(0)
+  , mOffsetPromoted(0)
   , mFlowControlLimit(flowControlLimit)
-  , mOffsetChargedToConnFlowControl(0)
   , mFin(false)
+  , mFinPromoted(false)
   , mRst(false)
   , mBlocked(false)
+  , mStreamBlockedDirty(false)
+  , mActiveListed(false)
+  , mActivePrev(nullptr)
+  , mActiveNext(nullptr)
+  , mUrgency(kUrgencyDefault)
+  , mIncremental(true)
+  , mScheduled(false)
+  , mDeficit(0)
+  , mSchedPrev(nullptr)
+  , mSchedNext(nullptr)
 {
 }
 
 StreamOut::~StreamOut()
 {
+  mWriter->StreamInactive(this);
+  mWriter->Unschedule(this);
 }
 
 uint32_t
-StreamOut::StreamWrite(std::unique_ptr<ReliableData> &p)
+StreamOut::Write(const unsigned char *data, uint32_t len, bool fin)
 {
-  mStreamUnWritten.push_back(std::move(p));
+  if (mRst) {
+    return MOZQUIC_ERR_IO;
+  }
 
+  if (mFin) {
+    return MOZQUIC_ERR_ALREADY_FINISHED;
+  }
+
+  if ((0xfffffffffffffffe - mOffset) < len) {
+    return MOZQUIC_ERR_GENERAL;
+  }
+
+  // the data is framed straight out of the send buffer once flow
+  // control promotes it
+  mSendBuffer->Append(data, len);
+  mOffset += len;
+  mFin = fin;
+  mWriter->StreamActive(this);
   return MOZQUIC_OK;
 }
 
+uint32_t
+StreamOut::Writev(const struct mozquic_iovec *iov, int iovcnt, bool fin)
+{
+  if (mRst) {
+    return MOZQUIC_ERR_IO;
+  }
+
+  if (mFin) {
+    return MOZQUIC_ERR_ALREADY_FINISHED;
+  }
+
+  uint64_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].len;
+  }
+  if ((0xfffffffffffffffe - mOffset) < total) {
+    return MOZQUIC_ERR_GENERAL;
+  }
+
+  // the pieces land back to back in the send buffer, so they are
+  // promoted and framed as if they were one write
+  for (int i = 0; i < iovcnt; i++) {
+    mSendBuffer->Append((const unsigned char *)iov[i].data, iov[i].len);
+  }
+  mOffset += total;
+  mFin = fin;
+  mWriter->StreamActive(this);
+  return MOZQUIC_OK;
+}
 
 uint32_t
-StreamOut::Write(const unsigned char *data, uint32_t len, bool fin)
+StreamOut::WriteExternal(const unsigned char *data, uint32_t len, bool fin,
+                         SendBuffer::ReleaseFn release, void *cookie)
 {
   if (mRst) {
     return MOZQUIC_ERR_IO;
@@ -1420,10 +1947,46 @@ StreamOut::Write(const unsigned char *data, uint32_t len, bool fin)
     return MOZQUIC_ERR_ALREADY_FINISHED;
   }
 
-  std::unique_ptr<ReliableData> tmp(new ReliableData(mStreamID, mOffset, data, len, fin));
+  if ((0xfffffffffffffffe - mOffset) < len) {
+    return MOZQUIC_ERR_GENERAL;
+  }
+
+  // framed straight out of the app's memory, which it gets back when
+  // all of it is acked
+  mSendBuffer->AppendExternal(data, len, release, cookie);
   mOffset += len;
   mFin = fin;
-  return StreamWrite(tmp);
+  mWriter->StreamActive(this);
+  return MOZQUIC_OK;
+}
+
+uint32_t
+StreamOut::WriteFile(int fd, uint64_t fileOffset, uint64_t len, bool fin)
+{
+  if (mRst) {
+    return MOZQUIC_ERR_IO;
+  }
+
+  if (mFin) {
+    return MOZQUIC_ERR_ALREADY_FINISHED;
+  }
+
+  if ((0xfffffffffffffffe - mOffset) < len) {
+    return MOZQUIC_ERR_GENERAL;
+  }
+
+  // nothing is read now - the file is pread a frame at a time when the
+  // data is framed, so a large file costs no buffer memory. The buffer
+  // keeps its own descriptor until the range is acked.
+  int dupFD = dup(fd);
+  if (dupFD < 0) {
+    return MOZQUIC_ERR_IO;
+  }
+  mSendBuffer->AppendFile(dupFD, fileOffset, len);
+  mOffset += len;
+  mFin = fin;
+  mWriter->StreamActive(this);
+  return MOZQUIC_OK;
 }
 
 int
@@ -1433,9 +1996,8 @@ StreamOut::EndStream()
     return MOZQUIC_ERR_ALREADY_FINISHED;
   }
   mFin = true;
-
-  std::unique_ptr<ReliableData> tmp(new ReliableData(mStreamID, mOffset, nullptr, 0, true));
-  return StreamWrite(tmp);
+  mWriter->StreamActive(this);
+  return MOZQUIC_OK;
 }
 
 int
@@ -1446,55 +2008,63 @@ StreamOut::RstStream(uint32_t code)
   }
   mFin = true;
   mRst = true;
+  mWriter->StreamActive(this); // so promotion checks if it can be deleted
 
   // empty local queue before sending rst
   ScrubUnWritten();
     
-  std::unique_ptr<ReliableData> tmp(new ReliableData(mStreamID, mOffset, nullptr, 0, 0));
+  std::unique_ptr<ReliableData> tmp(new ReliableData(mStreamID, mOffset));
   tmp->MakeRstStream(code);
   return mWriter->ConnectionWrite(tmp);
 }
 
-ReliableData::ReliableData(uint32_t id, uint64_t offset,
-                           const unsigned char *data, uint32_t len,
-                           bool fin)
-  : mType(kStream)
-  , mData(new unsigned char[len])
-  , mLen(len)
-  , mStreamID(id)
-  , mOffset(offset)
-  , mFin(fin)
-  , mRstCode(0)
-  , mStreamCreditValue(0)
-  , mConnectionCreditKB(0)
+ReliableData::ReliableData(uint32_t id, uint64_t offset)
+  : mOffset(offset)
+  , mPacketNumber(0)
   , mTransmitTime(0)
+  , mStreamID(id)
+  , mLen(0)
   , mTransmitCount(1)
+  , mType(kStream)
+  , mFin(false)
   , mRetransmitted(false)
   , mTransmitKeyPhase(keyPhaseUnknown)
+  , u()
 {
-  if ((0xfffffffffffffffe - offset) < len) {
-    // todo should not silently truncate like this
-    len = 0xfffffffffffffffe - offset;
-  }
+}
 
-  memcpy((void *)mData.get(), data, len);
+ReliableData::ReliableData(uint32_t id, uint64_t offset,
+                           const std::shared_ptr<SendBuffer> &buffer,
+                           uint32_t len, bool fin)
+  : mOffset(offset)
+  , mPacketNumber(0)
+  , mTransmitTime(0)
+  , mStreamID(id)
+  , mLen(len)
+  , mTransmitCount(1)
+  , mType(kStream)
+  , mFin(fin)
+  , mRetransmitted(false)
+  , mTransmitKeyPhase(keyPhaseUnknown)
+  , u()
+  , mSendBuffer(buffer)
+{
 }
 
 ReliableData::ReliableData(ReliableData &orig)
-  : mType(orig.mType)
-  , mLen(orig.mLen)
-  , mStreamID(orig.mStreamID)
-  , mOffset(orig.mOffset)
-  , mFin(orig.mFin)
-  , mRstCode(orig.mRstCode)
-  , mStreamCreditValue(orig.mStreamCreditValue)
-  , mConnectionCreditKB(orig.mConnectionCreditKB)
+  : mOffset(orig.mOffset)
+  , mPacketNumber(0)
   , mTransmitTime(0)
+  , mStreamID(orig.mStreamID)
+  , mLen(orig.mLen)
   , mTransmitCount(orig.mTransmitCount + 1)
+  , mType(orig.mType)
+  , mFin(orig.mFin)
   , mRetransmitted(false)
   , mTransmitKeyPhase(keyPhaseUnknown)
+  , u(orig.u)
+  , mSendBuffer(orig.mSendBuffer)
 {
-  mData = std::move(orig.mData);
 }
 
 ReliableData::~ReliableData()
@@ -5,14 +5,21 @@
 
 #pragma once
 
+#include "Pool.h"
+#include "StreamBuffer.h"
+
 namespace mozquic  {
 
 enum  {
   kMaxStreamIDDefault   = 1024,
   kMaxStreamDataDefault = 10 * 1024 * 1024,
   kMaxDataDefault       = 50 * 1024 * 1024,
+  kWindowBudgetDefault  = 128 * 1024 * 1024,
+  kUrgencyLevels        = 8,
+  kUrgencyDefault       = 3,
   kRetransmitThresh     = 500,
   kForgetUnAckedThresh  = 4000, // ms
+  kDeficitMinimum       = 256, // smallest round robin turn worth a frame
 };
 
 class StreamAck
@@ -42,15 +49,27 @@ public:
   bool Transmitted() { return !mTransmits.empty(); }
 };
 
+class StreamOut;
+
 class FlowController
 {
 public:
   // the caller owns the unique_ptr if it returns 0
   virtual uint32_t ConnectionWrite(std::unique_ptr<ReliableData> &p) = 0;
   virtual uint32_t ScrubUnWritten(uint32_t id) = 0;
-  virtual uint32_t GetIncrement() = 0;
+  // the receive window to advertise next on a stream, given its current
+  // window and when that was last advertised
+  virtual uint64_t TuneStreamWindow(uint64_t window, uint64_t lastUpdate) = 0;
   virtual uint32_t IssueStreamCredit(uint32_t streamID, uint64_t newMax) = 0;
+  // amt bytes arrived (charged against the window we advertised)
   virtual uint32_t ConnectionReadBytes(uint64_t amt) = 0;
+  // the app has consumed amt bytes, which may open the window
+  virtual uint32_t ConnectionConsumedBytes(uint64_t amt) = 0;
+  // out may have something for flow control promotion to do
+  virtual void StreamActive(StreamOut *out) = 0;
+  virtual void StreamInactive(StreamOut *out) = 0;
+  virtual void SetPriority(StreamOut *out, uint8_t urgency, bool incremental) = 0;
+  virtual void Unschedule(StreamOut *out) = 0;
 };
 
 class StreamOut
@@ -60,31 +79,68 @@ public:
   StreamOut(MozQuic *m, uint32_t id, FlowController *f, uint64_t limit);
   ~StreamOut();
   uint32_t Write(const unsigned char *data, uint32_t len, bool fin);
+  uint32_t Writev(const struct mozquic_iovec *iov, int iovcnt, bool fin);
+  uint32_t WriteExternal(const unsigned char *data, uint32_t len, bool fin,
+                         SendBuffer::ReleaseFn release, void *cookie);
+  uint32_t WriteFile(int fd, uint64_t fileOffset, uint64_t len, bool fin);
   int EndStream();
   int RstStream(uint32_t code);
-  bool Done() { return mFin && mStreamUnWritten.empty(); }
-  uint32_t ScrubUnWritten() { mStreamUnWritten.clear(); return mWriter->ScrubUnWritten(mStreamID); }
+  bool Done() {
+    return mUnWritten.empty() &&
+      mFin && (mRst || (mFinPromoted && (mOffsetPromoted == mOffset)));
+  }
+  uint32_t ScrubUnWritten() {
+    mOffsetPromoted = mOffset;
+    mFinPromoted = true;
+    return mWriter->ScrubUnWritten(mStreamID);
+  }
   void NewFlowControlLimit(uint64_t limit) {
     mFlowControlLimit = limit;
+    mWriter->StreamActive(this);
   }
   uint32_t ConnectionWrite(std::unique_ptr<ReliableData> &p) {
     return mWriter->ConnectionWrite(p);
   }
+  // the app has written bytes or a fin that are not yet promoted
+  bool Unpromoted() { return (mOffsetPromoted != mOffset) || (mFin && !mFinPromoted); }
+  void SetPriority(uint8_t urgency, bool incremental) {
+    mWriter->SetPriority(this, urgency, incremental);
+  }
 
 private:
   MozQuic *mMozQuic;
-  uint32_t StreamWrite(std::unique_ptr<ReliableData> &p);
-  
+
   FlowController *mWriter;
-  std::list<std::unique_ptr<ReliableData>> mStreamUnWritten;
+  // bytes [mOffsetPromoted, mOffset) have been written by the app but not
+  // yet promoted to the connection by flow control. Everything that is
+  // promoted lives on in mSendBuffer until it is acked.
+  std::shared_ptr<SendBuffer> mSendBuffer;
   uint32_t mStreamID;
   uint64_t mOffset;
+  uint64_t mOffsetPromoted;
   uint64_t mFlowControlLimit;
-  uint64_t mOffsetChargedToConnFlowControl;
 
   bool mFin;
+  bool mFinPromoted;
   bool mRst;
   bool mBlocked; // blocked on stream based flow control
+  bool mStreamBlockedDirty; // a STREAM_BLOCKED needs to be sent
+
+  // link in StreamState's list of streams for FlowControlPromotion
+  bool mActiveListed;
+  StreamOut *mActivePrev;
+  StreamOut *mActiveNext;
+
+  // promoted (or retransmitted) frames waiting to be written. While
+  // there are any the stream is scheduled in StreamState's list for
+  // mUrgency.
+  std::list<std::unique_ptr<ReliableData>> mUnWritten;
+  uint8_t mUrgency; // 0 is the most urgent
+  bool mIncremental; // take turns with the class instead of draining first
+  bool mScheduled;
+  uint32_t mDeficit; // bytes left in this turn (incremental streams)
+  StreamOut *mSchedPrev;
+  StreamOut *mSchedNext;
 };
 
 class StreamState : public FlowController
@@ -92,20 +148,30 @@ class StreamState : public FlowController
   friend class MozQuic;
 public:
   StreamState(MozQuic *, uint64_t initialStreamWindow,
-                         uint64_t initialConnectionWindow);
+                         uint64_t initialConnectionWindow,
+                         uint64_t windowBudgetKB);
+  ~StreamState();
 
   // FlowController Methods
   uint32_t ConnectionWrite(std::unique_ptr<ReliableData> &p) override;
   uint32_t ScrubUnWritten(uint32_t id) override;
-  uint32_t GetIncrement() override;
+  uint64_t TuneStreamWindow(uint64_t window, uint64_t lastUpdate) override;
   uint32_t IssueStreamCredit(uint32_t streamID, uint64_t newMax) override;
   uint32_t ConnectionReadBytes(uint64_t amt) override;
+  uint32_t ConnectionConsumedBytes(uint64_t amt) override;
+  void StreamActive(StreamOut *out) override;
+  void StreamInactive(StreamOut *out) override;
+  void SetPriority(StreamOut *out, uint8_t urgency, bool incremental) override;
+  void Unschedule(StreamOut *out) override;
   
   uint32_t StartNewStream(StreamPair **outStream, const void *data, uint32_t amount, bool fin);
-  uint32_t FindStream(uint32_t streamID, std::unique_ptr<ReliableData> &d);
+  uint32_t FindStream(uint32_t streamID, uint64_t offset,
+                      const unsigned char *data, uint32_t len, bool fin);
   uint32_t RetransmitTimer();
+  uint32_t RetransmitEarlyData(); // 0-RTT was not accepted
   bool     MaybeDeleteStream(uint32_t streamID);
   uint32_t RstStream(uint32_t streamID, uint32_t code);
+  void     FailStreamSend(uint32_t streamID, uint64_t finalOffset);
 
   uint32_t Flush(bool forceAck);
   uint32_t HandleStreamFrame(FrameHeaderData *result, bool fromCleartext,
@@ -137,30 +203,41 @@ public:
                                   uint32_t &_ptr);
   uint32_t CreateStreamFrames(unsigned char *&framePtr, const unsigned char *endpkt,
                               bool justZero);
+  uint32_t CreateControlFrames(unsigned char *&framePtr, const unsigned char *endpkt);
+  uint32_t CreateStreamFrame(unsigned char *&framePtr, const unsigned char *endpkt,
+                             std::unique_ptr<ReliableData> &queued, uint32_t limit,
+                             bool &consumed, uint32_t &written);
   uint32_t CreateRstStreamFrame(unsigned char *&framePtr, const unsigned char *endpkt,
                                 ReliableData *chunk);
   uint32_t CreateStopSendingFrame(unsigned char *&framePtr, const unsigned char *endpkt,
                                   ReliableData *chunk);
   uint32_t CreateMaxStreamDataFrame(unsigned char *&framePtr, const unsigned char *endpkt,
-                                    ReliableData *chunk);
+                                    uint32_t streamID, uint64_t maxStreamData);
   uint32_t CreateMaxDataFrame(unsigned char *&framePtr, const unsigned char *endpkt,
-                              ReliableData *chunk);
+                              uint64_t maxDataKB);
   uint32_t CreateMaxStreamIDFrame(unsigned char *&framePtr, const unsigned char *endpkt,
-                                  ReliableData *chunk);
+                                  uint32_t maxStreamID);
   uint32_t CreateStreamBlockedFrame(unsigned char *&framePtr, const unsigned char *endpkt,
-                                    ReliableData *chunk);
-  uint32_t CreateBlockedFrame(unsigned char *&framePtr, const unsigned char *endpkt,
-                              ReliableData *chunk);
-  uint32_t CreateStreamIDBlockedFrame(unsigned char *&framePtr, const unsigned char *endpkt,
-                                      ReliableData *chunk);
+                                    uint32_t streamID);
+  uint32_t CreateBlockedFrame(unsigned char *&framePtr, const unsigned char *endpkt);
+  uint32_t CreateStreamIDBlockedFrame(unsigned char *&framePtr, const unsigned char *endpkt);
 
   void InitIDs(uint32_t next, uint32_t nextR) { mNextStreamID = next; mNextRecvStreamIDUsed = nextR; }
   void MaybeIssueFlowControlCredit();
 
 private:
+  uint64_t TuneWindow(uint64_t window, uint64_t lastUpdate, uint64_t cap);
   uint32_t FlowControlPromotion();
-  uint32_t FlowControlPromotionForStreamPair(StreamPair *);
-  uint64_t CalculateConnectionCharge(ReliableData *data, StreamOut *out);
+  uint32_t FlowControlPromotionForStream(StreamOut *);
+  StreamPair *FindStreamPair(uint32_t streamID);
+  void MarkStreamControlDirty(StreamPair *sp);
+  bool ControlFramesPending();
+  void ControlFrameSent(std::unique_ptr<ReliableData> &frame);
+  bool RedirtyControlFrame(ReliableData *lost);
+  void SetTransmitted(ReliableData *sent);
+  void Schedule(StreamOut *out);
+  void QueueStreamData(StreamOut *out, std::unique_ptr<ReliableData> &p);
+  bool UnWrittenPending() { return !mConnUnWritten.empty() || mScheduledCount; }
   
   MozQuic *mMozQuic;
   uint32_t mNextStreamID;
@@ -176,6 +253,16 @@ private: // these still need friend mozquic
 
   __uint128_t mLocalMaxData; // conn credit announced to peer
   __uint128_t mLocalMaxDataUsed; // conn credit consumed by peer
+  __uint128_t mLocalMaxDataConsumed; // bytes the app has read (or that were reset)
+
+  // receive windows start at the advertised size and double whenever the
+  // peer uses one up within a couple of round trips of it being
+  // advertised - i.e. when the window, not the app, is limiting the
+  // transfer. Nothing grows past mWindowBudget, and a stream window never
+  // grows past the connection window.
+  uint64_t mConnWindow;
+  uint64_t mConnWindowUpdateTime;
+  uint64_t mWindowBudget;
 
   uint32_t mPeerMaxStreamID;  // id limit set by peer
   uint32_t mLocalMaxStreamID; // id limit sent to peer
@@ -185,13 +272,49 @@ private: // these still need friend mozquic
   std::unique_ptr<StreamPair> mStream0;
   std::unordered_map<uint32_t, std::shared_ptr<StreamPair>> mStreams;
 
+  // only streams with unpromoted data or fin (or a reset that may make
+  // them deletable) are listed, so promotion does not scan idle streams.
+  // Streams blocked by stream flow control leave the list until their
+  // limit is raised.
+  StreamOut *mActiveHead;
+  StreamOut *mActiveTail;
+  std::vector<uint32_t> mMaybeDone; // reused by FlowControlPromotion
+
+  // streams with frames to write, one list per urgency. Packets are
+  // filled from the most urgent non empty list. Within a list the
+  // incremental streams are served deficit round robin - each turn at
+  // the front is worth a packet's worth of bytes (the mtu), and the
+  // stream goes to the back once less than kDeficitMinimum of them are
+  // left. That remainder is carried into its next turn. Any other stream
+  // keeps the front until its frames are written.
+  StreamOut *mSchedHead[kUrgencyLevels];
+  StreamOut *mSchedTail[kUrgencyLevels];
+  uint32_t   mScheduledCount;
+
+  // flow control frames are not queued. Each one is a dirty flag next to
+  // the value it carries, and CreateControlFrames writes the current value
+  // when a packet is built - so an update that is superseded before it is
+  // sent costs nothing, and a lost one is resent with the newest value.
+  bool mMaxDataDirty;
+  bool mBlockedDirty;
+  bool mMaxStreamIDDirty;
+  bool mStreamIDBlockedDirty;
+  // streams with a dirty StreamIn::mMaxStreamDataDirty or
+  // StreamOut::mStreamBlockedDirty. An id is listed once.
+  std::vector<uint32_t> mControlDirtyStreams;
+  // streams whose credit was held back by mBackPressure
+  std::vector<uint32_t> mCreditDeferredStreams;
+
   // retransmit happens off of mUnAckedData by
-  // duplicating it and placing it in mConnUnWritten. The
+  // duplicating it and placing it in mConnUnWritten (or the stream's
+  // StreamOut::mUnWritten). The
   // dup'd entry is marked retransmitted so it doesn't repeat that. After a
   // certain amount of time the retransmitted packet is just forgotten (as
   // it won't be retransmitted again - that happens to the dup'd
   // incarnation)
   // mUnackedData is sorted by the packet number it was sent in.
+  // mConnUnWritten holds stream 0, resets and stop sendings (and data of
+  // streams that are gone). It is written ahead of the scheduled streams.
   std::list<std::unique_ptr<ReliableData>> mConnUnWritten;
   std::list<std::unique_ptr<ReliableData>> mUnAckedData;
 
@@ -207,51 +330,70 @@ private: // these still need friend mozquic
   std::list<StreamAck>                    mAckList;
 };
 
-class ReliableData
+// a cache line holds all of one frame: the fields touched on every send,
+// ack and retransmit come first, then the value of a control frame and
+// the send buffer of a stream frame.
+class alignas(64) ReliableData
 {
 public:
-  ReliableData(uint32_t id, uint64_t offset, const unsigned char *data,
+  // control frames - the type is set by one of the Make functions
+  ReliableData(uint32_t id, uint64_t offset);
+
+  // outbound stream data is a view of the stream's send buffer
+  ReliableData(uint32_t id, uint64_t offset,
+               const std::shared_ptr<SendBuffer> &buffer,
                uint32_t len, bool fin);
 
-  // This form of ctor steals the data pointer. used for retransmit
+  // used for retransmit
   ReliableData(ReliableData &);
   ~ReliableData();
 
-  void MakeRstStream(uint32_t code) { mType = kRstStream; mRstCode = code;}
-  void MakeStopSending(uint32_t code) { mType = kStopSending; mStopSendingCode = code;}
-  void MakeMaxStreamData(uint64_t offset) { mType = kMaxStreamData; mStreamCreditValue = offset;}
-  void MakeMaxData(uint64_t kb) { mType = kMaxData; mConnectionCreditKB = kb;}
-  void MakeMaxStreamID(uint32_t maxID) {mType = kMaxStreamID; mMaxStreamID = maxID; }
+  // these come and go with every frame, so they are recycled through a
+  // per thread free list rather than malloc
+  static void *operator new(size_t size) { return Pool::AllocReliableData(size); }
+  static void operator delete(void *p) { Pool::FreeReliableData(p); }
+
+  void MakeRstStream(uint32_t code) { mType = kRstStream; u.mRstCode = code;}
+  void MakeStopSending(uint32_t code) { mType = kStopSending; u.mStopSendingCode = code;}
+  // flow control frames only record what was sent for loss recovery. The
+  // value is whatever is current when they are written
+  void MakeMaxStreamData() { mType = kMaxStreamData; }
+  void MakeMaxData() { mType = kMaxData; }
+  void MakeMaxStreamID() { mType = kMaxStreamID; }
   void MakeStreamBlocked() { mType = kStreamBlocked; }
   void MakeBlocked() { mType = kBlocked; }
   void MakeStreamIDBlocked() { mType = kStreamIDBlocked; }
 
-  enum 
-  {
-    kStream, kRstStream, kMaxStreamData, kStreamBlocked, kMaxData, kBlocked,
-    kStreamIDBlocked, kMaxStreamID, kStopSending
-  } mType;
-  
-  std::unique_ptr<const unsigned char []>mData;
-  uint32_t mLen;
-  uint32_t mStreamID;
   uint64_t mOffset;
-  bool     mFin;
-
-  uint32_t mRstCode; // for kRstStream
-  uint32_t mStopSendingCode;
-  uint64_t mStreamCreditValue; // for kMaxStreamData
-  uint64_t mConnectionCreditKB; // for kMaxData 
-  uint32_t mMaxStreamID; // for kMaxStreamID
-  
   // when unacked these are set
   uint64_t mPacketNumber;
   uint64_t mTransmitTime; // todo.. hmm if this gets queued for any cc/fc reason (same for ack)
+  uint32_t mStreamID;
+  uint32_t mLen;
   uint16_t mTransmitCount;
+
+  enum : uint8_t
+  {
+    kStream, kRstStream, kMaxStreamData, kStreamBlocked, kMaxData, kBlocked,
+    kStreamIDBlocked, kMaxStreamID, kStopSending
+  } mType;
+
+  bool     mFin;
   bool     mRetransmitted; // no data after retransmitted
   enum keyPhase mTransmitKeyPhase;
+
+  // only the member for mType is meaningful
+  union
+  {
+    uint32_t mRstCode;            // for kRstStream
+    uint32_t mStopSendingCode;    // for kStopSending
+  } u;
+
+  std::shared_ptr<SendBuffer> mSendBuffer; // for outbound kStream
 };
 
+static_assert(sizeof(ReliableData) == 64, "ReliableData should fill exactly one cache line");
+
 class StreamIn
 {
   friend class StreamState;
@@ -259,33 +401,43 @@ public:
   StreamIn(MozQuic *m, uint32_t id, FlowController *flowController, uint64_t localMSD);
   ~StreamIn();
   uint32_t Read(unsigned char *buffer, uint32_t avail, uint32_t &amt, bool &fin);
-  uint32_t Supply(std::unique_ptr<ReliableData> &p);
+  uint32_t Readv(const struct mozquic_iovec *iov, int iovcnt, uint32_t &amt, bool &fin);
+  uint32_t Peek(const unsigned char *&data, uint32_t &amt, bool &fin);
+  uint32_t Consume(uint32_t amt, bool &fin);
+  uint32_t Supply(uint64_t offset, const unsigned char *data, uint32_t len, bool fin);
   void MaybeIssueFlowControlCredit();
   bool     Empty();
+  uint64_t Readable() { return mBuffer.Readable(); } // in order bytes buffered
 
   bool Done() {
     return mEndGivenToApp;
   }
   uint32_t ResetInbound(); // reset as in start over for hrr, not stream reset
   uint32_t HandleResetStream(uint64_t finalOffset);
-  uint32_t ScrubUnRead() { mAvailable.clear(); return MOZQUIC_OK; }
+  uint32_t ScrubUnRead() { mBuffer.Reset(mOffset); return MOZQUIC_OK; }
 
 private:
+  void Consumed(uint64_t amt); // the app took amt bytes - maybe issue credit
+
   MozQuic *mMozQuic;
   uint32_t mStreamID;
-  uint64_t mOffset;
+  uint64_t mOffset; // next byte to give to the app. same as mBuffer.Base()
   uint64_t mFinalOffset;
 
   uint64_t mLocalMaxStreamData; // highest flow control we have sent to peer
   uint64_t mNextStreamDataExpected;
+  uint64_t mWindow; // autotuned receive window
+  uint64_t mWindowUpdateTime; // when mLocalMaxStreamData was last raised
 
   FlowController *mFlowController;
 
   bool     mFinRecvd;
   bool     mRstRecvd;
   bool     mEndGivenToApp;
+  bool     mMaxStreamDataDirty; // mLocalMaxStreamData needs to be sent
+  bool     mCreditDeferred; // in StreamState::mCreditDeferredStreams
 
-  std::list<std::unique_ptr<ReliableData>> mAvailable;
+  RecvBuffer mBuffer;
 };
 
 class StreamPair
@@ -296,17 +448,36 @@ public:
   ~StreamPair() {};
 
   // Supply places data on the input (i.e. read()) queue
-  uint32_t Supply(std::unique_ptr<ReliableData> &p);
+  uint32_t Supply(uint64_t offset, const unsigned char *data, uint32_t len, bool fin) {
+    return mIn.Supply(offset, data, len, fin);
+  }
 
-  // todo it would be nice to have a zero copy interface
   uint32_t Read(unsigned char *buffer, uint32_t avail, uint32_t &amt, bool &fin) {
     return mIn.Read(buffer, avail, amt, fin);
   }
 
+  uint32_t Readv(const struct mozquic_iovec *iov, int iovcnt, uint32_t &amt, bool &fin) {
+    return mIn.Readv(iov, iovcnt, amt, fin);
+  }
+
+  // zero copy form of Read - Peek lends out the reassembly buffer
+  // and Consume returns it
+  uint32_t Peek(const unsigned char *&data, uint32_t &amt, bool &fin) {
+    return mIn.Peek(data, amt, fin);
+  }
+
+  uint32_t Consume(uint32_t amt, bool &fin) {
+    return mIn.Consume(amt, fin);
+  }
+
   bool Empty() {
     return mIn.Empty();
   }
 
+  uint64_t Readable() {
+    return mIn.Readable();
+  }
+
   uint32_t ResetInbound();
 
   void NewFlowControlLimit(uint64_t limit) {
@@ -314,6 +485,10 @@ public:
   }
 
   uint32_t Write(const unsigned char *data, uint32_t len, bool fin);
+  uint32_t Writev(const struct mozquic_iovec *iov, int iovcnt, bool fin);
+  uint32_t WriteExternal(const unsigned char *data, uint32_t len, bool fin,
+                         SendBuffer::ReleaseFn release, void *cookie);
+  uint32_t WriteFile(int fd, uint64_t fileOffset, uint64_t len, bool fin);
 
   int EndStream() {
     return mOut.EndStream();
@@ -324,6 +499,10 @@ public:
   }
 
   int StopSending(uint32_t code);
+
+  void SetPriority(uint8_t urgency, bool incremental) {
+    mOut.SetPriority(urgency, incremental);
+  }
   
   bool Done(); // All data and fin bit given to an application and all data are transmitted and acked.
                // todo(or stream has been reseted)
@@ -333,6 +512,7 @@ public:
   StreamOut mOut;
   StreamIn  mIn;
   MozQuic *mMozQuic;
+  bool mControlDirtyListed; // in StreamState::mControlDirtyStreams
 };
 
 }
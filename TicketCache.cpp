@@ -0,0 +1,212 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "TicketCache.h"
+#include "MozQuic.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+namespace mozquic  {
+
+static std::mutex sTicketLock;
+typedef std::unordered_map<std::string, std::vector<unsigned char>> TokenMap;
+static TokenMap sTickets;
+static TokenMap sAddressTokens;
+
+static std::atomic<uint64_t> sClientHandshakes(0);
+static std::atomic<uint64_t> sClientOffered(0);
+static std::atomic<uint64_t> sClientResumed(0);
+static std::atomic<uint64_t> sServerHandshakes(0);
+static std::atomic<uint64_t> sServerResumed(0);
+static std::atomic<uint64_t> sClientEarlySent(0);
+static std::atomic<uint64_t> sClientEarlyAccepted(0);
+static std::atomic<uint64_t> sServerEarlyAccepted(0);
+
+std::string
+TicketCache::Key(const char *origin, int port)
+{
+  char buf[16];
+  snprintf(buf, sizeof(buf), ":%d", port);
+  return std::string(origin ? origin : "") + buf;
+}
+
+static bool
+LookupLocked(TokenMap &map, const std::string &key, std::vector<unsigned char> &token)
+{
+  std::lock_guard<std::mutex> lock(sTicketLock);
+  auto i = map.find(key);
+  if (i == map.end()) {
+    return false;
+  }
+  token = i->second;
+  return true;
+}
+
+static void
+StoreLocked(TokenMap &map, const std::string &key, const unsigned char *token, uint32_t len)
+{
+  std::lock_guard<std::mutex> lock(sTicketLock);
+  if (key.size() > 0xffff) {
+    return;
+  }
+  if (map.size() >= kTicketCacheMax && map.find(key) == map.end()) {
+    // no lru - any one will do
+    map.erase(map.begin());
+  }
+  map[key].assign(token, token + len);
+}
+
+bool
+TicketCache::Lookup(const std::string &key, std::vector<unsigned char> &token)
+{
+  return LookupLocked(sTickets, key, token);
+}
+
+void
+TicketCache::Store(const std::string &key, const unsigned char *token, uint32_t len)
+{
+  StoreLocked(sTickets, key, token, len);
+}
+
+void
+TicketCache::Remove(const std::string &key)
+{
+  std::lock_guard<std::mutex> lock(sTicketLock);
+  sTickets.erase(key);
+}
+
+bool
+TicketCache::LookupAddressToken(const std::string &key, std::vector<unsigned char> &token)
+{
+  return LookupLocked(sAddressTokens, key, token);
+}
+
+void
+TicketCache::StoreAddressToken(const std::string &key, const unsigned char *token, uint32_t len)
+{
+  StoreLocked(sAddressTokens, key, token, len);
+}
+
+uint32_t
+TicketCache::Export(unsigned char *buf, uint32_t avail, uint32_t &used)
+{
+  std::lock_guard<std::mutex> lock(sTicketLock);
+  uint64_t needed = 0;
+  for (auto i = sTickets.begin(); i != sTickets.end(); ++i) {
+    needed += 2 + i->first.size() + 4 + i->second.size();
+  }
+  if (needed > 0xffffffff) {
+    used = 0;
+    return MOZQUIC_ERR_GENERAL;
+  }
+  used = needed;
+  if (!buf || needed > avail) {
+    return MOZQUIC_ERR_MEMORY;
+  }
+
+  unsigned char *p = buf;
+  for (auto i = sTickets.begin(); i != sTickets.end(); ++i) {
+    uint16_t keyLen = i->first.size();
+    uint32_t tokenLen = i->second.size();
+    p[0] = keyLen >> 8;
+    p[1] = keyLen;
+    memcpy(p + 2, i->first.data(), keyLen);
+    p += 2 + keyLen;
+    p[0] = tokenLen >> 24;
+    p[1] = tokenLen >> 16;
+    p[2] = tokenLen >> 8;
+    p[3] = tokenLen;
+    memcpy(p + 4, i->second.data(), tokenLen);
+    p += 4 + tokenLen;
+  }
+  return MOZQUIC_OK;
+}
+
+uint32_t
+TicketCache::Import(const unsigned char *buf, uint32_t len)
+{
+  // check the whole thing before taking any of it
+  const unsigned char *end = buf + len;
+  const unsigned char *p = buf;
+  while (p != end) {
+    if (end - p < 2) {
+      return MOZQUIC_ERR_INVALID;
+    }
+    uint32_t keyLen = (p[0] << 8) | p[1];
+    p += 2;
+    if ((uint64_t)(end - p) < keyLen + 4) {
+      return MOZQUIC_ERR_INVALID;
+    }
+    p += keyLen;
+    uint32_t tokenLen = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    p += 4;
+    if ((uint64_t)(end - p) < tokenLen) {
+      return MOZQUIC_ERR_INVALID;
+    }
+    p += tokenLen;
+  }
+
+  p = buf;
+  while (p != end) {
+    uint32_t keyLen = (p[0] << 8) | p[1];
+    std::string key((const char *)p + 2, keyLen);
+    p += 2 + keyLen;
+    uint32_t tokenLen = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    Store(key, p + 4, tokenLen);
+    p += 4 + tokenLen;
+  }
+  return MOZQUIC_OK;
+}
+
+void
+TicketCache::CountHandshake(bool isClient, bool offered, bool resumed)
+{
+  if (isClient) {
+    sClientHandshakes++;
+    if (offered) {
+      sClientOffered++;
+    }
+    if (resumed) {
+      sClientResumed++;
+    }
+  } else {
+    sServerHandshakes++;
+    if (resumed) {
+      sServerResumed++;
+    }
+  }
+}
+
+void
+TicketCache::CountEarlyData(bool isClient, bool accepted)
+{
+  if (isClient) {
+    sClientEarlySent++;
+    if (accepted) {
+      sClientEarlyAccepted++;
+    }
+  } else if (accepted) {
+    sServerEarlyAccepted++;
+  }
+}
+
+void
+TicketCache::GetStats(struct mozquic_ticket_stats *stats)
+{
+  stats->clientHandshakes = sClientHandshakes;
+  stats->clientOffered = sClientOffered;
+  stats->clientResumed = sClientResumed;
+  stats->serverHandshakes = sServerHandshakes;
+  stats->serverResumed = sServerResumed;
+  stats->clientEarlySent = sClientEarlySent;
+  stats->clientEarlyAccepted = sClientEarlyAccepted;
+  stats->serverEarlyAccepted = sServerEarlyAccepted;
+}
+
+} // namespace
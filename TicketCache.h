@@ -0,0 +1,53 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct mozquic_ticket_stats;
+
+namespace mozquic  {
+
+enum {
+  kTicketCacheMax = 1024 // origins remembered
+};
+
+// TicketCache keeps the latest TLS resumption token (the session ticket
+// plus what NSS needs to use it) for each origin:port a client has
+// connected to, so the next connection can resume with a PSK instead of
+// a full handshake. It is process wide and locked - handshakes may run
+// on workers.
+class TicketCache
+{
+public:
+  static std::string Key(const char *origin, int port);
+
+  static bool Lookup(const std::string &key, std::vector<unsigned char> &token);
+  static void Store(const std::string &key, const unsigned char *token, uint32_t len);
+  static void Remove(const std::string &key);
+
+  // the server's latest address validation token for origin:port. these
+  // let the next connection skip a stateless retry. they are opaque to
+  // the client and are not part of Export.
+  static bool LookupAddressToken(const std::string &key, std::vector<unsigned char> &token);
+  static void StoreAddressToken(const std::string &key, const unsigned char *token, uint32_t len);
+
+  // a flat copy of the whole cache for another process. entries are
+  // [2 byte key len][key][4 byte token len][token], network order. used
+  // is set to the size needed even when avail is too small.
+  static uint32_t Export(unsigned char *buf, uint32_t avail, uint32_t &used);
+  static uint32_t Import(const unsigned char *buf, uint32_t len);
+
+  // offered means a cached token was given to the client handshake
+  static void CountHandshake(bool isClient, bool offered, bool resumed);
+  // a connection that tried 0-RTT, once its handshake is complete
+  static void CountEarlyData(bool isClient, bool accepted);
+  static void GetStats(struct mozquic_ticket_stats *stats);
+};
+
+} // namespace
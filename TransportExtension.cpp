@@ -18,6 +18,7 @@ enum TransportExtensionID {
   kOmitConnectionID     = 0x4,
   kMaxPacketSize        = 0x5,
   kStatelessResetToken  = 0x6,
+  kAddressToken         = 0x7f51, // private - see MozQuic::AddressTokenMake
 };
 
 void
@@ -135,6 +136,38 @@ TransportExtension::Decode16ByteObject(const unsigned char *input,
   _offset += 16;
 }
 
+void
+TransportExtension::EncodeAddressToken(unsigned char *output, uint16_t &_offset, uint16_t maxOutput,
+                                       const unsigned char *token, uint16_t tokenLen)
+{
+  if (!tokenLen) {
+    return;
+  }
+  Encode2ByteObject(output, _offset, maxOutput, kAddressToken);
+  Encode2ByteObject(output, _offset, maxOutput, tokenLen);
+  assert(_offset + tokenLen <= maxOutput);
+  if (_offset + tokenLen > maxOutput) {
+    return;
+  }
+  memcpy(output + _offset, token, tokenLen);
+  _offset += tokenLen;
+}
+
+void
+TransportExtension::DecodeAddressToken(const unsigned char *input,
+                                       uint16_t &_offset, uint16_t len,
+                                       unsigned char *_token, uint16_t &_tokenLen)
+{
+  // one that does not fit is ignored rather than an error
+  if (_token && len <= _tokenLen) {
+    memcpy(_token, input + _offset, len);
+    _tokenLen = len;
+  } else {
+    _tokenLen = 0;
+  }
+  _offset += len;
+}
+
 void
 TransportExtension::EncodeClientTransportParameters(unsigned char *output, uint16_t &_offset, uint16_t maxOutput,
                                                     uint32_t negotiatedVersion,
@@ -142,7 +175,9 @@ TransportExtension::EncodeClientTransportParameters(unsigned char *output, uint1
                                                     uint32_t initialMaxStreamData,
                                                     __uint128_t initialMaxDataBytes,
                                                     uint32_t initialMaxStreamID,
-                                                    uint16_t idleTimeout)
+                                                    uint16_t idleTimeout,
+                                                    const unsigned char *addressToken,
+                                                    uint16_t addressTokenLen)
 {
   assert(!(initialMaxDataBytes & 0x3ff));
   assert((initialMaxDataBytes >> 10) <= 0xffffffff);
@@ -150,12 +185,14 @@ TransportExtension::EncodeClientTransportParameters(unsigned char *output, uint1
   
   Encode4ByteObject(output, _offset, maxOutput, negotiatedVersion);
   Encode4ByteObject(output, _offset, maxOutput, initialVersion);
-  Encode2ByteObject(output, _offset, maxOutput, 30); // size of next 4 parameters
+  // size of next 4 parameters and the token
+  Encode2ByteObject(output, _offset, maxOutput, 30 + (addressTokenLen ? 4 + addressTokenLen : 0));
 
   Encode2xLenx4Record(output, _offset, maxOutput, kInitialMaxStreamData, initialMaxStreamData);
   Encode2xLenx4Record(output, _offset, maxOutput, kInitialMaxData, initialMaxDataKB);
   Encode2xLenx4Record(output, _offset, maxOutput, kInitialMaxStreamID, initialMaxStreamID);
   Encode2xLenx2Record(output, _offset, maxOutput, kIdleTimeout, idleTimeout);
+  EncodeAddressToken(output, _offset, maxOutput, addressToken, addressTokenLen);
 }
 
 uint32_t
@@ -165,8 +202,12 @@ TransportExtension::DecodeClientTransportParameters(unsigned char *input, uint16
                                                     uint32_t &_initialMaxStreamData,
                                                     uint32_t &_initialMaxDataKB,
                                                     uint32_t &_initialMaxStreamID,
-                                                    uint16_t &_idleTimeout)
+                                                    uint16_t &_idleTimeout,
+                                                    unsigned char *_addressToken,
+                                                    uint16_t &_addressTokenLen)
 {
+  uint16_t addressTokenMax = _addressTokenLen;
+  _addressTokenLen = 0;
   if (inputSize < 10) { // the version fields and size of params
     return MOZQUIC_ERR_GENERAL;
   }
@@ -213,6 +254,10 @@ TransportExtension::DecodeClientTransportParameters(unsigned char *input, uint16
         break;
       case kStatelessResetToken:
         return MOZQUIC_ERR_GENERAL;
+      case kAddressToken:
+        _addressTokenLen = addressTokenMax;
+        DecodeAddressToken(input, offset, len, _addressToken, _addressTokenLen);
+        break;
       default:
         offset += len;
         break;
@@ -229,7 +274,9 @@ TransportExtension::EncodeServerTransportParameters(unsigned char *output, uint1
                                                     __uint128_t initialMaxDataBytes,
                                                     uint32_t initialMaxStreamID,
                                                     uint16_t idleTimeout,
-                                                    unsigned char *statelessResetToken /* 16 bytes */)
+                                                    unsigned char *statelessResetToken /* 16 bytes */,
+                                                    const unsigned char *addressToken,
+                                                    uint16_t addressTokenLen)
 {
   assert(!(initialMaxDataBytes & 0x3ff));
   assert((initialMaxDataBytes >> 10) <= 0xffffffff);
@@ -241,7 +288,8 @@ TransportExtension::EncodeServerTransportParameters(unsigned char *output, uint1
     Encode4ByteObject(output, _offset, maxOutput, versionList[i]);
   }
 
-  Encode2ByteObject(output, _offset, maxOutput, 50); // size of next 5 parameters
+  // size of next 5 parameters and the token
+  Encode2ByteObject(output, _offset, maxOutput, 50 + (addressTokenLen ? 4 + addressTokenLen : 0));
   Encode2xLenx4Record(output, _offset, maxOutput, kInitialMaxStreamData, initialMaxStreamData);
   Encode2xLenx4Record(output, _offset, maxOutput, kInitialMaxData, initialMaxDataKB);
   Encode2xLenx4Record(output, _offset, maxOutput, kInitialMaxStreamID, initialMaxStreamID);
@@ -250,6 +298,7 @@ TransportExtension::EncodeServerTransportParameters(unsigned char *output, uint1
   Encode2ByteObject(output, _offset, maxOutput, kStatelessResetToken);
   Encode2ByteObject(output, _offset, maxOutput, 16);
   Encode16ByteObject(output, _offset, maxOutput, statelessResetToken);
+  EncodeAddressToken(output, _offset, maxOutput, addressToken, addressTokenLen);
 }
 
 uint32_t
@@ -259,8 +308,12 @@ TransportExtension::DecodeServerTransportParameters(unsigned char *input, uint16
                                                     uint32_t &_initialMaxDataKB,
                                                     uint32_t &_initialMaxStreamID,
                                                     uint16_t &_idleTimeout,
-                                                    unsigned char *_statelessResetToken /* 16 bytes */)
+                                                    unsigned char *_statelessResetToken /* 16 bytes */,
+                                                    unsigned char *_addressToken,
+                                                    uint16_t &_addressTokenLen)
 {
+  uint16_t addressTokenMax = _addressTokenLen;
+  _addressTokenLen = 0;
   if (inputSize < 6) {
     return MOZQUIC_ERR_GENERAL;
   }
@@ -297,10 +350,8 @@ TransportExtension::DecodeServerTransportParameters(unsigned char *input, uint16
   bool version = false, maxStreamData = false, maxData = false, maxStreamID = false, idleTimeout = false;
   bool statelessReset = false;
 
-  do {
-    if (inputSize - offset < 4) {
-      return MOZQUIC_ERR_GENERAL;
-    }
+  while (inputSize - offset >= 4) {
+    // scan them all - the address token follows the required ones
     uint16_t id, len;
     Decode2ByteObject(input, offset, inputSize, id);
     Decode2ByteObject(input, offset, inputSize, len);
@@ -332,16 +383,18 @@ TransportExtension::DecodeServerTransportParameters(unsigned char *input, uint16
         Decode16ByteObject(input, offset, inputSize, _statelessResetToken);
         statelessReset= true;
         break;
+      case kAddressToken:
+        _addressTokenLen = addressTokenMax;
+        DecodeAddressToken(input, offset, len, _addressToken, _addressTokenLen);
+        break;
       default:
         offset += len;
         break;
       }
-    if (maxStreamData && maxData && maxStreamID && idleTimeout && statelessReset) {
-      return MOZQUIC_OK;
-    }
-  } while (1);
-  
-  return MOZQUIC_ERR_GENERAL;
+  }
+
+  return (maxStreamData && maxData && maxStreamID && idleTimeout && statelessReset) ?
+    MOZQUIC_OK : MOZQUIC_ERR_GENERAL;
 }
 
 }
@@ -33,21 +33,33 @@ private:
   static void Decode16ByteObject(const unsigned char *input,
                                  uint16_t &_offset, uint16_t inputSize,
                                  unsigned char *_output);
+  static void EncodeAddressToken(unsigned char *output, uint16_t &_offset, uint16_t maxOutput,
+                                 const unsigned char *token, uint16_t tokenLen);
+  static void DecodeAddressToken(const unsigned char *input,
+                                 uint16_t &_offset, uint16_t len,
+                                 unsigned char *_token, uint16_t &_tokenLen);
 public:
+  // the address token is optional in both directions. addressTokenLen 0
+  // leaves it out, and on decode _addressTokenLen is the room in
+  // _addressToken going in and the size found (or 0) coming out
   static void EncodeClientTransportParameters(unsigned char *output, uint16_t &_offset, uint16_t maxOutput,
                                               uint32_t negotiatedVersion,
                                               uint32_t initialVersion,
                                               uint32_t initialMaxStreamData,
                                               __uint128_t initialMaxData,
                                               uint32_t initialMaxStreamID,
-                                              uint16_t idleTimeout);
+                                              uint16_t idleTimeout,
+                                              const unsigned char *addressToken,
+                                              uint16_t addressTokenLen);
   static uint32_t DecodeClientTransportParameters(unsigned char *input, uint16_t inputSize,
                                                   uint32_t &_negotiatedVersion,
                                                   uint32_t &_initialVersion,
                                                   uint32_t &_initialMaxStreamData,
                                                   uint32_t &_initialMaxData,
                                                   uint32_t &_initialMaxStreamID,
-                                                  uint16_t &_idleTimeout);
+                                                  uint16_t &_idleTimeout,
+                                                  unsigned char *_addressToken,
+                                                  uint16_t &_addressTokenLen);
   
   static void EncodeServerTransportParameters(unsigned char *output, uint16_t &_offset, uint16_t maxOutput,
                                               const uint32_t *versionList, uint16_t versionListSize,
@@ -55,14 +67,18 @@ public:
                                               __uint128_t initialMaxData,
                                               uint32_t initialMaxStreamID,
                                               uint16_t idleTimeout,
-                                              unsigned char *statelessResetToken /* 16 bytes */);
+                                              unsigned char *statelessResetToken /* 16 bytes */,
+                                              const unsigned char *addressToken,
+                                              uint16_t addressTokenLen);
   static uint32_t DecodeServerTransportParameters(unsigned char *input, uint16_t inputSize,
                                                   uint32_t *versionList, uint16_t &_versionListSize,
                                                   uint32_t &_initialMaxStreamData,
                                                   uint32_t &_initialMaxData,
                                                   uint32_t &_initialMaxStreamID,
                                                   uint16_t &_idleTimeout,
-                                                  unsigned char *_statelessResetToken /* 16 bytes */);
+                                                  unsigned char *_statelessResetToken /* 16 bytes */,
+                                                  unsigned char *_addressToken,
+                                                  uint16_t &_addressTokenLen);
 
 private:
   TransportExtension(){}
@@ -0,0 +1,197 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#if 0
+
+  ./aead-bench [-packets N] [-size BYTES] [-chacha]
+
+Times packet protection through NSSHelper::ProtectBlocks, once with a
+reused AEAD context (one PK11_AEADOp per packet) and once without (one
+PK11_Encrypt/PK11_Decrypt per packet, which sets up a new context and
+key schedule each time). Defaults are 200000 packets of 1200 bytes with
+AES-128-GCM. Prints ns and TSC cycles per packet for each way.
+
+#endif
+
+#include "../../MozQuic.h"
+#include "../../NSSHelper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+using mozquic::NSSHelper;
+
+static uint64_t
+Now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+Cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static int
+has_arg(int argc, char **argv, const char *arg, char **value)
+{
+  for (int i = 1; i < argc; i++) {
+    if (!strcasecmp(argv[i], arg)) {
+      if (value) {
+        *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// encrypts then opens every packet, checking the round trip, and reports
+// the cost of each half
+static int
+Run(const char *name, CK_MECHANISM_TYPE mech, PK11SymKey *key,
+    PK11Context *sealer, PK11Context *opener, uint32_t packets, uint32_t size)
+{
+  const uint32_t kBatch = 16; // what a flush typically hands over
+  unsigned char iv[12];
+  unsigned char aad[32];
+  memset(iv, 0x5a, sizeof(iv));
+  memset(aad, 0xa5, sizeof(aad));
+
+  std::vector<unsigned char> plain(size);
+  for (uint32_t i = 0; i < size; i++) {
+    plain[i] = i % 251;
+  }
+  std::vector<unsigned char> sealed(kBatch * (size + 16));
+  std::vector<unsigned char> opened(kBatch * size);
+  NSSHelper::PacketBlock blocks[kBatch];
+
+  uint64_t sealNs = 0, sealCycles = 0, openNs = 0, openCycles = 0;
+  for (uint32_t done = 0; done < packets; done += kBatch) {
+    uint32_t count = (packets - done < kBatch) ? (packets - done) : kBatch;
+    for (uint32_t i = 0; i < count; i++) {
+      blocks[i].mAAD = aad;
+      blocks[i].mAADLen = sizeof(aad);
+      blocks[i].mData = plain.data();
+      blocks[i].mDataLen = size;
+      blocks[i].mPacketNumber = done + i;
+      blocks[i].mOut = sealed.data() + i * (size + 16);
+      blocks[i].mOutAvail = size + 16;
+    }
+    uint64_t t = Now(), c = Cycles();
+    if (NSSHelper::ProtectBlocks(true, sealer, key, mech, iv, blocks, count) != MOZQUIC_OK) {
+      fprintf(stderr, "%s: seal failed\n", name);
+      return 1;
+    }
+    sealNs += Now() - t;
+    sealCycles += Cycles() - c;
+
+    for (uint32_t i = 0; i < count; i++) {
+      blocks[i].mData = sealed.data() + i * (size + 16);
+      blocks[i].mDataLen = blocks[i].mWritten;
+      blocks[i].mOut = opened.data() + i * size;
+      blocks[i].mOutAvail = size;
+    }
+    t = Now();
+    c = Cycles();
+    if (NSSHelper::ProtectBlocks(false, opener, key, mech, iv, blocks, count) != MOZQUIC_OK) {
+      fprintf(stderr, "%s: open failed\n", name);
+      return 1;
+    }
+    openNs += Now() - t;
+    openCycles += Cycles() - c;
+
+    for (uint32_t i = 0; i < count; i++) {
+      if (blocks[i].mWritten != size || memcmp(blocks[i].mOut, plain.data(), size)) {
+        fprintf(stderr, "%s: round trip mismatch\n", name);
+        return 1;
+      }
+    }
+  }
+
+  fprintf(stdout, "%-10s seal %6lu ns %7lu cycles/packet, open %6lu ns %7lu cycles/packet\n",
+          name, (unsigned long)(sealNs / packets), (unsigned long)(sealCycles / packets),
+          (unsigned long)(openNs / packets), (unsigned long)(openCycles / packets));
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  char *value;
+  uint32_t packets = 200000;
+  uint32_t size = 1200;
+  if (has_arg(argc, argv, "-packets", &value) && value) {
+    packets = strtoul(value, nullptr, 10);
+  }
+  if (has_arg(argc, argv, "-size", &value) && value) {
+    size = strtoul(value, nullptr, 10);
+  }
+  if (!packets || !size) {
+    fprintf(stderr, "bad -packets or -size\n");
+    return 1;
+  }
+  bool chacha = has_arg(argc, argv, "-chacha", nullptr);
+
+  if (NSS_NoDB_Init(nullptr) != SECSuccess) {
+    fprintf(stderr, "NSS init failed\n");
+    return 1;
+  }
+
+  CK_MECHANISM_TYPE mech = chacha ? CKM_NSS_CHACHA20_POLY1305 : CKM_AES_GCM;
+  unsigned char raw[32];
+  PK11SymKey *key = nullptr;
+  if (PK11_GenerateRandom(raw, sizeof(raw)) == SECSuccess) {
+    SECItem keyItem = {siBuffer, raw, chacha ? 32u : 16u};
+    PK11SlotInfo *slot = PK11_GetInternalSlot();
+    key = PK11_ImportSymKey(slot, mech, PK11_OriginUnwrap, CKA_ENCRYPT, &keyItem, nullptr);
+    PK11_FreeSlot(slot);
+  }
+  if (!key) {
+    fprintf(stderr, "key import failed\n");
+    return 1;
+  }
+
+  fprintf(stdout, "%s, %u packets of %u bytes\n",
+          chacha ? "chacha20-poly1305" : "aes-128-gcm", packets, size);
+
+  int rv = Run("one-shot", mech, key, nullptr, nullptr, packets, size);
+#ifdef MOZQUIC_AEAD_CONTEXT
+  PK11Context *sealer = NSSHelper::CreateAEADContext(mech, key, true);
+  PK11Context *opener = NSSHelper::CreateAEADContext(mech, key, false);
+  if (!sealer || !opener) {
+    fprintf(stderr, "context creation failed\n");
+    rv = 1;
+  } else {
+    rv |= Run("context", mech, key, sealer, opener, packets, size);
+  }
+  if (sealer) {
+    PK11_DestroyContext(sealer, PR_TRUE);
+  }
+  if (opener) {
+    PK11_DestroyContext(opener, PR_TRUE);
+  }
+#else
+  fprintf(stdout, "context    needs NSS 3.52\n");
+#endif
+
+  PK11_FreeSymKey(key);
+  NSS_Shutdown();
+  return rv;
+}
@@ -0,0 +1,254 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#if 0
+
+  MOZQUIC_NSS_CONFIG=sample/nss-config ./handshake-bench [-handshakes N]
+
+Runs servers and clients in one process over loopback and times N
+handshakes, one after another, each driven until both ends are
+connected. It does this against a server that imports every
+connection's TLS socket from its model socket and against one that sets
+the noServerModel knob, so each connection configures TLS from scratch.
+The passes take turns in rounds of 50 so drift hits both alike. Prints
+the time spent in the server's IO per handshake (the server's cost) and
+the wall time per handshake (both ends). Defaults to 2000 handshakes.
+
+Each client is gone before it reads a session ticket, so every handshake
+is a full one. The resumed count printed at the end shows that.
+
+#endif
+
+#include "../../MozQuic.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Pass
+{
+  const char *name;
+  mozquic_connection_t *server;
+  mozquic_connection_t *client;
+  mozquic_connection_t *child;
+  bool clientConnected;
+  bool serverConnected;
+  bool failed;
+  uint64_t serverNs;
+  uint64_t wallNs;
+  uint32_t done;
+};
+
+static uint64_t
+Now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+has_arg(int argc, char **argv, const char *arg, char **value)
+{
+  for (int i = 1; i < argc; i++) {
+    if (!strcasecmp(argv[i], arg)) {
+      if (value) {
+        *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int
+FreePort()
+{
+  struct sockaddr_in sin;
+  socklen_t slen = sizeof(sin);
+  int port = 0;
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  if (!bind(fd, (const struct sockaddr *)&sin, sizeof(sin)) &&
+      !getsockname(fd, (struct sockaddr *)&sin, &slen)) {
+    port = ntohs(sin.sin_port);
+  }
+  close(fd);
+  return port;
+}
+
+static int
+EventCB(void *closure, uint32_t event, void *param)
+{
+  Pass *pass = reinterpret_cast<Pass *>(closure);
+  switch (event) {
+  case MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION:
+    pass->child = reinterpret_cast<mozquic_connection_t *>(param);
+    mozquic_set_event_callback(pass->child, EventCB);
+    mozquic_set_event_callback_closure(pass->child, pass);
+    break;
+  case MOZQUIC_EVENT_CONNECTED:
+    if (param == pass->client) {
+      pass->clientConnected = true;
+    } else {
+      pass->serverConnected = true;
+    }
+    break;
+  case MOZQUIC_EVENT_ERROR:
+  case MOZQUIC_EVENT_CLOSE_CONNECTION:
+    if (param == pass->client || param == pass->child) {
+      pass->failed = true;
+    }
+    break;
+  }
+  return MOZQUIC_OK;
+}
+
+static bool
+StartServer(Pass *pass, bool noServerModel, int port)
+{
+  struct mozquic_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.originName = "foo.example.com"; // the cert in sample/nss-config
+  config.originPort = port;
+  config.handleIO = 0;
+  config.connection_event_callback = EventCB;
+  config.closure = pass;
+  mozquic_unstable_api1(&config, "tolerateBadALPN", 1, 0);
+  mozquic_unstable_api1(&config, "noServerModel", noServerModel, 0);
+  return mozquic_new_connection(&pass->server, &config) == MOZQUIC_OK &&
+    mozquic_start_server(pass->server) == MOZQUIC_OK;
+}
+
+// one handshake, from a new client to both ends connected. both ends are
+// destroyed after
+static bool
+Handshake(Pass *pass, int port)
+{
+  struct mozquic_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.originName = "localhost";
+  config.originPort = port;
+  config.handleIO = 0;
+  config.connection_event_callback = EventCB;
+  config.closure = pass;
+  mozquic_unstable_api1(&config, "ignorePKI", 1, 0);
+  mozquic_unstable_api1(&config, "tolerateBadALPN", 1, 0);
+
+  pass->child = nullptr;
+  pass->clientConnected = pass->serverConnected = pass->failed = false;
+  uint64_t start = Now();
+  if (mozquic_new_connection(&pass->client, &config) != MOZQUIC_OK ||
+      mozquic_start_client(pass->client) != MOZQUIC_OK) {
+    return false;
+  }
+  while (!(pass->clientConnected && pass->serverConnected) && !pass->failed &&
+         (Now() - start < 5000000000ULL)) {
+    mozquic_IO(pass->client);
+    uint64_t t = Now();
+    mozquic_IO(pass->server);
+    pass->serverNs += Now() - t;
+  }
+  pass->wallNs += Now() - start;
+  bool ok = pass->clientConnected && pass->serverConnected && !pass->failed;
+
+  if (pass->child) {
+    mozquic_destroy_connection(pass->child);
+  }
+  mozquic_destroy_connection(pass->client);
+  pass->client = nullptr;
+  // the client's close reaches the server now, outside the timed part
+  mozquic_IO(pass->server);
+  pass->done++;
+  return ok;
+}
+
+static void
+Report(Pass *pass)
+{
+  fprintf(stdout, "%-9s server %6lu us/handshake (%5lu/s), wall %6lu us/handshake\n",
+          pass->name,
+          (unsigned long)(pass->serverNs / pass->done / 1000),
+          (unsigned long)(pass->serverNs ? 1000000000ULL * pass->done / pass->serverNs : 0),
+          (unsigned long)(pass->wallNs / pass->done / 1000));
+}
+
+int
+main(int argc, char **argv)
+{
+  char *value;
+  uint32_t handshakes = 2000;
+  if (has_arg(argc, argv, "-handshakes", &value) && value) {
+    handshakes = strtoul(value, nullptr, 10);
+  }
+  if (!handshakes) {
+    fprintf(stderr, "bad -handshakes\n");
+    return 1;
+  }
+
+  char *cdir = getenv("MOZQUIC_NSS_CONFIG");
+  if (mozquic_nss_config(cdir) != MOZQUIC_OK) {
+    fprintf(stderr, "MOZQUIC_NSS_CONFIG FAILURE [%s]\n", cdir ? cdir : "");
+    return 1;
+  }
+
+  Pass passes[2];
+  memset(passes, 0, sizeof(passes));
+  passes[0].name = "model";
+  passes[1].name = "no model";
+  int ports[2];
+  for (int i = 0; i < 2; i++) {
+    ports[i] = FreePort();
+    if (!ports[i] || !StartServer(&passes[i], i == 1, ports[i])) {
+      fprintf(stderr, "server start failed\n");
+      return 1;
+    }
+  }
+
+  fprintf(stdout, "%u handshakes each\n", handshakes);
+
+  // untimed warm up of nss and both servers
+  for (int i = 0; i < 2; i++) {
+    for (int j = 0; j < 20; j++) {
+      if (!Handshake(&passes[i], ports[i])) {
+        fprintf(stderr, "%s: warm up handshake failed\n", passes[i].name);
+        return 1;
+      }
+    }
+    passes[i].serverNs = passes[i].wallNs = passes[i].done = 0;
+  }
+
+  const uint32_t kRound = 50;
+  for (uint32_t done = 0; done < handshakes; done += kRound) {
+    uint32_t count = (handshakes - done < kRound) ? (handshakes - done) : kRound;
+    for (int i = 0; i < 2; i++) {
+      for (uint32_t j = 0; j < count; j++) {
+        if (!Handshake(&passes[i], ports[i])) {
+          fprintf(stderr, "%s: handshake %u failed\n", passes[i].name, passes[i].done);
+          return 1;
+        }
+      }
+    }
+  }
+
+  Report(&passes[0]);
+  Report(&passes[1]);
+
+  struct mozquic_ticket_stats stats;
+  mozquic_ticket_stats(&stats);
+  fprintf(stdout, "server handshakes %lu resumed %lu\n",
+          (unsigned long)stats.serverHandshakes, (unsigned long)stats.serverResumed);
+
+  mozquic_destroy_connection(passes[0].server);
+  mozquic_destroy_connection(passes[1].server);
+  return 0;
+}
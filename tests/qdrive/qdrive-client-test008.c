@@ -6,7 +6,8 @@
 // -qdrive-test8 pushes 2 streams in parallel and
 // recvs another 2 in parallel. each should be 250K + streamid
 // long. when server has done its reading it sends a 3rd stream
-// when client has read all 3 streams it closes session
+// when client has read all 3 streams it checks the pool stats and
+// closes session
 
 #include "qdrive-common.h"
 #include <stdio.h>
@@ -41,12 +42,9 @@ int testEvent8(void *closure, uint32_t event, void *param)
   test_assert(event != MOZQUIC_EVENT_ERROR);
 
   if (event == MOZQUIC_EVENT_CONNECTED) {
+    // start here - the server's streams can arrive before the next io event
     test_assert(state.state == 0);
     state.state++;
-    return MOZQUIC_OK;
-  }
-
-  if (state.state == 1) {
     mozquic_start_new_stream(&state.stream1, param, gbuf, sizeof(gbuf), 0);
     mozquic_start_new_stream(&state.stream2, param, gbuf, sizeof(gbuf), 0);
     for (int j=1; j<250; j++) {
@@ -98,6 +96,13 @@ int testEvent8(void *closure, uint32_t event, void *param)
     test_assert(state.read1 == 250 * 1024 + 2);
     test_assert(state.read2 == 250 * 1024 + 4);
 
+    // a MB of stream data recycles frames and ring storage
+    struct mozquic_pool_stats stats;
+    test_assert(mozquic_pool_stats(&stats) == MOZQUIC_OK);
+    test_assert(stats.frameHits > 0);
+    test_assert(stats.frameMisses > 0);
+    test_assert(stats.bufferHits + stats.bufferMisses > 0);
+
     mozquic_destroy_connection(parentConnection);
     fprintf(stderr,"exit ok\n");
     exit(0);
@@ -0,0 +1,118 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test11 the client opens a stream and the server answers it
+// with 64000 bytes and a fin. The client lets the data queue up
+// unread for 500ms and then reads 100 bytes with mozquic_recv_all,
+// asserting that the rest of what arrived (many frames worth) is
+// reported as readable. It then drains the stream with recv_all and
+// checks every byte.
+
+#include "qdrive-common.h"
+#include <stdio.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  uint64_t time0;
+  uint64_t time1;
+  uint32_t ctr;
+  mozquic_stream_t *stream;
+} state;
+
+void *testGetClosure11()
+{
+  return &state;
+}
+
+void testConfig11(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+}
+
+static void checkData11(unsigned char *buf, uint32_t len)
+{
+  for (uint32_t i = 0; i < len; i++) {
+    test_assert(buf[i] == ((state.ctr + i) % 251));
+  }
+  state.ctr += len;
+}
+
+int testEvent11(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_CLOSE_CONNECTION);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+
+  if (!state.time0) {
+    test_assert(state.state == 0);
+    state.state++;
+    state.time0 = Timestamp();
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 1);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 2) {
+    unsigned char buf = 1;
+    mozquic_start_new_stream(&state.stream, param, &buf, 1, 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA && state.state == 3) {
+    // leave it unread for a while so a lot of frames pile up
+    test_assert(param == state.stream);
+    state.time1 = Timestamp();
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 4 && (Timestamp() - state.time1 > 500)) {
+    unsigned char buf[100];
+    uint32_t read = 0;
+    int fin = 0;
+    uint64_t readable = 0;
+    uint32_t code = mozquic_recv_all(state.stream, buf, sizeof(buf), &read, &fin, &readable);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(read == sizeof(buf));
+    test_assert(!fin);
+    fprintf(stderr,"test11 client read %d with %ld more readable\n",
+            read, readable);
+    // more than one packet worth of frames is contiguous behind it
+    test_assert(readable > 2000);
+    test_assert(readable <= 64000 - sizeof(buf));
+    checkData11(buf, read);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 5) {
+    unsigned char buf[64000];
+    uint32_t read = 0;
+    int fin = 0;
+    uint64_t readable = 0;
+    do {
+      uint32_t code = mozquic_recv_all(state.stream, buf, sizeof(buf), &read, &fin, &readable);
+      test_assert(code == MOZQUIC_OK);
+      // a big enough buffer always drains everything that is readable
+      test_assert(!readable);
+      checkData11(buf, read);
+    } while (read && !fin);
+
+    if (fin) {
+      test_assert(state.ctr == 64000);
+      mozquic_destroy_connection(parentConnection);
+      fprintf(stderr,"exit ok\n");
+      exit(0);
+    }
+  }
+
+  return MOZQUIC_OK;
+}
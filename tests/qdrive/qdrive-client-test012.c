@@ -0,0 +1,94 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test12 the client opens a stream and the server answers it
+// with 64000 bytes and a fin. The client reads it all with the zero
+// copy mozquic_recv_peek / mozquic_recv_consume interface, consuming
+// it in odd sized pieces and checking every byte in place.
+
+#include "qdrive-common.h"
+#include <stdio.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  uint32_t ctr;
+  mozquic_stream_t *stream;
+} state;
+
+void *testGetClosure12()
+{
+  return &state;
+}
+
+void testConfig12(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+}
+
+int testEvent12(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_CLOSE_CONNECTION);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 1) {
+    unsigned char buf = 1;
+    mozquic_start_new_stream(&state.stream, param, &buf, 1, 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    test_assert(param == state.stream);
+
+    const unsigned char *data = NULL;
+    const unsigned char *data2 = NULL;
+    uint32_t amount = 0, amount2 = 0;
+    int fin = 0, fin2 = 0;
+    uint32_t code = mozquic_recv_peek(state.stream, (const void **)&data, &amount, &fin);
+    test_assert(code == MOZQUIC_OK);
+    if (!amount) {
+      test_assert(!fin);
+      return MOZQUIC_OK;
+    }
+
+    // peeking again without consuming lends out the same bytes
+    code = mozquic_recv_peek(state.stream, (const void **)&data2, &amount2, &fin2);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(data == data2);
+    test_assert(amount == amount2);
+    test_assert(fin == fin2);
+
+    for (uint32_t i = 0; i < amount; i++) {
+      test_assert(data[i] == ((state.ctr + i) % 251));
+    }
+
+    // consume an odd sized piece, unless it is the end
+    uint32_t piece = (amount > 777 && !fin) ? 777 : amount;
+    test_assert(mozquic_recv_consume(state.stream, piece) == MOZQUIC_OK);
+    state.ctr += piece;
+    fprintf(stderr,"test12 client consumed %d of %d now at %d\n",
+            piece, amount, state.ctr);
+    test_assert(state.ctr <= 64000);
+
+    if (fin && piece == amount) {
+      test_assert(state.ctr == 64000);
+      mozquic_destroy_connection(parentConnection);
+      fprintf(stderr,"exit ok\n");
+      exit(0);
+    }
+  }
+
+  return MOZQUIC_OK;
+}
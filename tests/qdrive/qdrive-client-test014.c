@@ -0,0 +1,93 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test14 the client sends a request made of a header, a body
+// and a trailer with one mozquic_sendv and a fin. The server gathers it
+// with mozquic_recvv into 3 buffers of unrelated sizes, checks it, and
+// answers with a 2 piece mozquic_sendv that the client reads with
+// mozquic_recvv.
+
+#include "qdrive-common.h"
+#include <stdio.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  uint32_t ctr;
+  mozquic_stream_t *stream;
+} state;
+
+void *testGetClosure14()
+{
+  return &state;
+}
+
+void testConfig14(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+}
+
+int testEvent14(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_CLOSE_CONNECTION);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 1) {
+    // 100 + 5000 + 50 bytes of (offset % 251)
+    unsigned char buf[5150];
+    for (int i = 0; i < sizeof(buf); i++) {
+      buf[i] = i % 251;
+    }
+    struct mozquic_iovec iov[3];
+    iov[0].data = buf;
+    iov[0].len = 100;
+    iov[1].data = buf + 100;
+    iov[1].len = 5000;
+    iov[2].data = buf + 5100;
+    iov[2].len = 50;
+    mozquic_start_new_stream(&state.stream, param, NULL, 0, 0);
+    test_assert(state.stream != NULL);
+    test_assert(mozquic_sendv(state.stream, iov, 3, 1) == MOZQUIC_OK);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    test_assert(param == state.stream);
+    unsigned char a[3], b[5];
+    struct mozquic_iovec iov[2];
+    iov[0].data = a;
+    iov[0].len = sizeof(a);
+    iov[1].data = b;
+    iov[1].len = sizeof(b);
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recvv(state.stream, iov, 2, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    for (uint32_t i = 0; i < read; i++) {
+      unsigned char c = (i < sizeof(a)) ? a[i] : b[i - sizeof(a)];
+      test_assert(c == 'a' + state.ctr + i);
+    }
+    state.ctr += read;
+    test_assert(state.ctr <= 8);
+    if (fin) {
+      test_assert(state.ctr == 8);
+      mozquic_destroy_connection(parentConnection);
+      fprintf(stderr,"exit ok\n");
+      exit(0);
+    }
+  }
+
+  return MOZQUIC_OK;
+}
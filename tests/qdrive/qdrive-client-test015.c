@@ -0,0 +1,74 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test15 the client opens a stream and the server writes a
+// 150000 byte temp file and answers with bytes [1000, 101000) of it
+// using mozquic_send_file with fin. The server closes its own fd right
+// away. The client checks the data and the fin.
+
+#include "qdrive-common.h"
+#include <stdio.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  uint32_t ctr;
+  mozquic_stream_t *stream;
+} state;
+
+void *testGetClosure15()
+{
+  return &state;
+}
+
+void testConfig15(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+}
+
+int testEvent15(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_CLOSE_CONNECTION);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+  test_assert(event != MOZQUIC_EVENT_RESET_STREAM);
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 1) {
+    unsigned char buf = 1;
+    mozquic_start_new_stream(&state.stream, param, &buf, 1, 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    test_assert(param == state.stream);
+    unsigned char buf[5000];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(state.stream, buf, sizeof(buf), &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    for (uint32_t i = 0; i < read; i++) {
+      test_assert(buf[i] == ((1000 + state.ctr + i) % 251));
+    }
+    state.ctr += read;
+    test_assert(state.ctr <= 100000);
+    if (fin) {
+      test_assert(state.ctr == 100000);
+      mozquic_destroy_connection(parentConnection);
+      fprintf(stderr,"exit ok\n");
+      exit(0);
+    }
+  }
+
+  return MOZQUIC_OK;
+}
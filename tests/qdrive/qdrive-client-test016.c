@@ -0,0 +1,112 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test16 the client opens a stream to say go. The server then
+// opens a bulk stream at urgency 7 and writes 200000 bytes to it, and
+// after that opens an urgent stream at urgency 0 and writes 1000 bytes
+// and a fin to it. The client checks that the urgent stream is complete
+// before the bulk stream is.
+
+#include "qdrive-common.h"
+#include <stdio.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  mozquic_stream_t *stream;
+  mozquic_stream_t *bulk;
+  mozquic_stream_t *urgent;
+  uint32_t bulkCtr;
+  uint32_t urgentCtr;
+  int urgentDone;
+} state;
+
+void *testGetClosure16()
+{
+  return &state;
+}
+
+void testConfig16(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+}
+
+int testEvent16(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_CLOSE_CONNECTION);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+  test_assert(event != MOZQUIC_EVENT_RESET_STREAM);
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 1) {
+    unsigned char buf = 1;
+    mozquic_start_new_stream(&state.stream, param, &buf, 1, 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    mozquic_stream_t *stream = param;
+    test_assert(stream != state.stream);
+    unsigned char buf[5000];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(stream, buf, sizeof(buf), &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    if (!read && !fin) {
+      return MOZQUIC_OK;
+    }
+
+    unsigned char *data = buf;
+    if (stream != state.bulk && stream != state.urgent) {
+      // the first byte says which stream this is
+      test_assert(read);
+      test_assert(buf[0] == 1 || buf[0] == 2);
+      if (buf[0] == 1) {
+        state.bulk = stream;
+      } else {
+        state.urgent = stream;
+      }
+      data++;
+      read--;
+    }
+
+    if (stream == state.bulk) {
+      for (uint32_t i = 0; i < read; i++) {
+        test_assert(data[i] == 1);
+      }
+      state.bulkCtr += read;
+      test_assert(state.bulkCtr <= 200000);
+      if (fin) {
+        test_assert(state.bulkCtr == 200000);
+        test_assert(state.urgentDone);
+        mozquic_destroy_connection(parentConnection);
+        fprintf(stderr,"exit ok\n");
+        exit(0);
+      }
+    } else {
+      for (uint32_t i = 0; i < read; i++) {
+        test_assert(data[i] == 2);
+      }
+      state.urgentCtr += read;
+      test_assert(state.urgentCtr <= 1000);
+      if (fin) {
+        test_assert(state.urgentCtr == 1000);
+        test_assert(state.bulkCtr < 200000);
+        state.urgentDone = 1;
+      }
+    }
+  }
+
+  return MOZQUIC_OK;
+}
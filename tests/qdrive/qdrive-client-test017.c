@@ -0,0 +1,108 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test17 the client opens a stream to say go. The server then
+// opens 4 streams at the default priority, one after the other, and
+// writes 50000 bytes and a fin to each. The client checks that every
+// stream has started before any of them is complete - i.e. the first
+// stream written does not drain before the others get a turn.
+
+#include "qdrive-common.h"
+#include <stdio.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  mozquic_stream_t *stream;
+  mozquic_stream_t *streams[4];
+  uint32_t ctr[4];
+  int done;
+} state;
+
+void *testGetClosure17()
+{
+  return &state;
+}
+
+void testConfig17(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+}
+
+int testEvent17(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_CLOSE_CONNECTION);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+  test_assert(event != MOZQUIC_EVENT_RESET_STREAM);
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 1) {
+    unsigned char buf = 1;
+    mozquic_start_new_stream(&state.stream, param, &buf, 1, 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    mozquic_stream_t *stream = param;
+    test_assert(stream != state.stream);
+    unsigned char buf[5000];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(stream, buf, sizeof(buf), &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    if (!read && !fin) {
+      return MOZQUIC_OK;
+    }
+
+    unsigned char *data = buf;
+    int idx;
+    for (idx = 0; idx < 4; idx++) {
+      if (state.streams[idx] == stream) {
+        break;
+      }
+    }
+    if (idx == 4) {
+      // the first byte says which stream this is
+      test_assert(read);
+      test_assert(buf[0] >= 1 && buf[0] <= 4);
+      idx = buf[0] - 1;
+      test_assert(!state.streams[idx]);
+      state.streams[idx] = stream;
+      data++;
+      read--;
+    }
+
+    for (uint32_t i = 0; i < read; i++) {
+      test_assert(data[i] == idx + 1);
+    }
+    state.ctr[idx] += read;
+    test_assert(state.ctr[idx] <= 50000);
+    if (fin) {
+      test_assert(state.ctr[idx] == 50000);
+      for (int i = 0; i < 4; i++) {
+        test_assert(state.streams[i] != NULL);
+      }
+      state.done++;
+      fprintf(stderr,"test17 stream %d done (%d %d %d %d)\n", idx,
+              state.ctr[0], state.ctr[1], state.ctr[2], state.ctr[3]);
+      if (state.done == 4) {
+        mozquic_destroy_connection(parentConnection);
+        fprintf(stderr,"exit ok\n");
+        exit(0);
+      }
+    }
+  }
+
+  return MOZQUIC_OK;
+}
@@ -0,0 +1,80 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test18 both ends seal and open packets on crypto workers. The
+// client sends 300000 bytes of (offset % 251) and a fin, the server
+// checks them and answers with 200000 bytes of (offset % 253) and a fin.
+
+#include "qdrive-common.h"
+#include <stdio.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  uint32_t ctr;
+  mozquic_stream_t *stream;
+} state;
+
+void *testGetClosure18()
+{
+  return &state;
+}
+
+void testConfig18(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+  test_assert(mozquic_unstable_api1(_c, "cryptoWorkers", 2, 0) == MOZQUIC_OK);
+}
+
+int testEvent18(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_CLOSE_CONNECTION);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 1) {
+    static unsigned char buf[300000];
+    for (int i = 0; i < sizeof(buf); i++) {
+      buf[i] = i % 251;
+    }
+    mozquic_start_new_stream(&state.stream, param, NULL, 0, 0);
+    test_assert(state.stream != NULL);
+    test_assert(mozquic_send(state.stream, buf, sizeof(buf), 1) == MOZQUIC_OK);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    test_assert(param == state.stream);
+    unsigned char buf[4000];
+    uint32_t read = 0;
+    int fin = 0;
+    do {
+      uint32_t code = mozquic_recv(state.stream, buf, sizeof(buf), &read, &fin);
+      test_assert(code == MOZQUIC_OK);
+      for (uint32_t i = 0; i < read; i++) {
+        test_assert(buf[i] == ((state.ctr + i) % 253));
+      }
+      state.ctr += read;
+    } while (read && !fin);
+    test_assert(state.ctr <= 200000);
+    if (fin) {
+      test_assert(state.ctr == 200000);
+      mozquic_destroy_connection(parentConnection);
+      fprintf(stderr,"exit ok\n");
+      exit(0);
+    }
+  }
+
+  return MOZQUIC_OK;
+}
@@ -0,0 +1,69 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test19 the server drives its handshakes on a worker pool. The
+// client connects, sends 5 bytes and a fin, and waits for the server's
+// 5 byte reply and fin.
+
+#include "qdrive-common.h"
+#include <stdio.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  uint32_t ctr;
+  mozquic_stream_t *stream;
+} state;
+
+void *testGetClosure19()
+{
+  return &state;
+}
+
+void testConfig19(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+}
+
+int testEvent19(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_CLOSE_CONNECTION);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 1) {
+    mozquic_start_new_stream(&state.stream, param, "hello", 5, 1);
+    test_assert(state.stream != NULL);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    test_assert(param == state.stream);
+    unsigned char buf[5];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(state.stream, buf, sizeof(buf) - state.ctr, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(!memcmp(buf, "world" + state.ctr, read));
+    state.ctr += read;
+    if (fin) {
+      test_assert(state.ctr == 5);
+      mozquic_destroy_connection(parentConnection);
+      fprintf(stderr,"exit ok\n");
+      exit(0);
+    }
+  }
+
+  return MOZQUIC_OK;
+}
@@ -0,0 +1,113 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test20 session resumption. The client connects and waits for
+// the server's session ticket to land in the ticket cache, round trips
+// the cache through export/import, and then makes a second connection
+// to the same server which must resume. On the resumed connection it
+// sends 5 bytes and a fin, and waits for the server's reply so both ends
+// have seen the handshake finish.
+
+#include "qdrive-common.h"
+#include <stdio.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  struct mozquic_config_t config;
+  mozquic_connection_t *second;
+  struct mozquic_ticket_stats before;
+  uint32_t ctr;
+} state;
+
+void *testGetClosure20()
+{
+  return &state;
+}
+
+void testConfig20(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+  memcpy(&state.config, _c, sizeof(state.config));
+}
+
+int testEvent20(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_CLOSE_CONNECTION);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+
+  if (event == MOZQUIC_EVENT_CONNECTED && param == parentConnection) {
+    test_assert(state.state == 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 1) {
+    uint32_t used = 0;
+    test_assert(mozquic_ticket_cache_export(NULL, 0, &used) != MOZQUIC_OK);
+    if (!used) {
+      return MOZQUIC_OK; // no ticket yet
+    }
+    unsigned char *buf = malloc(used);
+    uint32_t used2 = 0;
+    test_assert(mozquic_ticket_cache_export(buf, used, &used2) == MOZQUIC_OK);
+    test_assert(used2 == used);
+    test_assert(mozquic_ticket_cache_import(buf, used) == MOZQUIC_OK);
+    test_assert(mozquic_ticket_cache_import(buf, used - 1) != MOZQUIC_OK);
+    free(buf);
+
+    test_assert(mozquic_ticket_stats(&state.before) == MOZQUIC_OK);
+    test_assert(state.before.clientHandshakes >= 1);
+    mozquic_new_connection(&state.second, &state.config);
+    test_assert(state.second != NULL);
+    mozquic_set_event_callback(state.second, testEvent20);
+    mozquic_set_event_callback_closure(state.second, &state);
+    test_assert(mozquic_start_client(state.second) == MOZQUIC_OK);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state >= 2 && event == MOZQUIC_EVENT_IO && param == parentConnection) {
+    mozquic_IO(state.second);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED && param == state.second) {
+    test_assert(state.state == 2);
+    struct mozquic_ticket_stats after;
+    test_assert(mozquic_ticket_stats(&after) == MOZQUIC_OK);
+    test_assert(after.clientHandshakes == state.before.clientHandshakes + 1);
+    test_assert(after.clientOffered == state.before.clientOffered + 1);
+    test_assert(after.clientResumed == state.before.clientResumed + 1);
+    mozquic_stream_t *stream;
+    test_assert(mozquic_start_new_stream(&stream, state.second, "hello", 5, 1) == MOZQUIC_OK);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 3);
+    mozquic_stream_t *stream = param;
+    unsigned char buf[5];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(stream, buf, sizeof(buf) - state.ctr, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(!memcmp(buf, "world" + state.ctr, read));
+    state.ctr += read;
+    if (!fin) {
+      return MOZQUIC_OK;
+    }
+    test_assert(state.ctr == 5);
+    mozquic_destroy_connection(state.second);
+    mozquic_destroy_connection(parentConnection);
+    fprintf(stderr,"exit ok\n");
+    exit(0);
+  }
+
+  return MOZQUIC_OK;
+}
@@ -0,0 +1,111 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test21 0-RTT. The client connects once to get a session ticket,
+// waits out the server's anti-replay window, and then opens a second
+// connection with "hello" already written to a stream - before the
+// handshake has started - which the server must get as early data.
+// The ticket stats must show the early data was sent and accepted.
+
+#include "qdrive-common.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+static struct closure
+{
+  int state;
+  struct mozquic_config_t config;
+  struct timeval connected;
+  mozquic_connection_t *second;
+  mozquic_stream_t *stream;
+  int ctr;
+  struct mozquic_ticket_stats before;
+} state;
+
+void *testGetClosure21()
+{
+  return &state;
+}
+
+void testConfig21(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+  test_assert(mozquic_unstable_api1(_c, "enable0RTT", 1, 0) == MOZQUIC_OK);
+  memcpy(&state.config, _c, sizeof(state.config));
+}
+
+int testEvent21(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_CLOSE_CONNECTION);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+
+  if (event == MOZQUIC_EVENT_CONNECTED && param == parentConnection) {
+    test_assert(state.state == 0);
+    gettimeofday(&state.connected, NULL);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 1) {
+    uint32_t used = 0;
+    mozquic_ticket_cache_export(NULL, 0, &used);
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long elapsed = (now.tv_sec - state.connected.tv_sec) * 1000 +
+      (now.tv_usec - state.connected.tv_usec) / 1000;
+    if (!used || elapsed < 1500) {
+      return MOZQUIC_OK; // no ticket yet, or the server still refuses early data
+    }
+
+    test_assert(mozquic_ticket_stats(&state.before) == MOZQUIC_OK);
+    mozquic_new_connection(&state.second, &state.config);
+    test_assert(state.second != NULL);
+    mozquic_set_event_callback(state.second, testEvent21);
+    mozquic_set_event_callback_closure(state.second, &state);
+    test_assert(mozquic_start_client(state.second) == MOZQUIC_OK);
+    mozquic_start_new_stream(&state.stream, state.second, "hello", 5, 1);
+    test_assert(state.stream != NULL);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 2 && event == MOZQUIC_EVENT_IO && param == parentConnection) {
+    mozquic_IO(state.second);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED && param == state.second) {
+    test_assert(state.state == 2);
+    struct mozquic_ticket_stats after;
+    test_assert(mozquic_ticket_stats(&after) == MOZQUIC_OK);
+    test_assert(after.clientResumed == state.before.clientResumed + 1);
+    test_assert(after.clientEarlySent == state.before.clientEarlySent + 1);
+    test_assert(after.clientEarlyAccepted == state.before.clientEarlyAccepted + 1);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    test_assert(param == state.stream);
+    unsigned char buf[5];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(state.stream, buf, sizeof(buf) - state.ctr, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(!memcmp(buf, "world" + state.ctr, read));
+    state.ctr += read;
+    if (fin) {
+      test_assert(state.ctr == 5);
+      mozquic_destroy_connection(state.second);
+      mozquic_destroy_connection(parentConnection);
+      fprintf(stderr,"exit ok\n");
+      exit(0);
+    }
+  }
+
+  return MOZQUIC_OK;
+}
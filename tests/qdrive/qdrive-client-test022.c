@@ -0,0 +1,88 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test22 address tokens. The client connects to a server that
+// forces address validation, which costs a stateless retry. That
+// handshake leaves an address token behind and a second connection to
+// the same server offers it. The server checks it skipped the retry.
+// The second connection then sends 5 bytes and a fin and waits for the
+// server's 5 byte reply and fin, so the server sees it connect.
+
+#include "qdrive-common.h"
+#include <stdio.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  struct mozquic_config_t config;
+  mozquic_connection_t *second;
+  mozquic_stream_t *stream;
+  uint32_t ctr;
+} state;
+
+void *testGetClosure22()
+{
+  return &state;
+}
+
+void testConfig22(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+  memcpy(&state.config, _c, sizeof(state.config));
+}
+
+int testEvent22(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_CLOSE_CONNECTION);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+
+  if (event == MOZQUIC_EVENT_CONNECTED && param == parentConnection) {
+    // the token came with the server transport parameters
+    test_assert(state.state == 0);
+    mozquic_new_connection(&state.second, &state.config);
+    test_assert(state.second != NULL);
+    mozquic_set_event_callback(state.second, testEvent22);
+    mozquic_set_event_callback_closure(state.second, &state);
+    test_assert(mozquic_start_client(state.second) == MOZQUIC_OK);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state >= 1 && event == MOZQUIC_EVENT_IO && param == parentConnection) {
+    mozquic_IO(state.second);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED && param == state.second) {
+    test_assert(state.state == 1);
+    test_assert(mozquic_start_new_stream(&state.stream, state.second,
+                                         "hello", 5, 1) == MOZQUIC_OK);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    test_assert(param == state.stream);
+    unsigned char buf[5];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(state.stream, buf, sizeof(buf) - state.ctr, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(!memcmp(buf, "world" + state.ctr, read));
+    state.ctr += read;
+    if (fin) {
+      test_assert(state.ctr == 5);
+      mozquic_destroy_connection(state.second);
+      mozquic_destroy_connection(parentConnection);
+      fprintf(stderr,"exit ok\n");
+      exit(0);
+    }
+  }
+
+  return MOZQUIC_OK;
+}
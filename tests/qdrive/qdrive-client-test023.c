@@ -0,0 +1,104 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test23 stateless retry under load. The client makes three
+// connections at once to a server that allows two new ones a second.
+// All three must connect - the server retries the third. Each one then
+// sends 5 bytes and a fin and waits for the server's 5 byte reply, so
+// the client only exits once the server has connected all three.
+
+#include "qdrive-common.h"
+#include <stdio.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  int connected;
+  int replied;
+  struct mozquic_config_t config;
+  mozquic_connection_t *more[2];
+  mozquic_stream_t *streams[3];
+  uint32_t ctr[3];
+} state;
+
+void *testGetClosure23()
+{
+  return &state;
+}
+
+void testConfig23(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+  memcpy(&state.config, _c, sizeof(state.config));
+}
+
+int testEvent23(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_CLOSE_CONNECTION);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+
+  if (state.state == 0 && event == MOZQUIC_EVENT_IO && param == parentConnection) {
+    for (int i = 0; i < 2; i++) {
+      mozquic_new_connection(&state.more[i], &state.config);
+      test_assert(state.more[i] != NULL);
+      mozquic_set_event_callback(state.more[i], testEvent23);
+      mozquic_set_event_callback_closure(state.more[i], &state);
+      test_assert(mozquic_start_client(state.more[i]) == MOZQUIC_OK);
+    }
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 1 && event == MOZQUIC_EVENT_IO && param == parentConnection) {
+    mozquic_IO(state.more[0]);
+    mozquic_IO(state.more[1]);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 1);
+    test_assert(state.connected < 3);
+    test_assert(mozquic_start_new_stream(&state.streams[state.connected], param,
+                                         "hello", 5, 1) == MOZQUIC_OK);
+    state.connected++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    int idx;
+    for (idx = 0; idx < state.connected; idx++) {
+      if (state.streams[idx] == param) {
+        break;
+      }
+    }
+    test_assert(idx < state.connected);
+    unsigned char buf[5];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(param, buf, sizeof(buf) - state.ctr[idx], &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(!memcmp(buf, "world" + state.ctr[idx], read));
+    state.ctr[idx] += read;
+    if (!fin) {
+      return MOZQUIC_OK;
+    }
+    test_assert(state.ctr[idx] == 5);
+    // the stream may be freed now, and a later one can reuse its address
+    state.streams[idx] = NULL;
+    state.replied++;
+    if (state.replied == 3) {
+      mozquic_destroy_connection(state.more[0]);
+      mozquic_destroy_connection(state.more[1]);
+      mozquic_destroy_connection(parentConnection);
+      fprintf(stderr,"exit ok\n");
+      exit(0);
+    }
+    return MOZQUIC_OK;
+  }
+
+  return MOZQUIC_OK;
+}
@@ -0,0 +1,103 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test24 rejected 0-RTT. Like test21, but the second connection
+// is made as soon as the ticket arrives - inside the server's anti-replay
+// window - so the server refuses the early data. The "hello" written
+// before the handshake must be sent again once connected.
+
+#include "qdrive-common.h"
+#include <stdio.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  struct mozquic_config_t config;
+  mozquic_connection_t *second;
+  mozquic_stream_t *stream;
+  int ctr;
+  struct mozquic_ticket_stats before;
+} state;
+
+void *testGetClosure24()
+{
+  return &state;
+}
+
+void testConfig24(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+  test_assert(mozquic_unstable_api1(_c, "enable0RTT", 1, 0) == MOZQUIC_OK);
+  memcpy(&state.config, _c, sizeof(state.config));
+}
+
+int testEvent24(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_CLOSE_CONNECTION);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+
+  if (event == MOZQUIC_EVENT_CONNECTED && param == parentConnection) {
+    test_assert(state.state == 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 1) {
+    uint32_t used = 0;
+    mozquic_ticket_cache_export(NULL, 0, &used);
+    if (!used) {
+      return MOZQUIC_OK; // no ticket yet
+    }
+
+    test_assert(mozquic_ticket_stats(&state.before) == MOZQUIC_OK);
+    mozquic_new_connection(&state.second, &state.config);
+    test_assert(state.second != NULL);
+    mozquic_set_event_callback(state.second, testEvent24);
+    mozquic_set_event_callback_closure(state.second, &state);
+    test_assert(mozquic_start_client(state.second) == MOZQUIC_OK);
+    mozquic_start_new_stream(&state.stream, state.second, "hello", 5, 1);
+    test_assert(state.stream != NULL);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 2 && event == MOZQUIC_EVENT_IO && param == parentConnection) {
+    mozquic_IO(state.second);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED && param == state.second) {
+    test_assert(state.state == 2);
+    struct mozquic_ticket_stats after;
+    test_assert(mozquic_ticket_stats(&after) == MOZQUIC_OK);
+    test_assert(after.clientResumed == state.before.clientResumed + 1);
+    test_assert(after.clientEarlySent == state.before.clientEarlySent + 1);
+    test_assert(after.clientEarlyAccepted == state.before.clientEarlyAccepted);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    test_assert(param == state.stream);
+    unsigned char buf[5];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(state.stream, buf, sizeof(buf) - state.ctr, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(!memcmp(buf, "world" + state.ctr, read));
+    state.ctr += read;
+    if (fin) {
+      test_assert(state.ctr == 5);
+      mozquic_destroy_connection(state.second);
+      mozquic_destroy_connection(parentConnection);
+      fprintf(stderr,"exit ok\n");
+      exit(0);
+    }
+  }
+
+  return MOZQUIC_OK;
+}
@@ -16,13 +16,17 @@
 
 TEST_EXPORT(0)  TEST_EXPORT(1)  TEST_EXPORT(2)  TEST_EXPORT(3)  TEST_EXPORT(4)
 TEST_EXPORT(5)  TEST_EXPORT(6)  TEST_EXPORT(7)  TEST_EXPORT(8)  TEST_EXPORT(9)
-TEST_EXPORT(10)
+TEST_EXPORT(10) TEST_EXPORT(11) TEST_EXPORT(12) TEST_EXPORT(13) TEST_EXPORT(14)
+TEST_EXPORT(15) TEST_EXPORT(16) TEST_EXPORT(17) TEST_EXPORT(18) TEST_EXPORT(19) TEST_EXPORT(20)
+TEST_EXPORT(21) TEST_EXPORT(22) TEST_EXPORT(23) TEST_EXPORT(24) TEST_EXPORT(25) TEST_EXPORT(26)
 
 struct testParam testList[] =
 {
   TEST_PARAMS(0),  TEST_PARAMS(1),  TEST_PARAMS(2),  TEST_PARAMS(3),  TEST_PARAMS(4),
   TEST_PARAMS(5),  TEST_PARAMS(6),  TEST_PARAMS(7),  TEST_PARAMS(8),  TEST_PARAMS(9),
-  TEST_PARAMS(10),
+  TEST_PARAMS(10), TEST_PARAMS(11), TEST_PARAMS(12), TEST_PARAMS(13), TEST_PARAMS(14),
+  TEST_PARAMS(15), TEST_PARAMS(16), TEST_PARAMS(17), TEST_PARAMS(18), TEST_PARAMS(19), TEST_PARAMS(20),
+  TEST_PARAMS(21), TEST_PARAMS(22), TEST_PARAMS(23), TEST_PARAMS(24), TEST_PARAMS(25), TEST_PARAMS(26),
 
   { NULL, NULL, NULL, NULL } // eof sentinel
 };
@@ -0,0 +1,87 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test12 the client opens a stream and the server answers it
+// with 64000 bytes and a fin. The client reads it all with the zero
+// copy mozquic_recv_peek / mozquic_recv_consume interface, consuming
+// it in odd sized pieces and checking every byte in place.
+
+#include "qdrive-common.h"
+#include "string.h"
+
+static struct closure
+{
+  int state;
+  mozquic_connection_t *child;
+  mozquic_stream_t *stream;
+} state;
+
+void testConfig12(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+}
+
+void *testGetClosure12()
+{
+  return &state;
+}
+
+int testEvent12(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+  test_assert(event != MOZQUIC_EVENT_RESET_STREAM);
+
+  if (event == MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION) {
+    test_assert(state.state == 0);
+    state.state++;
+    state.child = (mozquic_connection_t *) param;
+    mozquic_set_event_callback(state.child, testEvent12);
+    mozquic_set_event_callback_closure(state.child, &state);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 1);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    mozquic_stream_t *stream = param;
+    char buf[1024];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(stream, buf, 1024, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(!fin);
+    test_assert(read == 1);
+    test_assert(buf[0] == 1);
+    state.stream = stream;
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 3) {
+    // 4 separate writes, the last with the fin
+    unsigned char buf[16000];
+    for (int j = 0; j < 4; j++) {
+      for (int i = 0; i < sizeof(buf); i++) {
+        buf[i] = ((j * sizeof(buf)) + i) % 251;
+      }
+      int code = mozquic_send(state.stream, buf, sizeof(buf), j == 3);
+      test_assert(code == MOZQUIC_OK);
+    }
+    state.state++;
+  }
+
+  if (event == MOZQUIC_EVENT_CLOSE_CONNECTION) {
+    test_assert(state.state == 4);
+    exit (0);
+  }
+
+  return MOZQUIC_OK;
+}
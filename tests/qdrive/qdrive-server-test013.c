@@ -0,0 +1,116 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test13 the client opens a stream and the server answers it
+// with 64000 bytes from a static buffer using mozquic_send_zc in 4
+// pieces. 3 of them have a release callback, the last one is returned
+// with MOZQUIC_EVENT_RELEASE_BUFFER. Once all 4 have been released
+// (i.e. acked) the server ends the stream, and the client checks that
+// it got all the data followed by the fin.
+
+#include "qdrive-common.h"
+#include "string.h"
+
+static unsigned char sendBuffer13[64000];
+
+static struct closure
+{
+  int state;
+  int released;
+  mozquic_connection_t *child;
+  mozquic_stream_t *stream;
+} state;
+
+void testConfig13(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+  for (int i = 0; i < sizeof(sendBuffer13); i++) {
+    sendBuffer13[i] = i % 251;
+  }
+}
+
+void *testGetClosure13()
+{
+  return &state;
+}
+
+static void checkRelease13(void *cookie, const void *data, uint32_t len)
+{
+  long piece = (long) cookie;
+  test_assert(piece >= 0 && piece < 4);
+  test_assert(data == sendBuffer13 + (piece * 16000));
+  test_assert(len == 16000);
+  test_assert(!(state.released & (1 << piece)));
+  state.released |= 1 << piece;
+}
+
+int testEvent13(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+  test_assert(event != MOZQUIC_EVENT_RESET_STREAM);
+
+  if (event == MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION) {
+    test_assert(state.state == 0);
+    state.state++;
+    state.child = (mozquic_connection_t *) param;
+    mozquic_set_event_callback(state.child, testEvent13);
+    mozquic_set_event_callback_closure(state.child, &state);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 1);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    mozquic_stream_t *stream = param;
+    char buf[1024];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(stream, buf, 1024, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(!fin);
+    test_assert(read == 1);
+    test_assert(buf[0] == 1);
+    state.stream = stream;
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_RELEASE_BUFFER) {
+    test_assert(state.state == 4);
+    struct mozquic_eventdata_release *release = param;
+    checkRelease13(release->cookie, release->data, release->len);
+    test_assert(release->cookie == (void *)3);
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 3) {
+    for (long j = 0; j < 4; j++) {
+      int code = mozquic_send_zc(state.stream, sendBuffer13 + (j * 16000), 16000, 0,
+                                 j == 3 ? NULL : checkRelease13, (void *)j);
+      test_assert(code == MOZQUIC_OK);
+    }
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (state.state == 4 && state.released == 0xf) {
+    // everything has been acked - nothing is referenced anymore
+    test_assert(mozquic_end_stream(state.stream) == MOZQUIC_OK);
+    state.state++;
+  }
+
+  if (event == MOZQUIC_EVENT_CLOSE_CONNECTION) {
+    test_assert(state.state == 5);
+    exit (0);
+  }
+
+  return MOZQUIC_OK;
+}
@@ -0,0 +1,100 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test14 the client sends a request made of a header, a body
+// and a trailer with one mozquic_sendv and a fin. The server gathers it
+// with mozquic_recvv into 3 buffers of unrelated sizes, checks it, and
+// answers with a 2 piece mozquic_sendv that the client reads with
+// mozquic_recvv.
+
+#include "qdrive-common.h"
+#include "string.h"
+
+static struct closure
+{
+  int state;
+  uint32_t ctr;
+  mozquic_connection_t *child;
+  mozquic_stream_t *stream;
+} state;
+
+void testConfig14(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+}
+
+void *testGetClosure14()
+{
+  return &state;
+}
+
+int testEvent14(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+  test_assert(event != MOZQUIC_EVENT_RESET_STREAM);
+
+  if (event == MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION) {
+    test_assert(state.state == 0);
+    state.state++;
+    state.child = (mozquic_connection_t *) param;
+    mozquic_set_event_callback(state.child, testEvent14);
+    mozquic_set_event_callback_closure(state.child, &state);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 1);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    mozquic_stream_t *stream = param;
+    test_assert(!state.stream || state.stream == stream);
+    state.stream = stream;
+
+    unsigned char a[33], b[2000], c[10000];
+    struct mozquic_iovec iov[3];
+    iov[0].data = a;
+    iov[0].len = sizeof(a);
+    iov[1].data = b;
+    iov[1].len = sizeof(b);
+    iov[2].data = c;
+    iov[2].len = sizeof(c);
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recvv(stream, iov, 3, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    for (uint32_t i = 0; i < read; i++) {
+      unsigned char v = (i < sizeof(a)) ? a[i] :
+        (i < sizeof(a) + sizeof(b)) ? b[i - sizeof(a)] : c[i - sizeof(a) - sizeof(b)];
+      test_assert(v == ((state.ctr + i) % 251));
+    }
+    state.ctr += read;
+    test_assert(state.ctr <= 5150);
+    if (!fin) {
+      return MOZQUIC_OK;
+    }
+    test_assert(state.ctr == 5150);
+
+    struct mozquic_iovec reply[2];
+    reply[0].data = "abcd";
+    reply[0].len = 4;
+    reply[1].data = "efgh";
+    reply[1].len = 4;
+    test_assert(mozquic_sendv(stream, reply, 2, 1) == MOZQUIC_OK);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CLOSE_CONNECTION) {
+    test_assert(state.state == 3);
+    exit (0);
+  }
+
+  return MOZQUIC_OK;
+}
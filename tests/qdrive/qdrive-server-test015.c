@@ -0,0 +1,94 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test15 the client opens a stream and the server writes a
+// 150000 byte temp file and answers with bytes [1000, 101000) of it
+// using mozquic_send_file with fin. The server closes its own fd right
+// away. The client checks the data and the fin.
+
+#include "qdrive-common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static struct closure
+{
+  int state;
+  mozquic_connection_t *child;
+} state;
+
+void testConfig15(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+}
+
+void *testGetClosure15()
+{
+  return &state;
+}
+
+static int makeFile15()
+{
+  char name[] = "/tmp/qdrive-test15-XXXXXX";
+  int fd = mkstemp(name);
+  test_assert(fd >= 0);
+  unlink(name);
+  unsigned char buf[1000];
+  for (int i = 0; i < 150; i++) {
+    for (int j = 0; j < 1000; j++) {
+      buf[j] = (i * 1000 + j) % 251;
+    }
+    test_assert(write(fd, buf, 1000) == 1000);
+  }
+  return fd;
+}
+
+int testEvent15(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+  test_assert(event != MOZQUIC_EVENT_RESET_STREAM);
+
+  if (event == MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION) {
+    test_assert(state.state == 0);
+    state.state++;
+    state.child = (mozquic_connection_t *) param;
+    mozquic_set_event_callback(state.child, testEvent15);
+    mozquic_set_event_callback_closure(state.child, &state);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 1);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    mozquic_stream_t *stream = param;
+    char buf[1024];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(stream, buf, 1024, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(!fin);
+    test_assert(read == 1);
+    test_assert(buf[0] == 1);
+
+    int fd = makeFile15();
+    test_assert(mozquic_send_file(stream, fd, 1000, 100000, 1) == MOZQUIC_OK);
+    close(fd);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CLOSE_CONNECTION) {
+    test_assert(state.state == 3);
+    exit (0);
+  }
+
+  return MOZQUIC_OK;
+}
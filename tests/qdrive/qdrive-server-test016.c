@@ -0,0 +1,89 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test16 the client opens a stream to say go. The server then
+// opens a bulk stream at urgency 7 and writes 200000 bytes to it, and
+// after that opens an urgent stream at urgency 0 and writes 1000 bytes
+// and a fin to it. The client checks that the urgent stream is complete
+// before the bulk stream is.
+
+#include "qdrive-common.h"
+#include <stdlib.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  mozquic_connection_t *child;
+} state;
+
+static unsigned char bulk16[200000];
+
+void testConfig16(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+}
+
+void *testGetClosure16()
+{
+  return &state;
+}
+
+int testEvent16(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+  test_assert(event != MOZQUIC_EVENT_RESET_STREAM);
+
+  if (event == MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION) {
+    test_assert(state.state == 0);
+    state.state++;
+    state.child = (mozquic_connection_t *) param;
+    mozquic_set_event_callback(state.child, testEvent16);
+    mozquic_set_event_callback_closure(state.child, &state);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 1);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    mozquic_stream_t *stream = param;
+    char buf[1024];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(stream, buf, 1024, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(read == 1);
+    test_assert(buf[0] == 1);
+
+    mozquic_stream_t *bulk, *urgent;
+    unsigned char tag = 1;
+    test_assert(mozquic_start_new_stream(&bulk, state.child, &tag, 1, 0) == MOZQUIC_OK);
+    test_assert(mozquic_set_stream_priority(bulk, 8, 0) == MOZQUIC_ERR_INVALID);
+    test_assert(mozquic_set_stream_priority(bulk, 7, 0) == MOZQUIC_OK);
+    memset(bulk16, 1, sizeof(bulk16));
+    test_assert(mozquic_send(bulk, bulk16, sizeof(bulk16), 1) == MOZQUIC_OK);
+
+    tag = 2;
+    test_assert(mozquic_start_new_stream(&urgent, state.child, &tag, 1, 0) == MOZQUIC_OK);
+    test_assert(mozquic_set_stream_priority(urgent, 0, 1) == MOZQUIC_OK);
+    memset(buf, 2, sizeof(buf));
+    test_assert(mozquic_send(urgent, buf, 1000, 1) == MOZQUIC_OK);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CLOSE_CONNECTION) {
+    test_assert(state.state == 3);
+    exit (0);
+  }
+
+  return MOZQUIC_OK;
+}
@@ -0,0 +1,82 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test17 the client opens a stream to say go. The server then
+// opens 4 streams at the default priority, one after the other, and
+// writes 50000 bytes and a fin to each. The client checks that every
+// stream has started before any of them is complete - i.e. the first
+// stream written does not drain before the others get a turn.
+
+#include "qdrive-common.h"
+#include <stdlib.h>
+#include <string.h>
+
+static struct closure
+{
+  int state;
+  mozquic_connection_t *child;
+} state;
+
+static unsigned char data17[50000];
+
+void testConfig17(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+}
+
+void *testGetClosure17()
+{
+  return &state;
+}
+
+int testEvent17(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+  test_assert(event != MOZQUIC_EVENT_RESET_STREAM);
+
+  if (event == MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION) {
+    test_assert(state.state == 0);
+    state.state++;
+    state.child = (mozquic_connection_t *) param;
+    mozquic_set_event_callback(state.child, testEvent17);
+    mozquic_set_event_callback_closure(state.child, &state);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 1);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    mozquic_stream_t *stream = param;
+    char buf[1024];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(stream, buf, 1024, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(read == 1);
+    test_assert(buf[0] == 1);
+
+    for (unsigned char tag = 1; tag <= 4; tag++) {
+      mozquic_stream_t *s;
+      test_assert(mozquic_start_new_stream(&s, state.child, &tag, 1, 0) == MOZQUIC_OK);
+      memset(data17, tag, sizeof(data17));
+      test_assert(mozquic_send(s, data17, sizeof(data17), 1) == MOZQUIC_OK);
+    }
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CLOSE_CONNECTION) {
+    test_assert(state.state == 3);
+    exit (0);
+  }
+
+  return MOZQUIC_OK;
+}
@@ -0,0 +1,91 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test18 both ends seal and open packets on crypto workers. The
+// client sends 300000 bytes of (offset % 251) and a fin, the server
+// checks them and answers with 200000 bytes of (offset % 253) and a fin.
+
+#include "qdrive-common.h"
+#include "string.h"
+
+static struct closure
+{
+  int state;
+  uint32_t ctr;
+  mozquic_connection_t *child;
+  mozquic_stream_t *stream;
+} state;
+
+void testConfig18(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+  test_assert(mozquic_unstable_api1(_c, "cryptoWorkers", 3, 0) == MOZQUIC_OK);
+}
+
+void *testGetClosure18()
+{
+  return &state;
+}
+
+int testEvent18(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+  test_assert(event != MOZQUIC_EVENT_RESET_STREAM);
+
+  if (event == MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION) {
+    test_assert(state.state == 0);
+    state.state++;
+    state.child = (mozquic_connection_t *) param;
+    mozquic_set_event_callback(state.child, testEvent18);
+    mozquic_set_event_callback_closure(state.child, &state);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 1);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    mozquic_stream_t *stream = param;
+    test_assert(!state.stream || state.stream == stream);
+    state.stream = stream;
+
+    unsigned char buf[4000];
+    uint32_t read = 0;
+    int fin = 0;
+    do {
+      uint32_t code = mozquic_recv(stream, buf, sizeof(buf), &read, &fin);
+      test_assert(code == MOZQUIC_OK);
+      for (uint32_t i = 0; i < read; i++) {
+        test_assert(buf[i] == ((state.ctr + i) % 251));
+      }
+      state.ctr += read;
+    } while (read && !fin);
+    test_assert(state.ctr <= 300000);
+    if (!fin) {
+      return MOZQUIC_OK;
+    }
+    test_assert(state.ctr == 300000);
+
+    static unsigned char reply[200000];
+    for (int i = 0; i < sizeof(reply); i++) {
+      reply[i] = i % 253;
+    }
+    test_assert(mozquic_send(stream, reply, sizeof(reply), 1) == MOZQUIC_OK);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CLOSE_CONNECTION) {
+    test_assert(state.state == 3);
+    exit (0);
+  }
+
+  return MOZQUIC_OK;
+}
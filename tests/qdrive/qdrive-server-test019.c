@@ -0,0 +1,82 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test19 the server drives its handshakes on a worker pool. The
+// client connects, sends 5 bytes and a fin, and waits for the server's
+// 5 byte reply and fin. The server checks the handshake did run on a
+// worker.
+
+#include "qdrive-common.h"
+#include "string.h"
+
+static struct closure
+{
+  int state;
+  uint32_t ctr;
+  mozquic_connection_t *child;
+} state;
+
+void testConfig19(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+  test_assert(mozquic_unstable_api1(_c, "handshakeWorkers", 2, 0) == MOZQUIC_OK);
+}
+
+void *testGetClosure19()
+{
+  return &state;
+}
+
+int testEvent19(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+  test_assert(event != MOZQUIC_EVENT_RESET_STREAM);
+
+  if (event == MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION) {
+    test_assert(state.state == 0);
+    state.state++;
+    state.child = (mozquic_connection_t *) param;
+    mozquic_set_event_callback(state.child, testEvent19);
+    mozquic_set_event_callback_closure(state.child, &state);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    test_assert(state.state == 1);
+    test_assert(param == state.child);
+    struct mozquic_worker_stats stats;
+    test_assert(mozquic_worker_stats(&stats) == MOZQUIC_OK);
+    test_assert(stats.handshakes > 0);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.state == 2);
+    mozquic_stream_t *stream = param;
+    unsigned char buf[5];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(stream, buf, sizeof(buf) - state.ctr, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(!memcmp(buf, "hello" + state.ctr, read));
+    state.ctr += read;
+    if (!fin) {
+      return MOZQUIC_OK;
+    }
+    test_assert(state.ctr == 5);
+    test_assert(mozquic_send(stream, "world", 5, 1) == MOZQUIC_OK);
+    state.state++;
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CLOSE_CONNECTION) {
+    test_assert(state.state == 3);
+    exit (0);
+  }
+
+  return MOZQUIC_OK;
+}
@@ -0,0 +1,84 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test20 session resumption. The client connects twice and the
+// second handshake must resume with the ticket from the first. The
+// client then sends 5 bytes and a fin on the resumed connection and waits
+// for the server's 5 byte reply and fin.
+
+#include "qdrive-common.h"
+#include "string.h"
+
+static struct closure
+{
+  int accepted;
+  int connected;
+  uint32_t ctr;
+  struct mozquic_ticket_stats before;
+} state;
+
+void testConfig20(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+}
+
+void *testGetClosure20()
+{
+  return &state;
+}
+
+int testEvent20(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+  test_assert(event != MOZQUIC_EVENT_ERROR);
+
+  if (event == MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION) {
+    test_assert(state.accepted == state.connected);
+    state.accepted++;
+    mozquic_set_event_callback(param, testEvent20);
+    mozquic_set_event_callback_closure(param, &state);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    state.connected++;
+    test_assert(state.connected == state.accepted);
+    if (state.connected == 1) {
+      test_assert(mozquic_ticket_stats(&state.before) == MOZQUIC_OK);
+    } else {
+      test_assert(state.connected == 2);
+      struct mozquic_ticket_stats after;
+      test_assert(mozquic_ticket_stats(&after) == MOZQUIC_OK);
+      test_assert(after.serverHandshakes == state.before.serverHandshakes + 1);
+      test_assert(after.serverResumed == state.before.serverResumed + 1);
+    }
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.connected == 2);
+    mozquic_stream_t *stream = param;
+    unsigned char buf[5];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(stream, buf, sizeof(buf) - state.ctr, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(!memcmp(buf, "hello" + state.ctr, read));
+    state.ctr += read;
+    if (fin) {
+      test_assert(state.ctr == 5);
+      test_assert(mozquic_send(stream, "world", 5, 1) == MOZQUIC_OK);
+    }
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CLOSE_CONNECTION) {
+    test_assert(state.connected == 2);
+    test_assert(state.ctr == 5);
+    exit (0);
+  }
+
+  return MOZQUIC_OK;
+}
@@ -0,0 +1,89 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test22 address tokens. The server forces address validation.
+// The first connection gets a stateless retry (the error from the
+// abandoned child) and the second one, offering the token it was given,
+// must connect without one. It then sends 5 bytes and a fin and gets a
+// 5 byte reply and fin.
+
+#include "qdrive-common.h"
+#include "string.h"
+
+static struct closure
+{
+  int accepted;
+  int retried;
+  int connected;
+  uint32_t ctr;
+  int replied;
+} state;
+
+void testConfig22(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+  test_assert(mozquic_unstable_api1(_c, "forceAddressValidation", 1, 0) == MOZQUIC_OK);
+}
+
+void *testGetClosure22()
+{
+  return &state;
+}
+
+int testEvent22(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+
+  if (event == MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION) {
+    state.accepted++;
+    test_assert(state.accepted <= 3);
+    mozquic_set_event_callback(param, testEvent22);
+    mozquic_set_event_callback_closure(param, &state);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_ERROR) {
+    // the hrr abort. only the first connection has one
+    test_assert(state.connected == 0);
+    state.retried++;
+    test_assert(state.retried == 1);
+    // the library frees the child once this returns
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    state.connected++;
+    test_assert(state.retried == 1);
+    test_assert(state.accepted == state.connected + 1);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    test_assert(state.connected == 2);
+    mozquic_stream_t *stream = param;
+    unsigned char buf[5];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(stream, buf, sizeof(buf) - state.ctr, &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    test_assert(!memcmp(buf, "hello" + state.ctr, read));
+    state.ctr += read;
+    if (fin) {
+      test_assert(state.ctr == 5);
+      test_assert(mozquic_send(stream, "world", 5, 1) == MOZQUIC_OK);
+      state.replied = 1;
+    }
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CLOSE_CONNECTION) {
+    test_assert(state.connected >= 1);
+    if (state.replied) {
+      exit (0);
+    }
+  }
+
+  return MOZQUIC_OK;
+}
@@ -0,0 +1,89 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test23 stateless retry under load. Address validation is not
+// forced but goes on above two new connections a second. Of the three
+// the client makes at once only the third gets a stateless retry (the
+// error from the abandoned child) and all three connect. Each
+// connection then gets 5 bytes and a fin, and replies with 5 bytes and a
+// fin of its own.
+
+#include "qdrive-common.h"
+#include "string.h"
+
+static struct closure
+{
+  int accepted;
+  int retried;
+  int connected;
+  int replied;
+} state;
+
+void testConfig23(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+  test_assert(mozquic_unstable_api1(_c, "addressValidationThreshold", 0, 2) == MOZQUIC_OK);
+}
+
+void *testGetClosure23()
+{
+  return &state;
+}
+
+int testEvent23(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+
+  if (event == MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION) {
+    state.accepted++;
+    test_assert(state.accepted <= 4);
+    mozquic_set_event_callback(param, testEvent23);
+    mozquic_set_event_callback_closure(param, &state);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_ERROR) {
+    // the hrr abort
+    state.retried++;
+    test_assert(state.retried == 1);
+    test_assert(state.accepted == 3);
+    mozquic_destroy_connection(param);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    state.connected++;
+    test_assert(state.connected <= 3);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    // each stream's 5 bytes arrive in one piece
+    unsigned char buf[5];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(param, buf, sizeof(buf), &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    if (!fin) {
+      test_assert(!read);
+      return MOZQUIC_OK;
+    }
+    test_assert(read == 5);
+    test_assert(!memcmp(buf, "hello", 5));
+    state.replied++;
+    test_assert(state.replied <= state.connected);
+    test_assert(mozquic_send(param, "world", 5, 1) == MOZQUIC_OK);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CLOSE_CONNECTION) {
+    test_assert(state.connected == 3);
+    test_assert(state.replied == 3);
+    test_assert(state.retried == 1);
+    exit (0);
+  }
+
+  return MOZQUIC_OK;
+}
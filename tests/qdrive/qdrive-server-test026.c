@@ -0,0 +1,105 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// -qdrive-test26 retried children are freed. The server forces address
+// validation and the client makes four connections at once, so each one
+// gets a stateless retry (the error from the abandoned child) and comes
+// back as a new connection. The abandoned children must not stay behind:
+// at every server IO its children are the connected ones plus those
+// still in their handshake, and once all four have connected and
+// exchanged 5 bytes each way there are four.
+
+#include "qdrive-common.h"
+#include "string.h"
+
+static struct closure
+{
+  mozquic_connection_t *server;
+  int accepted;
+  int retried;
+  int connected;
+  int replied;
+} state;
+
+void testConfig26(struct mozquic_config_t *_c)
+{
+  memset(&state, 0, sizeof(state));
+  test_assert(mozquic_unstable_api1(_c, "forceAddressValidation", 1, 0) == MOZQUIC_OK);
+}
+
+void *testGetClosure26()
+{
+  return &state;
+}
+
+int testEvent26(void *closure, uint32_t event, void *param)
+{
+  test_assert(closure == &state);
+
+  if (event == MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION) {
+    state.accepted++;
+    mozquic_set_event_callback(param, testEvent26);
+    mozquic_set_event_callback_closure(param, &state);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_ERROR) {
+    // the hrr abort. the library frees the child once this returns
+    state.retried++;
+    test_assert(state.retried <= state.accepted - state.connected);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CONNECTED) {
+    state.connected++;
+    test_assert(state.connected <= 4);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_IO) {
+    struct mozquic_server_stats stats;
+    if (mozquic_server_stats(param, &stats) != MOZQUIC_OK) {
+      return MOZQUIC_OK; // a child
+    }
+    state.server = param;
+    test_assert(stats.children == state.connected + stats.halfOpen);
+    test_assert(stats.children <= 4);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_NEW_STREAM_DATA) {
+    // each stream's 5 bytes arrive in one piece
+    unsigned char buf[5];
+    uint32_t read = 0;
+    int fin = 0;
+    uint32_t code = mozquic_recv(param, buf, sizeof(buf), &read, &fin);
+    test_assert(code == MOZQUIC_OK);
+    if (!fin) {
+      test_assert(!read);
+      return MOZQUIC_OK;
+    }
+    test_assert(read == 5);
+    test_assert(!memcmp(buf, "hello", 5));
+    state.replied++;
+    test_assert(state.replied <= state.connected);
+    test_assert(mozquic_send(param, "world", 5, 1) == MOZQUIC_OK);
+    return MOZQUIC_OK;
+  }
+
+  if (event == MOZQUIC_EVENT_CLOSE_CONNECTION) {
+    struct mozquic_server_stats stats;
+    test_assert(state.server);
+    test_assert(mozquic_server_stats(state.server, &stats) == MOZQUIC_OK);
+    test_assert(state.connected == 4);
+    test_assert(state.replied == 4);
+    test_assert(state.retried >= 4);
+    test_assert(state.accepted == state.retried + 4);
+    test_assert(stats.children == 4);
+    test_assert(stats.halfOpen == 0);
+    exit (0);
+  }
+
+  return MOZQUIC_OK;
+}